@@ -38,6 +38,57 @@
 //
 // Command line options:
 // To run the program with no turbulence, pass 'noTurbulence' on the command line.
+// To export the turbulence velocity field, pass 'exportVolume=<directory>'; optionally
+// with 'exportEvery=<frames>', 'exportStride=<cells>', 'exportChunk=<cells>' and
+// 'exportRoi=x0,y0,z0,x1,y1,z1' (grid cells, end exclusive).
+// To keep the CPU particles sorted by grid cell, pass 'mortonReorder[=<frames>]' (implies
+// cpuParticles, sorts every 10 frames by default); 'outputOrder=id' still writes them in
+// emission order, the default 'outputOrder=storage' in the order they are stored.
+// To measure the CPU particle step with and without the reordering, pass 'benchmarkMorton'.
+// To simulate the particles on the CPU instead of with the APEX IOS, pass
+// 'cpuParticles[=<max particles>]' (default 65536); the turbulence field is copied from the
+// actor every frame and carries them inside the turbulence grid.
+// To carry the CPU particles with a sparse, brick-allocated grid covering the whole domain
+// instead, pass 'sparseGrid[=<cell size>]' (implies cpuParticles); 'sparseIdle=<frames>' sets
+// how long unused bricks are kept.  The grid follows the turbulence field inside the
+// turbulence grid and the external velocity outside of it.
+// To publish the sprites of every frame to other processes through shared memory, pass
+// 'shm=<name>' (with 'shmSlots=<frames>' and 'shmMaxSprites=<count>'); run another instance
+// with 'consumeShm=<name>' to read them.
+// To hold a frame time budget by adjusting the LOD budget and emission, pass
+// 'targetFrameMs=<ms>' (for example 16.6), optionally with 'lodHysteresis=<fraction>'.
+// To spawn from several pooled emitters instead of one, pass 'emitters=<count>'; pass
+// 'benchmarkEmitters' to measure how the per-frame emitter work scales with the count.
+// To keep the simulation off CUDA entirely, pass 'device=cpu'; the default 'device=gpu'
+// uses CUDA when available.  Turbulence needs CUDA and is skipped on the CPU.
+// To let particles collide with static geometry, pass 'collider=<file.obj>' (repeatable);
+// cooked meshes are cached in 'meshCache=<directory>' (default cookedMeshes).
+// To write only the sprites a camera sees, back to front, pass 'camera[=ex,ey,ez,tx,ty,tz]'
+// (eye and target), optionally with 'fov=<degrees>', 'viewport=<w>x<h>' and 'clip=<near>,<far>'.
+// To split the domain between processes, pass 'ranks=<count>'; the first process launches
+// the others and each simulates the CPU particles (implied) in one slab of
+// 'slabDomain=<min>,<max>' (default 0,16) along the external velocity, handing particles
+// that cross over to its neighbours.  Not with 'sparseGrid' or 'targetFrameMs'.
+// To extract the particles in separate regions, concurrently, pass 'renderTiles=<nx>,<ny>,<nz>';
+// the tiles cover the turbulence grid or 'renderDomain=x0,y0,z0,x1,y1,z1', and the particles
+// outside of them form one more region.  With 'shm=<name>' every region is also published to
+// its own ring, '<name>.tile<i>' or '<name>.outside', for consumers of a single region.
+// To watch a running simulation, pass 'metrics[=<port>]' (default 9464) and scrape
+// http://127.0.0.1:<port>/metrics (Prometheus text format); 'frames=<count>' runs longer.
+// To blow a procedural wind, combine any of 'windCurl=<amplitude>[,<feature size>[,<speed>]]',
+// 'windVortex=cx,cy,cz,<speed>,<radius>' (repeatable, vertical axis) and
+// 'windShear=vx,vy,vz,gx,gy,gz' (v + g * height).  The field is cached every frame on a grid
+// of 'windCells=<n>' (default 32) nodes a side over the turbulence box.  Particles leave
+// the emitters with the wind; with 'cpuParticles' they keep feeling it in flight, otherwise
+// the turbulence actor gets its mean as an external velocity.
+// Startup is timed step by step and reported after the first frame.  To only load what
+// the options call for, pass 'lazyStartup': no CUDA probe or TurbulenceFS with
+// 'noTurbulence', and the Legacy module only if an asset needs upgrading.
+//
+// Logging:
+// Output from the render callbacks and the frame loop goes through an asynchronous logger.
+// Build with APP_LOG_LEVEL set to APP_LOG_LEVEL_WARN (or higher) to compile out the
+// per-frame and per-sprite messages entirely.
 //
 // Prerequisites: 
 // This program is intended to work on windows with PhysX 3.x
@@ -51,6 +102,11 @@
 #include <PxScene.h>
 #include <common/PxTolerancesScale.h>
 #include <cooking/PxCooking.h>
+#include <PxRigidStatic.h>
+#include <PxMaterial.h>
+#include <geometry/PxTriangleMesh.h>
+#include <geometry/PxTriangleMeshGeometry.h>
+#include <extensions/PxDefaultStreams.h>
 #include <pxtask/PxCudaContextManager.h>
 #include <extensions/PxDefaultCpuDispatcher.h>
 #include <extensions/PxDefaultSimulationFilterShader.h>
@@ -79,12 +135,16 @@
 // This program only works on windows with PhysX 3.2
 #if defined(PX_WINDOWS) && NX_SDK_VERSION_MAJOR == 3
 
-// Needed for the WinMain
+// Needed for the WinMain, winsock2 has to come first or windows.h pulls in the old winsock
+#include <winsock2.h>
 #include <windows.h>
 
 // Utility includes
 #include <string>
 #include <list>
+#include <vector>
+#include <algorithm>
+#include <emmintrin.h>
 
 // a small helper method for all those times we need to release and clear
 template <class T>
@@ -136,804 +196,7408 @@ using namespace physx;
 using namespace physx::apex;
 using namespace physx::general_PxIOStream2;
 
-// An allocator callback for APEX and PhysX
-class AppAlloc : public PxAllocatorCallback
+// A QueryPerformanceCounter stopwatch
+class AppTimer
 {
-	// PhysX3 PxAllocatorCallback interface
-	void* allocate(size_t size, const char* /*typeName*/, const char* /*filename*/, int /*line*/)
+public:
+	AppTimer()
 	{
-		return ::_aligned_malloc(size, 16);
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		mTicksToMs = 1000.0 / frequency.QuadPart;
+		reset();
 	}
 
-	void deallocate(void* ptr)
+	void reset()
 	{
-		return ::_aligned_free(ptr);
+		QueryPerformanceCounter(&mStart);
 	}
-};
 
-// An error callback for APEX and PhysX
-class AppErrorCallback : public PxErrorCallback
-{
-	// PhysX3 foundation PxErrorCallback interface
-	void reportError(PxErrorCode::Enum code, const char* message, const char* file, int line)
+	double elapsedMs() const
 	{
-		printf("ErrorCallback in file: %s(%i):\n%s\n", file, line, message);
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		return (now.QuadPart - mStart.QuadPart) * mTicksToMs;
 	}
 
+private:
+	LARGE_INTEGER	mStart;
+	double			mTicksToMs;
 };
 
-class DummyMaterial
-{};
-
-// A resource callback for APEX (APEX will ask for assets, materials, etc through this interface)
-class AppApexResourceCallback : public NxResourceCallback
+// Times the steps of starting up, until the first frame has run.  Steps are recorded as
+// they finish, skipped ones are listed with the reason, so a lazy start shows what it saved.
+class AppStartupProfiler
 {
 public:
-	AppApexResourceCallback::AppApexResourceCallback()
-		: mApexSDK(NULL)
+	AppStartupProfiler()
+		: mTotalMs(0.0)
+	{}
+
+	void record(const char* name, double ms)
 	{
-		mPathToMedia[0] = 0;
+		Step step = { name, ms, NULL };
+		mSteps.push_back(step);
 	}
 
-	void setApexSDK(NxApexSDK * apexSDK)
+	void skip(const char* name, const char* reason)
 	{
-		mApexSDK = apexSDK;
+		Step step = { name, 0.0, reason };
+		mSteps.push_back(step);
 	}
 
-	// This method is intended to find the specified path (in this case "media") in 
-	// a folder above the current folder.
-	// It will typically leave something like "../../../../../media" in the outBuffer
-	bool searchForPath(const char* path, char* outBuffer, int outBufferSize, int maxRecursion)
+	// stops the clock, startup is over
+	void finish()
 	{
-		char* tmpBuffer = (char*)alloca(outBufferSize);
-		strcpy_s(outBuffer, outBufferSize, path);
-		for(int i = 0; i < maxRecursion; i++)
+		if (!isFinished())
 		{
-			if(GetFileAttributes(outBuffer) == INVALID_FILE_ATTRIBUTES)
-			{
-				sprintf_s(tmpBuffer, outBufferSize, "../%s", outBuffer);
-				strcpy_s(outBuffer, outBufferSize, tmpBuffer);
-			}
-			else 
-				return true;
+			mTotalMs = mTimer.elapsedMs();
 		}
-		return false;
 	}
 
-	// This method is called by APEX to retrieve resources
-	void* requestResource(const char* nameSpace, const char* name)
+	bool isFinished() const
 	{
-		ConsoleTextColor consoleColor(FOREGROUND_GREEN);
-		if(!mApexSDK)
+		return mTotalMs > 0.0;
+	}
+
+	void print() const
+	{
+		printf("Startup, %.2f ms to the end of the first frame:\n", mTotalMs);
+		for (PxU32 i = 0; i < mSteps.size(); i++)
 		{
-			return NULL;
+			if (mSteps[i].skipped)
+			{
+				printf("  %-26s skipped, %s\n", mSteps[i].name, mSteps[i].skipped);
+			}
+			else
+			{
+				printf("  %-26s %9.2f ms\n", mSteps[i].name, mSteps[i].ms);
+			}
 		}
+	}
 
-		printf("requestResource called for <%s> %s\n", nameSpace, name);
+private:
+	struct Step
+	{
+		const char*	name;
+		double		ms;
+		const char*	skipped;	// the reason, NULL when the step ran
+	};
 
-		if (!strcmp(nameSpace, APEX_MATERIALS_NAME_SPACE))
+	AppTimer			mTimer;
+	std::vector<Step>	mSteps;
+	double				mTotalMs;
+};
+
+// Log levels, lowest first.  Calls below APP_LOG_LEVEL compile to nothing, arguments
+// included, so they can stay in the hot paths.
+#define APP_LOG_LEVEL_DEBUG		0
+#define APP_LOG_LEVEL_INFO		1
+#define APP_LOG_LEVEL_WARN		2
+#define APP_LOG_LEVEL_ERROR		3
+
+#ifndef APP_LOG_LEVEL
+#define APP_LOG_LEVEL			APP_LOG_LEVEL_INFO
+#endif
+
+// A log record as it sits in a thread's buffer: the format string, which must be a string
+// literal, and the raw arguments.  Formatting happens later on the logger thread.
+struct AppLogRecord
+{
+	static const PxU32 MAX_ARGS = 8;
+	static const PxU32 TEXT_SIZE = 96;
+
+	enum ArgType
+	{
+		ARG_INT,
+		ARG_UINT,
+		ARG_DOUBLE,
+		ARG_STRING,		// offset into text
+		ARG_POINTER
+	};
+
+	union Arg
+	{
+		PxI64		i;
+		PxU64		u;
+		PxF64		d;
+		const void*	p;
+	};
+
+	LONGLONG	timestamp;
+	const char*	format;
+	DWORD		threadId;
+	WORD		color;			// console attributes, 0 for the default color
+	PxU8		level;
+	PxU8		argCount;
+	PxU8		argTypes[MAX_ARGS];
+	PxU8		textUsed;
+	Arg			args[MAX_ARGS];
+	char		text[TEXT_SIZE];	// copies of the string arguments
+
+	void pack(int v)				{ packInt(v); }
+	void pack(long v)				{ packInt(v); }
+	void pack(long long v)			{ packInt(v); }
+	void pack(unsigned int v)		{ packUint(v); }
+	void pack(unsigned long v)		{ packUint(v); }
+	void pack(unsigned long long v)	{ packUint(v); }
+	void pack(double v)				{ if (argCount < MAX_ARGS) { argTypes[argCount] = ARG_DOUBLE; args[argCount++].d = v; } }
+	void pack(const void* v)		{ if (argCount < MAX_ARGS) { argTypes[argCount] = ARG_POINTER; args[argCount++].p = v; } }
+	void pack(char* v)				{ pack(const_cast<const char*>(v)); }
+	void pack(const char* v)
+	{
+		if (argCount < MAX_ARGS)
 		{
-			return &material;
+			argTypes[argCount] = ARG_STRING;
+			if (textUsed == TEXT_SIZE)
+			{
+				// the text is full, its last byte ends the previous string and reads as empty
+				args[argCount++].u = TEXT_SIZE - 1;
+				return;
+			}
+			args[argCount++].u = textUsed;
+			const char* src = v ? v : "(null)";
+			while (*src && textUsed < TEXT_SIZE - 1)
+			{
+				text[textUsed++] = *src++;
+			}
+			text[textUsed++] = 0;
 		}
-		// These strings should be pulled from the module headers
-		else if (!strcmp(nameSpace, NX_APEX_EMITTER_AUTHORING_TYPE_NAME) ||
-			!strcmp(nameSpace, NX_IOFX_AUTHORING_TYPE_NAME) ||
-			!strcmp(nameSpace, NX_BASIC_IOS_AUTHORING_TYPE_NAME) ||
-			!strcmp(nameSpace, NX_TURBULENCE_FS_AUTHORING_TYPE_NAME))
+	}
+
+	void packInt(PxI64 v)	{ if (argCount < MAX_ARGS) { argTypes[argCount] = ARG_INT; args[argCount++].i = v; } }
+	void packUint(PxU64 v)	{ if (argCount < MAX_ARGS) { argTypes[argCount] = ARG_UINT; args[argCount++].u = v; } }
+
+	// Formats the record like printf would have.  Length modifiers in the format are
+	// ignored since every argument was widened to 64 bits when it was packed.
+	void formatTo(char* out, size_t size) const
+	{
+		const char* f = format;
+		size_t len = 0;
+		PxU32 arg = 0;
+		while (*f && len + 1 < size)
 		{
-			// find the path to the APEX media folder
-			if (mPathToMedia[0] == 0)
+			if (*f != '%' || f[1] == '%')
 			{
-				if (!searchForPath("media", mPathToMedia, sizeof(mPathToMedia), 20))
-				{
-					printf("Error: requestResources cannot find the media folder\n");
-					return NULL;
-				}
+				out[len++] = *f;
+				f += *f == '%' ? 2 : 1;
+				continue;
 			}
 
-			// make a file stream for the asset file
-			std::string filename;
-			filename += mPathToMedia;
-			filename += ASSET_PATH_UNDER_MEDIA;
-			filename += "/MinimalTurbulence/";
-			filename += name;
-			filename += ".apx";
-			PxFileBuf* fileStream = mApexSDK->createStream(filename.c_str(), PxFileBuf::OPEN_READ_ONLY);
-			if(!fileStream->isOpen())
+			char spec[32];
+			PxU32 n = 0;
+			spec[n++] = *f++;
+			while (*f && strchr("-+ #0123456789.", *f) && n < sizeof(spec) - 4)
 			{
-				printf("Error: requestResources failed to open %s\n", filename.c_str());
-				return NULL;
+				spec[n++] = *f++;
 			}
-
-			// deserialize the asset into an NxParameterized object
-			NxParameterized::Traits* traits = mApexSDK->getParameterizedTraits();
-			NxParameterized::Serializer* serializer = mApexSDK->createSerializer(NxParameterized::Serializer::NST_XML, traits);
-			
-			NxParameterized::Serializer::DeserializedData deserializedData;
-			serializer->deserialize(*fileStream, deserializedData);
-			if (1 != deserializedData.size())
+			while (*f && (strchr("lhzjtLq", *f) || !strncmp(f, "I64", 3) || !strncmp(f, "I32", 3)))
 			{
-				printf("Error: requestResources found %i objects in %s\n", deserializedData.size(), filename.c_str());
-				return NULL;
+				f += *f == 'I' ? 3 : 1;
 			}
-
-			NxApexAsset* asset = mApexSDK->createAsset(deserializedData[0], name);
-			if (!asset)
+			char conversion = *f;
+			if (!conversion)
 			{
-				printf("Error: requestResources failed to create asset from %s\n", filename.c_str());
-				return NULL;
+				break;
+			}
+			f++;
+
+			int written = 0;
+			size_t room = size - len;
+			const Arg* a = arg < argCount ? &args[arg] : NULL;
+			PxU8 type = a ? argTypes[arg] : PxU8(ARG_INT);
+			arg++;
+			switch (conversion)
+			{
+			case 'd': case 'i':
+				spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = 'd'; spec[n] = 0;
+				written = _snprintf_s(out + len, room, _TRUNCATE, spec, a ? (type == ARG_DOUBLE ? PxI64(a->d) : a->i) : 0LL);
+				break;
+			case 'u': case 'x': case 'X': case 'o': case 'c':
+				if (conversion != 'c')
+				{
+					spec[n++] = 'l'; spec[n++] = 'l';
+				}
+				spec[n++] = conversion; spec[n] = 0;
+				written = conversion == 'c'
+					? _snprintf_s(out + len, room, _TRUNCATE, spec, a ? int(a->i) : 0)
+					: _snprintf_s(out + len, room, _TRUNCATE, spec, a ? (type == ARG_DOUBLE ? PxU64(a->d) : a->u) : 0ULL);
+				break;
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+				spec[n++] = conversion; spec[n] = 0;
+				written = _snprintf_s(out + len, room, _TRUNCATE, spec, a ? (type == ARG_DOUBLE ? a->d : PxF64(a->i)) : 0.0);
+				break;
+			case 's':
+				spec[n++] = 's'; spec[n] = 0;
+				written = _snprintf_s(out + len, room, _TRUNCATE, spec, a && type == ARG_STRING ? &text[a->u] : "(?)");
+				break;
+			case 'p':
+				spec[n++] = 'p'; spec[n] = 0;
+				written = _snprintf_s(out + len, room, _TRUNCATE, spec, a ? a->p : NULL);
+				break;
+			default:
+				break;
 			}
+			len = written < 0 ? size - 1 : len + written;
+		}
+		out[PxMin(len, size - 1)] = 0;
+	}
+};
 
-			return asset;
+// Allows at most maxPerSecond messages per second from one call site and counts the rest.
+// Used as a function local static, so it has no constructor and starts out zeroed.
+struct AppLogRateLimiter
+{
+	volatile LONGLONG	windowStart;
+	volatile LONG		count;
+	volatile LONG		suppressed;
+
+	bool allow(LONG maxPerSecond, PxU32& suppressedBefore)
+	{
+		LARGE_INTEGER now, frequency;
+		QueryPerformanceCounter(&now);
+		QueryPerformanceFrequency(&frequency);
+		suppressedBefore = 0;
+		if (now.QuadPart - windowStart >= frequency.QuadPart)
+		{
+			InterlockedExchange64(&windowStart, now.QuadPart);
+			InterlockedExchange(&count, 0);
+			suppressedBefore = PxU32(InterlockedExchange(&suppressed, 0));
 		}
-		else
+		if (InterlockedIncrement(&count) <= maxPerSecond)
 		{
-			printf("requestResource: <%s> %s\n", nameSpace, name);
+			return true;
 		}
+		InterlockedIncrement(&suppressed);
+		return false;
+	}
+};
 
-		return NULL;
+// An asynchronous logger.  Every thread appends binary records to its own single producer,
+// single consumer ring, without locks or system calls; a background thread collects the
+// rings, orders the records by time, formats them and writes them out, changing the console
+// color only when it differs from the previous record.  The particle positions logged are
+// the program's output, so nothing is dropped: when a thread's ring is full the thread waits
+// for the logger to catch up.  Before start() (and after stop()) records are formatted and
+// printed right away.
+class AppLog
+{
+public:
+	// Starts the logger for the lifetime of the object
+	class Session
+	{
+	public:
+		Session()	{ AppLog::start(); }
+		~Session()	{ AppLog::stop(); }
+	};
+
+	static void start()
+	{
+		if (sThread)
+		{
+			return;
+		}
+
+		CONSOLE_SCREEN_BUFFER_INFO info;
+		sDefaultColor = GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &info) ? info.wAttributes : WORD(FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
+		InitializeCriticalSection(&sDrainLock);
+		sQuit = 0;
+		sWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		sThread = CreateThread(NULL, 0, loggerThreadMain, NULL, 0, NULL);
 	}
 
-	void releaseResource(const char* nameSpace, const char* name, void* resource)
+	static void stop()
 	{
-		ConsoleTextColor consoleColor(FOREGROUND_GREEN);
-		if(!mApexSDK)
+		if (!sThread)
 		{
 			return;
 		}
-		
-		printf("releaseResources called for <%s> %s\n", nameSpace, name);
 
-		if (!strcmp(nameSpace, NX_APEX_EMITTER_AUTHORING_TYPE_NAME) ||
-			!strcmp(nameSpace, NX_IOFX_AUTHORING_TYPE_NAME) ||
-			!strcmp(nameSpace, NX_BASIC_IOS_AUTHORING_TYPE_NAME) ||
-			!strcmp(nameSpace, NX_TURBULENCE_FS_AUTHORING_TYPE_NAME))
+		InterlockedExchange(&sQuit, 1);
+		SetEvent(sWakeEvent);
+		WaitForSingleObject(sThread, INFINITE);
+		CloseHandle(sThread);
+		CloseHandle(sWakeEvent);
+		sThread = NULL;
+		sWakeEvent = NULL;
+		DeleteCriticalSection(&sDrainLock);
+
+		// no thread may log while the logger stops; threads that log after a restart see the
+		// new generation and get a new buffer
+		PxU32 count = PxMin(PxU32(sBufferCount), MAX_THREADS);
+		sBufferCount = 0;
+		for (PxU32 i = 0; i < count; i++)
 		{
-			NxApexAsset* asset = reinterpret_cast<NxApexAsset*>(resource);
-			asset->release();
+			delete sBuffers[i];
+			sBuffers[i] = NULL;
 		}
+		InterlockedIncrement(&sGeneration);
 	}
 
-	NxApexSDK*	mApexSDK;
-	char		mPathToMedia[MAX_PATH];
-	DummyMaterial material;
-};
-
-// A callback sprite buffer class for APEX rendering
-class AppSpriteBuffer : public NxUserRenderSpriteBuffer
-{
-public:
-	AppSpriteBuffer() : mContextData(NULL)
-	{}
+	// Writes out everything logged so far before returning
+	static void flush()
+	{
+		if (sThread)
+		{
+			drain();
+		}
+	}
 
-	void writeBuffer(const void* data, physx::PxU32 firstSprite, physx::PxU32 numSprites)
+	// Records written but not printed yet, over every thread; only a snapshot
+	static PxU32 getQueueDepth()
 	{
-		ConsoleTextColor consoleColor(FOREGROUND_RED);
-		printf("writeBuffer called for %i sprites with ", numSprites - firstSprite);
-		
-		if (mContextData)
+		PxU32 depth = 0;
+		PxU32 count = PxMin(PxU32(sBufferCount), MAX_THREADS);
+		for (PxU32 i = 0; i < count; i++)
 		{
-			printf("this context: (%s)\n", mContextData);
+			const Buffer* buffer = sBuffers[i];
+			if (buffer)
+			{
+				// the tail read after the head may already be past it; a buffer never
+				// holds more than CAPACITY records
+				PxU32 head = buffer->head;
+				MemoryBarrier();
+				PxI32 queued = PxI32(head - buffer->tail);
+				depth += PxU32(PxClamp(queued, 0, PxI32(Buffer::CAPACITY)));
+			}
 		}
-		else
+		return depth;
+	}
+
+	template <typename... Args>
+	static void write(PxU32 level, WORD color, const char* format, Args... args)
+	{
+		Buffer* buffer = sThread ? threadBuffer() : NULL;
+		AppLogRecord local;
+		AppLogRecord* record = &local;
+		while (buffer && buffer->head - buffer->tail >= Buffer::CAPACITY)
 		{
-			printf("no context\n");
+			// full, wait for the logger to hand slots back; once it is quitting print directly
+			if (sQuit)
+			{
+				buffer = NULL;
+				break;
+			}
+			SetEvent(sWakeEvent);
+			SwitchToThread();
 		}
-		
-		/* print position from data */
-		if (firstSprite >= MAX_SPRITE_COUNT)
+		if (buffer)
 		{
-			printf("Warning, writeBuffer called with firstSprite = %d", firstSprite);
-			return;
+			record = &buffer->records[buffer->head & (Buffer::CAPACITY - 1)];
 		}
 
-		if ((firstSprite + numSprites) > MAX_SPRITE_COUNT)
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		record->timestamp = now.QuadPart;
+		record->format = format;
+		record->threadId = GetCurrentThreadId();
+		record->color = color;
+		record->level = PxU8(level);
+		record->argCount = 0;
+		record->textUsed = 0;
+		int expand[] = { 0, (record->pack(args), 0)... };
+		PX_UNUSED(expand);
+
+		if (buffer)
 		{
-			printf("Warning, writeBuffer called with %d sprites\n", numSprites);
-			numSprites = MAX_SPRITE_COUNT - firstSprite;
+			// publish the record only once it is complete
+			MemoryBarrier();
+			buffer->head++;
 		}
-
-		SpriteData* spriteBuffer = &mSpriteData[firstSprite];
-		memcpy(spriteBuffer, data, numSprites*sizeof(SpriteData));
-		printf("Position Data: \n");
-		for (physx::PxU32 i = 0; i < numSprites; i++)
+		else
 		{
-			const PxVec3& pos = spriteBuffer[i].position;
-			printf(" (%.1f, %.1f, %.1f)\n", pos.x, pos.y, pos.z);
+			char line[1024];
+			local.formatTo(line, sizeof(line));
+			fputs(line, stdout);
 		}
 	}
 
-	struct SpriteData
+private:
+	struct Buffer
 	{
-		PxVec3	position;
-		PxF32	lifeRemaining;
-	};
+		static const PxU32 CAPACITY = 1024;	// a power of two
 
-	static const PxU32	MAX_SPRITE_COUNT = 20;
-	SpriteData			mSpriteData[MAX_SPRITE_COUNT];
-	const char*			mContextData;
-};
+		Buffer() : head(0), tail(0) {}
 
-// A render resource callback class for APEX rendering
-class AppRenderResource : public NxUserRenderResource
-{
-public:
-	AppRenderResource::AppRenderResource()
-		: mSpriteBuffer(NULL)
-	{}
+		volatile PxU32	head;		// written by the owning thread only
+		volatile PxU32	tail;		// written by the logger thread only
+		AppLogRecord	records[CAPACITY];
+	};
 
-	/** \brief Set vertex buffer range */
-	virtual void setVertexBufferRange(physx::PxU32 firstVertex, physx::PxU32 numVerts) {}
-	/** \brief Set index buffer range */
-	virtual void setIndexBufferRange(physx::PxU32 firstIndex, physx::PxU32 numIndices) {}
-	/** \brief Set bone buffer range */
-	virtual void setBoneBufferRange(physx::PxU32 firstBone, physx::PxU32 numBones) {}
-	/** \brief Set instance buffer range */
-	virtual void setInstanceBufferRange(physx::PxU32 firstInstance, physx::PxU32 numInstances) {}
-	/** \brief Set sprite buffer range */
-	virtual void setSpriteBufferRange(physx::PxU32 firstSprite, physx::PxU32 numSprites) 
+	static const PxU32 MAX_THREADS = 64;
+	static const DWORD DRAIN_INTERVAL_MS = 2;
+
+	static Buffer* threadBuffer()
 	{
-		ConsoleTextColor consoleColor(FOREGROUND_RED | FOREGROUND_INTENSITY);
-		printf("setSpriteBufferRange: first(%i) count(%i)\n", firstSprite, numSprites);
+		if (!sThreadBuffer || sThreadGeneration != sGeneration)
+		{
+			sThreadBuffer = NULL;
+			sThreadGeneration = sGeneration;
+			LONG index = InterlockedIncrement(&sBufferCount) - 1;
+			if (index >= LONG(MAX_THREADS))
+			{
+				InterlockedDecrement(&sBufferCount);
+				return NULL;
+			}
+			sThreadBuffer = new Buffer;
+			MemoryBarrier();
+			sBuffers[index] = sThreadBuffer;
+		}
+		return sThreadBuffer;
 	}
 
-	/** \brief Set material */
-	virtual void setMaterial(void* material) 
-	{}
-
-	/** \brief Get number of vertex buffers */
-	virtual physx::PxU32				getNbVertexBuffers() const 
+	static bool isEarlier(const AppLogRecord* a, const AppLogRecord* b)
 	{
-		return 0;
+		return a->timestamp < b->timestamp;
 	}
-	/** \brief Get vertex buffer */
-	virtual NxUserRenderVertexBuffer*	getVertexBuffer(physx::PxU32 index) const 
+
+	static void drain()
 	{
-		return NULL;
+		EnterCriticalSection(&sDrainLock);
+
+		PxU32 heads[MAX_THREADS];
+		PxU32 count = PxMin(PxU32(sBufferCount), MAX_THREADS);
+		sBatch.clear();
+		for (PxU32 i = 0; i < count; i++)
+		{
+			Buffer* buffer = sBuffers[i];
+			if (!buffer)
+			{
+				heads[i] = 0;
+				continue;
+			}
+			heads[i] = buffer->head;
+			MemoryBarrier();
+			for (PxU32 t = buffer->tail; t != heads[i]; t++)
+			{
+				sBatch.push_back(&buffer->records[t & (Buffer::CAPACITY - 1)]);
+			}
+		}
+		std::stable_sort(sBatch.begin(), sBatch.end(), isEarlier);
+
+		HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+		WORD currentColor = sDefaultColor;
+		for (PxU32 r = 0; r < sBatch.size(); r++)
+		{
+			WORD color = sBatch[r]->color ? sBatch[r]->color : sDefaultColor;
+			if (color != currentColor)
+			{
+				fflush(stdout);
+				SetConsoleTextAttribute(console, color);
+				currentColor = color;
+			}
+			char line[1024];
+			sBatch[r]->formatTo(line, sizeof(line));
+			fputs(line, stdout);
+		}
+		fflush(stdout);
+		if (currentColor != sDefaultColor)
+		{
+			SetConsoleTextAttribute(console, sDefaultColor);
+		}
+
+		// hand the slots back to the producers
+		MemoryBarrier();
+		for (PxU32 i = 0; i < count; i++)
+		{
+			Buffer* buffer = sBuffers[i];
+			if (buffer)
+			{
+				buffer->tail = heads[i];
+			}
+		}
+
+		LeaveCriticalSection(&sDrainLock);
 	}
 
-	/** \brief Get index buffer */
-	virtual NxUserRenderIndexBuffer*	getIndexBuffer() const
+	static DWORD WINAPI loggerThreadMain(LPVOID /*param*/)
 	{
-		return NULL;
+		while (!sQuit)
+		{
+			WaitForSingleObject(sWakeEvent, DRAIN_INTERVAL_MS);
+			drain();
+		}
+		drain();
+		return 0;
 	}
 
-	/** \brief Get bone buffer */
-	virtual NxUserRenderBoneBuffer*		getBoneBuffer() const 
+	static HANDLE						sThread;
+	static HANDLE						sWakeEvent;
+	static volatile LONG				sQuit;
+	static CRITICAL_SECTION				sDrainLock;
+	static WORD							sDefaultColor;
+	static Buffer*						sBuffers[MAX_THREADS];
+	static volatile LONG				sBufferCount;
+	static volatile LONG				sGeneration;	// bumped when stop() frees the buffers
+	static std::vector<AppLogRecord*>	sBatch;
+	static __declspec(thread) Buffer*	sThreadBuffer;
+	static __declspec(thread) LONG		sThreadGeneration;
+};
+
+HANDLE						AppLog::sThread = NULL;
+HANDLE						AppLog::sWakeEvent = NULL;
+volatile LONG				AppLog::sQuit = 0;
+CRITICAL_SECTION			AppLog::sDrainLock;
+WORD						AppLog::sDefaultColor = 0;
+AppLog::Buffer*				AppLog::sBuffers[AppLog::MAX_THREADS];
+volatile LONG				AppLog::sBufferCount = 0;
+volatile LONG				AppLog::sGeneration = 0;
+std::vector<AppLogRecord*>	AppLog::sBatch;
+__declspec(thread) AppLog::Buffer*	AppLog::sThreadBuffer = NULL;
+__declspec(thread) LONG		AppLog::sThreadGeneration = 0;
+
+#if APP_LOG_LEVEL <= APP_LOG_LEVEL_DEBUG
+#define APP_LOG_DEBUG(color, ...)	AppLog::write(APP_LOG_LEVEL_DEBUG, color, __VA_ARGS__)
+#else
+#define APP_LOG_DEBUG(color, ...)	((void)0)
+#endif
+
+#if APP_LOG_LEVEL <= APP_LOG_LEVEL_INFO
+#define APP_LOG_INFO(color, ...)	AppLog::write(APP_LOG_LEVEL_INFO, color, __VA_ARGS__)
+#else
+#define APP_LOG_INFO(color, ...)	((void)0)
+#endif
+
+#if APP_LOG_LEVEL <= APP_LOG_LEVEL_WARN
+#define APP_LOG_WARN(color, ...)	AppLog::write(APP_LOG_LEVEL_WARN, color, __VA_ARGS__)
+// at most maxPerSecond warnings per second from this call site, the rest are counted
+#define APP_LOG_WARN_LIMITED(maxPerSecond, color, ...)										\
+	do																						\
+	{																						\
+		static AppLogRateLimiter appLogLimiter;												\
+		PxU32 appLogSuppressed;																\
+		if (appLogLimiter.allow(maxPerSecond, appLogSuppressed))							\
+		{																					\
+			if (appLogSuppressed)															\
+			{																				\
+				AppLog::write(APP_LOG_LEVEL_WARN, color, "(%u similar warnings suppressed)\n", appLogSuppressed);	\
+			}																				\
+			AppLog::write(APP_LOG_LEVEL_WARN, color, __VA_ARGS__);							\
+		}																					\
+	} while (0)
+#else
+#define APP_LOG_WARN(color, ...)					((void)0)
+#define APP_LOG_WARN_LIMITED(maxPerSecond, color, ...)	((void)0)
+#endif
+
+#if APP_LOG_LEVEL <= APP_LOG_LEVEL_ERROR
+#define APP_LOG_ERROR(color, ...)	AppLog::write(APP_LOG_LEVEL_ERROR, color, __VA_ARGS__)
+#else
+#define APP_LOG_ERROR(color, ...)	((void)0)
+#endif
+
+// The body of a parallel loop, called once per chunk of the index range
+class AppRangeBody
+{
+public:
+	virtual ~AppRangeBody() {}
+	virtual void run(PxU32 chunk, PxU32 begin, PxU32 end) = 0;
+};
+
+// A small pool of worker threads for the app's own data-parallel work.  PhysX and APEX
+// keep their CPU dispatcher to themselves; this pool runs what the app does around them.
+class AppWorkerPool
+{
+public:
+	// A unit of work; the submitter owns it and must keep it alive until it has run
+	class Job
 	{
-		return NULL;
-	}
+	public:
+		virtual ~Job() {}
+		virtual void execute() = 0;
+	};
 
-	/** \brief Get instance buffer */
-	virtual NxUserRenderInstanceBuffer*	getInstanceBuffer() const
+	AppWorkerPool()
+		: mSemaphore(NULL)
+		, mQuit(0)
 	{
-		return NULL;
+		InitializeCriticalSection(&mLock);
 	}
 
-	/** \brief Get sprite buffer */
-	virtual NxUserRenderSpriteBuffer*	getSpriteBuffer() const
+	~AppWorkerPool()
 	{
-		return mSpriteBuffer;
+		stop();
+		DeleteCriticalSection(&mLock);
 	}
 
-	// directly accessed by the Render Resource Manager
-	NxUserRenderSpriteBuffer*	mSpriteBuffer;
-};
+	// numWorkers == 0 picks one worker per core, less the calling thread
+	bool start(PxU32 numWorkers = 0)
+	{
+		if (numWorkers == 0)
+		{
+			SYSTEM_INFO info;
+			GetSystemInfo(&info);
+			numWorkers = PxMax(PxU32(info.dwNumberOfProcessors), 2u) - 1;
+		}
 
-// A render resource manager for APEX (APEX will create render buffers through this interface)
-class AppRenderResourceManager : public NxUserRenderResourceManager
-{
-public:
-	// We're not using vertex, index, bone, or instance buffers in this exercise
-	virtual NxUserRenderVertexBuffer*   createVertexBuffer(const NxUserRenderVertexBufferDesc& desc)     
+		mQuit = 0;
+		mSemaphore = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+		for (PxU32 i = 0; i < numWorkers; i++)
+		{
+			HANDLE thread = CreateThread(NULL, 0, workerThreadMain, this, 0, NULL);
+			if (!thread)
+			{
+				return false;
+			}
+			mThreads.push_back(thread);
+		}
+		return true;
+	}
+
+	void stop()
 	{
-		return NULL;
+		if (mThreads.empty())
+		{
+			return;
+		}
+
+		InterlockedExchange(&mQuit, 1);
+		ReleaseSemaphore(mSemaphore, LONG(mThreads.size()), NULL);
+		// one wait per thread, WaitForMultipleObjects takes at most MAXIMUM_WAIT_OBJECTS
+		for (PxU32 i = 0; i < mThreads.size(); i++)
+		{
+			if (WaitForSingleObject(mThreads[i], INFINITE) != WAIT_OBJECT_0)
+			{
+				APP_LOG_ERROR(0, "Error: waiting for worker %u failed (%u)\n", i, PxU32(GetLastError()));
+			}
+			CloseHandle(mThreads[i]);
+		}
+		mThreads.clear();
+		CloseHandle(mSemaphore);
+		mSemaphore = NULL;
 	}
-	virtual void                        releaseVertexBuffer(NxUserRenderVertexBuffer& buffer)            
-	{}
 
-	virtual NxUserRenderIndexBuffer*    createIndexBuffer(const NxUserRenderIndexBufferDesc& desc)       
+	PxU32 getWorkerCount() const
 	{
-		return NULL;
+		return PxU32(mThreads.size());
 	}
-	virtual void                        releaseIndexBuffer(NxUserRenderIndexBuffer& buffer)              
-	{}
 
-	virtual NxUserRenderBoneBuffer*     createBoneBuffer(const NxUserRenderBoneBufferDesc& desc)         
+	void submit(Job& job)
 	{
-		return NULL;
+		EnterCriticalSection(&mLock);
+		mQueue.push_back(&job);
+		LeaveCriticalSection(&mLock);
+		ReleaseSemaphore(mSemaphore, 1, NULL);
 	}
-	virtual void                        releaseBoneBuffer(NxUserRenderBoneBuffer& buffer)                
-	{}
 
-	virtual NxUserRenderInstanceBuffer* createInstanceBuffer(const NxUserRenderInstanceBufferDesc& desc) 
+	// A chunk size that gives every thread a few chunks to balance the load
+	PxU32 suggestChunkSize(PxU32 count, PxU32 minChunkSize) const
 	{
-		return NULL;
+		PxU32 numChunks = (getWorkerCount() + 1) * 4;
+		return PxMax((count + numChunks - 1) / numChunks, PxMax(minChunkSize, 1u));
 	}
-	virtual void                        releaseInstanceBuffer(NxUserRenderInstanceBuffer& buffer)        
-	{}
 
-	virtual NxUserRenderSurfaceBuffer* createSurfaceBuffer(const NxUserRenderSurfaceBufferDesc& desc) 
+	// Runs body over [0, count) in chunks of chunkSize on the workers and the calling
+	// thread, returning once every chunk has finished.  Chunk c covers
+	// [c * chunkSize, min((c + 1) * chunkSize, count)).
+	void parallelFor(PxU32 count, PxU32 chunkSize, AppRangeBody& body)
 	{
-		return NULL;
+		PxU32 numChunks = (count + chunkSize - 1) / chunkSize;
+		if (numChunks <= 1 || mThreads.empty())
+		{
+			for (PxU32 c = 0; c < numChunks; c++)
+			{
+				body.run(c, c * chunkSize, PxMin((c + 1) * chunkSize, count));
+			}
+			return;
+		}
+
+		// the loop state is reference counted because a worker may only get to its
+		// helper job after every chunk has already been claimed and this call returned
+		PxU32 numHelpers = PxMin(numChunks - 1, getWorkerCount());
+		ParallelForJob* job = new ParallelForJob(body, count, chunkSize, numChunks, numHelpers + 1);
+		for (PxU32 i = 0; i < numHelpers; i++)
+		{
+			submit(*job);
+		}
+		job->runChunks();
+		WaitForSingleObject(job->mDone, INFINITE);
+		job->release();
 	}
-	virtual void                        releaseSurfaceBuffer(NxUserRenderSurfaceBuffer& buffer)        
-	{}
 
-	// Just a predicate for removing the released buffers and resources from our stl lists
-	class AppMatchesRenderResource
+private:
+	class ParallelForJob : public Job
 	{
 	public:
-		AppMatchesRenderResource::AppMatchesRenderResource(NxUserRenderResource* rr)
-			: mToBeRemovedResource(rr)
+		ParallelForJob(AppRangeBody& body, PxU32 count, PxU32 chunkSize, PxU32 numChunks, PxU32 refs)
+			: mBody(body)
+			, mCount(count)
+			, mChunkSize(chunkSize)
+			, mNumChunks(numChunks)
+			, mNextChunk(0)
+			, mRemaining(LONG(numChunks))
+			, mRefs(LONG(refs))
+			, mDone(CreateEvent(NULL, TRUE, FALSE, NULL))
 		{}
 
-		bool operator() (const AppRenderResource& value)
+		~ParallelForJob()
 		{
-			const NxUserRenderResource* rr = reinterpret_cast<const NxUserRenderResource*>(&value);
-			return (rr == mToBeRemovedResource);
+			CloseHandle(mDone);
 		}
 
-		AppMatchesRenderResource::AppMatchesRenderResource(NxUserRenderSpriteBuffer* rr)
-			: mToBeRemovedSpriteBuffer(rr)
-		{}
+		void execute()
+		{
+			runChunks();
+			release();
+		}
 
-		bool operator() (const AppSpriteBuffer& value)
+		void runChunks()
 		{
-			const NxUserRenderSpriteBuffer* rr = reinterpret_cast<const NxUserRenderSpriteBuffer*>(&value);
-			return (rr == mToBeRemovedSpriteBuffer);
+			for (;;)
+			{
+				PxU32 c = PxU32(InterlockedIncrement(&mNextChunk) - 1);
+				if (c >= mNumChunks)
+				{
+					return;
+				}
+				mBody.run(c, c * mChunkSize, PxMin((c + 1) * mChunkSize, mCount));
+				if (InterlockedDecrement(&mRemaining) == 0)
+				{
+					SetEvent(mDone);
+				}
+			}
 		}
 
-		NxUserRenderResource*		mToBeRemovedResource;
-		NxUserRenderSpriteBuffer*	mToBeRemovedSpriteBuffer;
-	};
+		void release()
+		{
+			if (InterlockedDecrement(&mRefs) == 0)
+			{
+				delete this;
+			}
+		}
 
+		AppRangeBody&	mBody;
+		PxU32			mCount;
+		PxU32			mChunkSize;
+		PxU32			mNumChunks;
+		volatile LONG	mNextChunk;
+		volatile LONG	mRemaining;
+		volatile LONG	mRefs;
+		HANDLE			mDone;
+	};
 
-	virtual NxUserRenderSpriteBuffer*   createSpriteBuffer(const NxUserRenderSpriteBufferDesc& desc)     
+	static DWORD WINAPI workerThreadMain(LPVOID param)
 	{
-		ConsoleTextColor consoleColor(FOREGROUND_BLUE|FOREGROUND_RED);
-		printf("NxUserRenderResourceManager::createSpriteBuffer called\n");
-		mSpriteBufferList.push_back(AppSpriteBuffer());
-		return &(mSpriteBufferList.back());
+		AppWorkerPool* pool = static_cast<AppWorkerPool*>(param);
+		for (;;)
+		{
+			WaitForSingleObject(pool->mSemaphore, INFINITE);
+			if (pool->mQuit)
+			{
+				break;
+			}
+
+			Job* job = NULL;
+			EnterCriticalSection(&pool->mLock);
+			if (!pool->mQueue.empty())
+			{
+				job = pool->mQueue.front();
+				pool->mQueue.pop_front();
+			}
+			LeaveCriticalSection(&pool->mLock);
+
+			if (job)
+			{
+				job->execute();
+			}
+		}
+		return 0;
 	}
 
-	virtual void                        releaseSpriteBuffer(NxUserRenderSpriteBuffer& buffer)            
+	std::vector<HANDLE>	mThreads;
+	std::list<Job*>		mQueue;
+	CRITICAL_SECTION	mLock;
+	HANDLE				mSemaphore;
+	volatile LONG		mQuit;
+};
+
+// A graph of jobs with dependencies, run once per frame.  Worker jobs go to the shared
+// worker pool; main thread jobs (anything that talks to APEX) run on the thread calling
+// run, which executes them as they become ready and otherwise waits for the workers.
+// Each run records when every job started and finished, which gives the critical path.
+class AppJobGraph
+{
+public:
+	AppJobGraph()
+		: mPool(NULL)
+		, mPending(0)
+		, mWake(CreateEvent(NULL, FALSE, FALSE, NULL))
+		, mDone(CreateEvent(NULL, FALSE, FALSE, NULL))
+		, mCriticalPathMs(0.0)
+		, mWallMs(0.0)
 	{
-		ConsoleTextColor consoleColor(FOREGROUND_BLUE|FOREGROUND_RED);
-		printf("NxUserRenderResourceManager::releaseSpriteBuffer called\n");
-		mSpriteBufferList.remove_if(AppMatchesRenderResource(&buffer));
+		InitializeCriticalSection(&mLock);
 	}
 
-	virtual NxUserRenderResource*       createResource(const NxUserRenderResourceDesc& desc)             
+	~AppJobGraph()
 	{
-		ConsoleTextColor consoleColor(FOREGROUND_GREEN|FOREGROUND_RED);
-		printf("NxUserRenderResourceManager::createResource called\n");
-		mRenderResourceList.push_back(AppRenderResource());
-		mRenderResourceList.back().mSpriteBuffer = desc.spriteBuffer;
-		
-		// Let's setup the context so the sprite buffer's 'writeBuffer' method will know who it is
-		AppSpriteBuffer* spriteBuffer = reinterpret_cast<AppSpriteBuffer*>(desc.spriteBuffer);
-		spriteBuffer->mContextData = static_cast<const char*>(desc.userRenderData);
-		
-		return &(mRenderResourceList.back());
+		for (PxU32 i = 0; i < mNodes.size(); i++)
+		{
+			delete mNodes[i].nodeJob;
+		}
+		CloseHandle(mWake);
+		CloseHandle(mDone);
+		DeleteCriticalSection(&mLock);
 	}
 
-	virtual void                        releaseResource(NxUserRenderResource& resource)                  
+	// The job must outlive the graph; returns the node index for addDependency
+	PxU32 addJob(const char* name, AppWorkerPool::Job& job, bool mainThread)
 	{
-		ConsoleTextColor consoleColor(FOREGROUND_GREEN|FOREGROUND_RED);
-		printf("NxUserRenderResourceManager::releaseResource called\n");
-		mRenderResourceList.remove_if(AppMatchesRenderResource(&resource));
+		Node node;
+		node.name = name;
+		node.job = &job;
+		node.mainThread = mainThread;
+		node.nodeJob = new NodeJob(*this, PxU32(mNodes.size()));
+		node.remaining = 0;
+		node.startMs = 0.0;
+		node.finishMs = 0.0;
+		mNodes.push_back(node);
+		return PxU32(mNodes.size()) - 1;
 	}
 
-	virtual physx::PxU32                getMaxBonesForMaterial(void* material) 
+	// Jobs may only depend on jobs added before them
+	void addDependency(PxU32 job, PxU32 dependsOn)
 	{
-		return PX_MAX_U32;
+		mNodes[job].dependencies.push_back(dependsOn);
+		mNodes[dependsOn].dependents.push_back(job);
 	}
 
-	/** \brief Get the sprite layout data */
-	virtual bool getSpriteLayoutData(physx::PxU32 spriteCount, physx::PxU32 /*spriteSemanticsBitmap*/, physx::apex::NxUserRenderSpriteBufferDesc* bufferDesc)
+	// Runs every job once and returns when all have finished
+	void run(AppWorkerPool& pool)
 	{
-		bufferDesc->semanticOffsets[NxRenderSpriteLayoutElement::POSITION_FLOAT3] = offsetof(AppSpriteBuffer::SpriteData, position);
-		bufferDesc->semanticOffsets[NxRenderSpriteLayoutElement::LIFE_REMAIN_FLOAT1] =  offsetof(AppSpriteBuffer::SpriteData, lifeRemaining);
-		bufferDesc->stride = sizeof(AppSpriteBuffer::SpriteData);
-		bufferDesc->maxSprites = min(spriteCount, AppSpriteBuffer::MAX_SPRITE_COUNT);
-		bufferDesc->registerInCUDA = false;
-		bufferDesc->textureCount = 0;
-		return true;
+		mPool = &pool;
+		mTimer.reset();
+		if (mNodes.empty())
+		{
+			mWallMs = 0.0;
+			return;
+		}
+
+		mPending = LONG(mNodes.size());
+		for (PxU32 i = 0; i < mNodes.size(); i++)
+		{
+			mNodes[i].remaining = LONG(mNodes[i].dependencies.size());
+		}
+		for (PxU32 i = 0; i < mNodes.size(); i++)
+		{
+			if (mNodes[i].dependencies.empty())
+			{
+				release(i);
+			}
+		}
+
+		// Only the signal of the job that finishes last ends the run, never a look at
+		// mPending: the worker that counts it down to zero signals afterwards, and a
+		// signal arriving after we returned would end the next run early.  Workers only
+		// signal mWake before their own count down, so none is left over either.
+		HANDLE events[2] = { mDone, mWake };
+		for (;;)
+		{
+			PxU32 ready = PX_MAX_U32;
+			EnterCriticalSection(&mLock);
+			if (!mMainQueue.empty())
+			{
+				ready = mMainQueue.front();
+				mMainQueue.pop_front();
+			}
+			LeaveCriticalSection(&mLock);
+
+			if (ready != PX_MAX_U32)
+			{
+				execute(ready);
+			}
+			else if (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0)
+			{
+				break;
+			}
+		}
+
+		mWallMs = mTimer.elapsedMs();
+		findCriticalPath();
 	}
 
-	/** \brief Get the instance layout data */
-	virtual bool getInstanceLayoutData(physx::PxU32 /*spriteCount*/, physx::PxU32 /*spriteSemanticsBitmap*/, physx::apex::NxUserRenderInstanceBufferDesc* /*instanceDescArray*/)
+	double getWallMs() const
 	{
-		PX_ALWAYS_ASSERT(); // TODO TODO TODO : This needs to be implemented.
-		return false;
+		return mWallMs;
 	}
 
+	double getCriticalPathMs() const
+	{
+		return mCriticalPathMs;
+	}
 
-	// These lists aren't required, but I thought it would be nice at some point
-	// to know what resources are out there...
-	std::list<AppRenderResource>	mRenderResourceList;
-	std::list<AppSpriteBuffer>		mSpriteBufferList;
-};
-
-
-// A callback class for APEX that handles the "dispatch render resources" calls
-class AppRenderer : public NxUserRenderer
-{
-	virtual void renderResource(const NxApexRenderContext& context)
+	PxU32 getJobCount() const
 	{
-		//printf("renderResource called\n");
+		return PxU32(mNodes.size());
 	}
-};
 
+	const char* getJobName(PxU32 job) const
+	{
+		return mNodes[job].name;
+	}
 
-// This class contains all of the different pointers and stuff for the program
-// so we don't make a bunch of globals
-class AppContext
-{
-public:
-	AppContext::AppContext()
-		: mFoundationSDK(NULL)
-		, mPhysxSDK(NULL)
-		, mPhysxCooking(NULL)
-		, mPhysxScene(NULL)
-		, mThreadPool(NULL)
-		, mCudaContext(NULL)
-		, mApexSDK(NULL)
-		, mApexScene(NULL)
-		, mParticlesModule(NULL)
-		, mTurbulenceFSModule(NULL)
-		, mIofxModule(NULL)
-		, mLegacyModule(NULL)
-		, mRenderVolume(NULL)
-		, mEmitterAsset(NULL)
-		, mEmitterActor(NULL)
-		, mTurbulenceAsset(NULL)
-		, mTurbulenceActor(NULL)
-	{}
+	// how long the job ran in the last run
+	double getJobMs(PxU32 job) const
+	{
+		return mNodes[job].finishMs - mNodes[job].startMs;
+	}
 
-	bool initPhysX()
+	// "a > b > c" with each job's time, for the log
+	std::string describeCriticalPath() const
 	{
-		// Create the PhysX foundation
-		mFoundationSDK = PxCreateFoundation(PX_PHYSICS_VERSION, mAppAllocator, mAppErrorCallback);
-		if (!mFoundationSDK)
+		std::string path;
+		for (PxU32 i = 0; i < mCriticalPath.size(); i++)
 		{
-			printf("Error initializing the foundation\n");
-			return false;
+			const Node& node = mNodes[mCriticalPath[i]];
+			char step[96];
+			sprintf_s(step, sizeof(step), "%s%s %.2f ms", i ? " > " : "", node.name, node.finishMs - node.startMs);
+			path += step;
 		}
+		return path;
+	}
 
-		// Create the PhysX SDK
-		mPhysxSDK = PxCreatePhysics(PX_PHYSICS_VERSION, *mFoundationSDK, PxTolerancesScale());
-		if (!mPhysxSDK)
-		{
-			printf("Error initializing PhysXSDK\n");
-			return false;
-		}
+private:
+	class NodeJob : public AppWorkerPool::Job
+	{
+	public:
+		NodeJob(AppJobGraph& graph, PxU32 node)
+			: mGraph(graph)
+			, mNode(node)
+		{}
 
-		mPhysxCooking = PxCreateCooking(PX_PHYSICS_VERSION, mPhysxSDK->getFoundation(), PxCookingParams(mPhysxSDK->getTolerancesScale()));
-		if (!mPhysxCooking)
+		void execute()
 		{
-			printf("Error initializing PhysXSDK Cooking\n");
-			return false;
+			mGraph.execute(mNode);
 		}
 
-		// Create the PhysX SDK CPU Thread Pool
-		mThreadPool = PxDefaultCpuDispatcherCreate(4);
+	private:
+		AppJobGraph&	mGraph;
+		PxU32			mNode;
+	};
 
-		// Create the CUDA context manager (APEX will use this as well, it retrieves it from PhysX)
-		physx::PxCudaContextManagerDesc ctxMgrDesc;
-		// this call simply returns NULL on platforms and configurations that don't support CUDA
-		mCudaContext = PxCreateCudaContextManager(mPhysxSDK->getFoundation(), ctxMgrDesc, mPhysxSDK->getProfileZoneManager());
-		if (mCudaContext && !mCudaContext->contextIsValid())
-		{
-			mCudaContext->release();
-			mCudaContext = NULL;
-			printf("Error creating CUDA Context Manager\n");
-			return false;
-		}
+	struct Node
+	{
+		const char*			name;
+		AppWorkerPool::Job*	job;
+		NodeJob*			nodeJob;
+		bool				mainThread;
+		std::vector<PxU32>	dependencies;
+		std::vector<PxU32>	dependents;
+		volatile LONG		remaining;	// unfinished dependencies in the current run
+		double				startMs;
+		double				finishMs;
+	};
 
-		// Create the PhysX SDK scene
-		PxSceneDesc desc(mPhysxSDK->getTolerancesScale());
-		desc.cpuDispatcher = mThreadPool;
-		desc.gpuDispatcher = mCudaContext->getGpuDispatcher();
-		desc.filterShader = PxDefaultSimulationFilterShader;
-		if (!desc.isValid())
+	void release(PxU32 index)
+	{
+		Node& node = mNodes[index];
+		if (node.mainThread)
 		{
-			printf("Error, invalid PhysX scene descriptor\n");
-			return false;
+			EnterCriticalSection(&mLock);
+			mMainQueue.push_back(index);
+			LeaveCriticalSection(&mLock);
+			SetEvent(mWake);
 		}
-
-		mPhysxScene = mPhysxSDK->createScene(desc);
-		if (!mPhysxScene)
+		else
 		{
-			printf("Error initializing PhysX scene\n");
-			return false;
+			mPool->submit(*node.nodeJob);
 		}
-
-		return true;
 	}
 
-	void destroyPhysX()
+	void execute(PxU32 index)
 	{
-		releaseAndClear(mPhysxScene);
-		releaseAndClear(mCudaContext);
-		releaseAndClear(mThreadPool);
-		releaseAndClear(mPhysxCooking);
-		releaseAndClear(mPhysxSDK);
-		releaseAndClear(mFoundationSDK);
+		Node& node = mNodes[index];
+		node.startMs = mTimer.elapsedMs();
+		node.job->execute();
+		node.finishMs = mTimer.elapsedMs();
+
+		for (PxU32 i = 0; i < node.dependents.size(); i++)
+		{
+			if (InterlockedDecrement(&mNodes[node.dependents[i]].remaining) == 0)
+			{
+				release(node.dependents[i]);
+			}
+		}
+		// the last thing a worker does with the graph, run() may return right after
+		if (InterlockedDecrement(&mPending) == 0)
+		{
+			SetEvent(mDone);
+		}
+	}
+
+	// The chain of dependencies with the longest summed job time; nodes were added with
+	// their dependencies first, so one pass in insertion order sees every predecessor
+	void findCriticalPath()
+	{
+		std::vector<double> pathMs(mNodes.size(), 0.0);
+		std::vector<PxU32> previous(mNodes.size(), PX_MAX_U32);
+		PxU32 last = PX_MAX_U32;
+		for (PxU32 i = 0; i < mNodes.size(); i++)
+		{
+			const Node& node = mNodes[i];
+			for (PxU32 d = 0; d < node.dependencies.size(); d++)
+			{
+				PxU32 dep = node.dependencies[d];
+				if (previous[i] == PX_MAX_U32 || pathMs[dep] > pathMs[previous[i]])
+				{
+					previous[i] = dep;
+				}
+			}
+			pathMs[i] = (node.finishMs - node.startMs) + (previous[i] != PX_MAX_U32 ? pathMs[previous[i]] : 0.0);
+			if (last == PX_MAX_U32 || pathMs[i] > pathMs[last])
+			{
+				last = i;
+			}
+		}
+
+		mCriticalPath.clear();
+		mCriticalPathMs = last != PX_MAX_U32 ? pathMs[last] : 0.0;
+		for (PxU32 i = last; i != PX_MAX_U32; i = previous[i])
+		{
+			mCriticalPath.insert(mCriticalPath.begin(), i);
+		}
+	}
+
+	std::vector<Node>	mNodes;
+	AppWorkerPool*		mPool;
+	AppTimer			mTimer;
+	volatile LONG		mPending;
+	std::list<PxU32>	mMainQueue;
+	CRITICAL_SECTION	mLock;
+	HANDLE				mWake;		// a main thread job was queued
+	HANDLE				mDone;		// the last job of the run finished
+	std::vector<PxU32>	mCriticalPath;
+	double				mCriticalPathMs;
+	double				mWallMs;
+};
+
+// A stable, parallel LSD radix sort of 32-bit keys, 8 bits per pass.  It produces the
+// permutation (sorted position -> original index) instead of moving any payload, so the
+// caller decides which state travels with the keys.
+class AppRadixSort
+{
+public:
+	AppRadixSort()
+		: mCurrent(0)
+	{}
+
+	// keyBits limits the passes to the low bits that are actually in use
+	void sort(AppWorkerPool& pool, const PxU32* keys, PxU32 count, PxU32 keyBits = 32)
+	{
+		for (PxU32 b = 0; b < 2; b++)
+		{
+			mKeys[b].resize(count);
+			mIndices[b].resize(count);
+		}
+		if (count == 0)
+		{
+			return;
+		}
+
+		memcpy(&mKeys[0][0], keys, count * sizeof(PxU32));
+		for (PxU32 i = 0; i < count; i++)
+		{
+			mIndices[0][i] = i;
+		}
+
+		PxU32 chunkSize = pool.suggestChunkSize(count, 4096);
+		PxU32 numChunks = (count + chunkSize - 1) / chunkSize;
+		mHistograms.resize(numChunks * RADIX);
+
+		mCurrent = 0;
+		for (PxU32 shift = 0; shift < keyBits; shift += RADIX_BITS)
+		{
+			PassBody pass(*this, shift);
+			pass.mScatter = false;
+			pool.parallelFor(count, chunkSize, pass);
+
+			// turn the per-chunk counts into per-chunk output offsets; chunks keep their
+			// relative order within a bucket, which is what makes the sort stable
+			PxU32 offset = 0;
+			for (PxU32 bucket = 0; bucket < RADIX; bucket++)
+			{
+				for (PxU32 c = 0; c < numChunks; c++)
+				{
+					PxU32 n = mHistograms[c * RADIX + bucket];
+					mHistograms[c * RADIX + bucket] = offset;
+					offset += n;
+				}
+			}
+
+			pass.mScatter = true;
+			pool.parallelFor(count, chunkSize, pass);
+			mCurrent ^= 1;
+		}
+	}
+
+	// sorted position -> original index
+	const PxU32* getPermutation() const
+	{
+		return mIndices[mCurrent].empty() ? NULL : &mIndices[mCurrent][0];
+	}
+
+private:
+	static const PxU32 RADIX_BITS = 8;
+	static const PxU32 RADIX = 1 << RADIX_BITS;
+
+	class PassBody : public AppRangeBody
+	{
+	public:
+		PassBody(AppRadixSort& sort, PxU32 shift)
+			: mSort(sort)
+			, mShift(shift)
+			, mScatter(false)
+		{}
+
+		void run(PxU32 chunk, PxU32 begin, PxU32 end)
+		{
+			const PxU32* srcKeys = &mSort.mKeys[mSort.mCurrent][0];
+			PxU32* histogram = &mSort.mHistograms[chunk * RADIX];
+			if (!mScatter)
+			{
+				memset(histogram, 0, RADIX * sizeof(PxU32));
+				for (PxU32 i = begin; i < end; i++)
+				{
+					histogram[(srcKeys[i] >> mShift) & (RADIX - 1)]++;
+				}
+			}
+			else
+			{
+				const PxU32* srcIndices = &mSort.mIndices[mSort.mCurrent][0];
+				PxU32* dstKeys = &mSort.mKeys[mSort.mCurrent ^ 1][0];
+				PxU32* dstIndices = &mSort.mIndices[mSort.mCurrent ^ 1][0];
+				for (PxU32 i = begin; i < end; i++)
+				{
+					PxU32 dst = histogram[(srcKeys[i] >> mShift) & (RADIX - 1)]++;
+					dstKeys[dst] = srcKeys[i];
+					dstIndices[dst] = srcIndices[i];
+				}
+			}
+		}
+
+		AppRadixSort&	mSort;
+		PxU32			mShift;
+		bool			mScatter;
+
+	private:
+		PassBody& operator=(const PassBody&);
+	};
+
+	std::vector<PxU32>	mKeys[2];
+	std::vector<PxU32>	mIndices[2];
+	std::vector<PxU32>	mHistograms;
+	PxU32				mCurrent;
+};
+
+// Sorts particles by the Morton code of each particle's grid cell, so that particles next
+// to each other in memory also sample grid cells next to each other.  Only particle state
+// the app owns can be sorted, the CPU particles; the particles APEX keeps in the IOS stay
+// in whatever order APEX stores them.  The state is sorted array by array: sort finds the
+// order from the positions, apply moves each array into it.
+class AppParticleReorder
+{
+public:
+	AppParticleReorder()
+		: mPool(NULL)
+		, mOrigin(0.0f)
+		, mInvSpacing(1.0f)
+	{}
+
+	void init(AppWorkerPool& pool)
+	{
+		mPool = &pool;
+	}
+
+	bool isEnabled() const
+	{
+		return mPool != NULL;
+	}
+
+	// the grid the Morton codes are computed on, positions outside it are clamped
+	void setGrid(const PxVec3& origin, const PxVec3& spacing)
+	{
+		mOrigin = origin;
+		mInvSpacing = PxVec3(1.0f / spacing.x, 1.0f / spacing.y, 1.0f / spacing.z);
+	}
+
+	// Finds the Morton order of count positions without moving them; returns the
+	// permutation (sorted position -> original index), NULL when count is 0
+	const PxU32* sort(const PxVec3* positions, PxU32 count)
+	{
+		mKeys.resize(count);
+		mPermutation.resize(count);
+		if (count == 0)
+		{
+			return NULL;
+		}
+
+		KeyBody keys(*this, positions, &mKeys[0]);
+		mPool->parallelFor(count, mPool->suggestChunkSize(count, 4096), keys);
+		mSort.sort(*mPool, &mKeys[0], count, 30);
+		memcpy(&mPermutation[0], mSort.getPermutation(), count * sizeof(PxU32));
+		return &mPermutation[0];
+	}
+
+	// Moves the count elements of an array of per-particle state into the order of the last
+	// sort, in place
+	template <class T>
+	void apply(T* data, PxU32 count)
+	{
+		PX_ASSERT(count == mPermutation.size());
+		if (count == 0)
+		{
+			return;
+		}
+
+		mScratch.resize(count * sizeof(T));
+		GatherBody<T> gather(data, reinterpret_cast<T*>(&mScratch[0]), &mPermutation[0]);
+		mPool->parallelFor(count, mPool->suggestChunkSize(count, 4096), gather);
+		memcpy(data, &mScratch[0], count * sizeof(T));
+	}
+
+	// 10 bits per axis, interleaved x-y-z from the lowest bit up
+	static PxU32 mortonCode(PxU32 x, PxU32 y, PxU32 z)
+	{
+		return expandBits(x) | (expandBits(y) << 1) | (expandBits(z) << 2);
+	}
+
+	PxU32 cellMortonCode(const PxVec3& pos) const
+	{
+		PxVec3 g = (pos - mOrigin).multiply(mInvSpacing);
+		return mortonCode(PxU32(PxClamp(g.x, 0.0f, 1023.0f)), PxU32(PxClamp(g.y, 0.0f, 1023.0f)), PxU32(PxClamp(g.z, 0.0f, 1023.0f)));
+	}
+
+private:
+	static PxU32 expandBits(PxU32 v)
+	{
+		v &= 0x3ff;
+		v = (v | (v << 16)) & 0x030000ff;
+		v = (v | (v << 8)) & 0x0300f00f;
+		v = (v | (v << 4)) & 0x030c30c3;
+		v = (v | (v << 2)) & 0x09249249;
+		return v;
+	}
+
+	class KeyBody : public AppRangeBody
+	{
+	public:
+		KeyBody(const AppParticleReorder& reorder, const PxVec3* positions, PxU32* keys)
+			: mReorder(reorder), mPositions(positions), mKeys(keys)
+		{}
+
+		void run(PxU32 /*chunk*/, PxU32 begin, PxU32 end)
+		{
+			for (PxU32 i = begin; i < end; i++)
+			{
+				mKeys[i] = mReorder.cellMortonCode(mPositions[i]);
+			}
+		}
+
+		const AppParticleReorder&	mReorder;
+		const PxVec3*				mPositions;
+		PxU32*						mKeys;
+
+	private:
+		KeyBody& operator=(const KeyBody&);
+	};
+
+	template <class T>
+	class GatherBody : public AppRangeBody
+	{
+	public:
+		GatherBody(const T* src, T* dst, const PxU32* permutation)
+			: mSrc(src), mDst(dst), mPermutation(permutation)
+		{}
+
+		void run(PxU32 /*chunk*/, PxU32 begin, PxU32 end)
+		{
+			for (PxU32 i = begin; i < end; i++)
+			{
+				mDst[i] = mSrc[mPermutation[i]];
+			}
+		}
+
+		const T*		mSrc;
+		T*				mDst;
+		const PxU32*	mPermutation;
+	};
+
+	AppWorkerPool*		mPool;
+	PxVec3				mOrigin;
+	PxVec3				mInvSpacing;
+	AppRadixSort		mSort;
+	std::vector<PxU32>	mKeys;
+	std::vector<PxU32>	mPermutation;
+	std::vector<PxU8>	mScratch;
+};
+
+// The storage type of each sprite semantic and the value written when a source lacks it
+template <NxRenderSpriteLayoutElement::Enum S>
+struct AppSpriteSemantic;
+
+#define APP_SPRITE_SEMANTIC(semantic, type, zeroValue) \
+	template <> \
+	struct AppSpriteSemantic<NxRenderSpriteLayoutElement::semantic> \
+	{ \
+		typedef type Type; \
+		static Type zero() { return zeroValue; } \
+	};
+
+APP_SPRITE_SEMANTIC(POSITION_FLOAT3, PxVec3, PxVec3(0.0f))
+APP_SPRITE_SEMANTIC(VELOCITY_FLOAT3, PxVec3, PxVec3(0.0f))
+APP_SPRITE_SEMANTIC(LIFE_REMAIN_FLOAT1, PxF32, 0.0f)
+APP_SPRITE_SEMANTIC(DENSITY_FLOAT1, PxF32, 0.0f)
+APP_SPRITE_SEMANTIC(COLOR_RGBA8, PxU32, 0xffffffff)
+APP_SPRITE_SEMANTIC(USER_DATA_UINT1, PxU32, 0)	// the sprite ID
+
+#undef APP_SPRITE_SEMANTIC
+
+// Compile time properties of a semantics list.  The compiler lacks constexpr, so the
+// values are enum constants folded by recursion over the list.
+template <NxRenderSpriteLayoutElement::Enum... Ss>
+struct AppSpriteStride
+{
+	enum { value = 0 };
+};
+
+template <NxRenderSpriteLayoutElement::Enum S, NxRenderSpriteLayoutElement::Enum... Rest>
+struct AppSpriteStride<S, Rest...>
+{
+	enum { value = sizeof(typename AppSpriteSemantic<S>::Type) + AppSpriteStride<Rest...>::value };
+};
+
+template <NxRenderSpriteLayoutElement::Enum... Ss>
+struct AppSpriteBitmap
+{
+	enum { value = 0 };
+};
+
+template <NxRenderSpriteLayoutElement::Enum S, NxRenderSpriteLayoutElement::Enum... Rest>
+struct AppSpriteBitmap<S, Rest...>
+{
+	enum { value = (1 << S) | AppSpriteBitmap<Rest...>::value };
+};
+
+template <NxRenderSpriteLayoutElement::Enum Target, NxRenderSpriteLayoutElement::Enum... Ss>
+struct AppSpriteOffset
+{
+	enum { present = 0, value = 0 };
+};
+
+template <NxRenderSpriteLayoutElement::Enum Target, NxRenderSpriteLayoutElement::Enum S, NxRenderSpriteLayoutElement::Enum... Rest>
+struct AppSpriteOffset<Target, S, Rest...>
+{
+	enum
+	{
+		present = Target == S ? 1 : AppSpriteOffset<Target, Rest...>::present,
+		value = Target == S ? 0 : sizeof(typename AppSpriteSemantic<S>::Type) + AppSpriteOffset<Target, Rest...>::value
+	};
+};
+
+template <NxRenderSpriteLayoutElement::Enum... Ss>
+struct AppSpriteDescribe
+{
+	static void run(PxU32*, PxU32) {}
+};
+
+template <NxRenderSpriteLayoutElement::Enum S, NxRenderSpriteLayoutElement::Enum... Rest>
+struct AppSpriteDescribe<S, Rest...>
+{
+	static void run(PxU32* semanticOffsets, PxU32 offset)
+	{
+		semanticOffsets[S] = offset;
+		AppSpriteDescribe<Rest...>::run(semanticOffsets, offset + sizeof(typename AppSpriteSemantic<S>::Type));
+	}
+};
+
+// A sprite whose fields are the listed semantics packed in order.  Offsets and the stride
+// are compile time constants, so nothing looks them up per sprite.
+template <NxRenderSpriteLayoutElement::Enum... Ss>
+struct AppSpriteLayout
+{
+	enum
+	{
+		STRIDE = AppSpriteStride<Ss...>::value,
+		SEMANTICS = AppSpriteBitmap<Ss...>::value
+	};
+
+	template <NxRenderSpriteLayoutElement::Enum S>
+	struct Has
+	{
+		enum { value = AppSpriteOffset<S, Ss...>::present };
+	};
+
+	template <NxRenderSpriteLayoutElement::Enum S>
+	struct Offset
+	{
+		enum { value = AppSpriteOffset<S, Ss...>::value };
+	};
+
+	template <NxRenderSpriteLayoutElement::Enum S>
+	typename AppSpriteSemantic<S>::Type& get()
+	{
+		PX_COMPILE_TIME_ASSERT(Has<S>::value);
+		return *reinterpret_cast<typename AppSpriteSemantic<S>::Type*>(reinterpret_cast<PxU8*>(this) + Offset<S>::value);
+	}
+
+	template <NxRenderSpriteLayoutElement::Enum S>
+	const typename AppSpriteSemantic<S>::Type& get() const
+	{
+		PX_COMPILE_TIME_ASSERT(Has<S>::value);
+		return *reinterpret_cast<const typename AppSpriteSemantic<S>::Type*>(reinterpret_cast<const PxU8*>(this) + Offset<S>::value);
+	}
+
+	const PxVec3& position() const
+	{
+		return get<NxRenderSpriteLayoutElement::POSITION_FLOAT3>();
+	}
+
+	// Fills the offsets of a sprite buffer description, PX_MAX_U32 for absent semantics
+	static void describe(PxU32* semanticOffsets)
+	{
+		for (PxU32 i = 0; i < NxRenderSpriteLayoutElement::NUM_SEMANTICS; i++)
+		{
+			semanticOffsets[i] = PX_MAX_U32;
+		}
+		AppSpriteDescribe<Ss...>::run(semanticOffsets, 0);
+	}
+
+	// every semantic is a multiple of four bytes, so words pack the fields without padding
+	PxU32	storage[STRIDE / sizeof(PxU32)];
+};
+
+// Reads a semantic from a source sprite, or its zero value when the source lacks it
+template <class Src, NxRenderSpriteLayoutElement::Enum S, bool present = (Src::template Has<S>::value != 0)>
+struct AppSpriteFetch
+{
+	static typename AppSpriteSemantic<S>::Type get(const Src& src)
+	{
+		return src.template get<S>();
+	}
+};
+
+template <class Src, NxRenderSpriteLayoutElement::Enum S>
+struct AppSpriteFetch<Src, S, false>
+{
+	static typename AppSpriteSemantic<S>::Type get(const Src&)
+	{
+		return AppSpriteSemantic<S>::zero();
+	}
+};
+
+template <class Dst, class Src, NxRenderSpriteLayoutElement::Enum... Ss>
+struct AppSpriteConvertFields
+{
+	static void run(Dst&, const Src&) {}
+};
+
+template <class Dst, class Src, NxRenderSpriteLayoutElement::Enum S, NxRenderSpriteLayoutElement::Enum... Rest>
+struct AppSpriteConvertFields<Dst, Src, S, Rest...>
+{
+	static void run(Dst& dst, const Src& src)
+	{
+		dst.template get<S>() = AppSpriteFetch<Src, S>::get(src);
+		AppSpriteConvertFields<Dst, Src, Rest...>::run(dst, src);
+	}
+};
+
+// Copies sprites between layouts field by field, unrolled at compile time.  Identical
+// layouts are a plain block copy.
+template <class Dst, class Src>
+struct AppSpriteConvert;
+
+template <class Src, NxRenderSpriteLayoutElement::Enum... Ds>
+struct AppSpriteConvert<AppSpriteLayout<Ds...>, Src>
+{
+	typedef AppSpriteLayout<Ds...> Dst;
+
+	static void run(Dst* dst, const Src* src, PxU32 count)
+	{
+		for (PxU32 i = 0; i < count; i++)
+		{
+			AppSpriteConvertFields<Dst, Src, Ds...>::run(dst[i], src[i]);
+		}
+	}
+};
+
+template <NxRenderSpriteLayoutElement::Enum... Ss>
+struct AppSpriteConvert<AppSpriteLayout<Ss...>, AppSpriteLayout<Ss...> >
+{
+	typedef AppSpriteLayout<Ss...> Layout;
+
+	static void run(Layout* dst, const Layout* src, PxU32 count)
+	{
+		memcpy(dst, src, count * sizeof(Layout));
+	}
+};
+
+// The layouts in use.  Build with APP_SPRITE_LAYOUT=AppFullSpriteLayout to have APEX write
+// velocity, density, color and ID too; the shared memory ring follows the APEX layout
+// unless APP_SHARED_SPRITE_LAYOUT picks its own, converted while publishing.
+typedef AppSpriteLayout<NxRenderSpriteLayoutElement::POSITION_FLOAT3,
+                        NxRenderSpriteLayoutElement::LIFE_REMAIN_FLOAT1> AppBasicSpriteLayout;
+typedef AppSpriteLayout<NxRenderSpriteLayoutElement::POSITION_FLOAT3,
+                        NxRenderSpriteLayoutElement::VELOCITY_FLOAT3,
+                        NxRenderSpriteLayoutElement::LIFE_REMAIN_FLOAT1,
+                        NxRenderSpriteLayoutElement::DENSITY_FLOAT1,
+                        NxRenderSpriteLayoutElement::COLOR_RGBA8,
+                        NxRenderSpriteLayoutElement::USER_DATA_UINT1> AppFullSpriteLayout;
+
+#ifndef APP_SPRITE_LAYOUT
+#define APP_SPRITE_LAYOUT AppBasicSpriteLayout
+#endif
+#ifndef APP_SHARED_SPRITE_LAYOUT
+#define APP_SHARED_SPRITE_LAYOUT APP_SPRITE_LAYOUT
+#endif
+
+typedef APP_SPRITE_LAYOUT			AppApexSpriteLayout;
+typedef APP_SHARED_SPRITE_LAYOUT	AppSharedSpriteLayout;
+
+PX_COMPILE_TIME_ASSERT(sizeof(AppBasicSpriteLayout) == AppBasicSpriteLayout::STRIDE);
+PX_COMPILE_TIME_ASSERT(sizeof(AppFullSpriteLayout) == AppFullSpriteLayout::STRIDE);
+PX_COMPILE_TIME_ASSERT(AppApexSpriteLayout::Has<NxRenderSpriteLayoutElement::POSITION_FLOAT3>::value);
+
+// The semantics an IOFX requests (a bitmap of NxRenderSpriteSemantic) that a layout with the
+// given SEMANTICS (a bitmap of NxRenderSpriteLayoutElement) has no element for.  The two
+// enums number differently, and a color may be stored in any of three formats.
+static PxU32 missingSpriteSemantics(PxU32 requested, PxU32 layoutSemantics)
+{
+	typedef NxRenderSpriteLayoutElement E;
+	PxU32 missing = 0;
+	for (PxU32 s = 0; s < NxRenderSpriteSemantic::NUM_SEMANTICS; s++)
+	{
+		PxU32 elements = 0;
+		switch (s)
+		{
+		case NxRenderSpriteSemantic::POSITION:		elements = 1 << E::POSITION_FLOAT3; break;
+		case NxRenderSpriteSemantic::COLOR:			elements = (1 << E::COLOR_RGBA8) | (1 << E::COLOR_BGRA8) | (1 << E::COLOR_FLOAT4); break;
+		case NxRenderSpriteSemantic::VELOCITY:		elements = 1 << E::VELOCITY_FLOAT3; break;
+		case NxRenderSpriteSemantic::SCALE:			elements = 1 << E::SCALE_FLOAT2; break;
+		case NxRenderSpriteSemantic::LIFE_REMAIN:	elements = 1 << E::LIFE_REMAIN_FLOAT1; break;
+		case NxRenderSpriteSemantic::DENSITY:		elements = 1 << E::DENSITY_FLOAT1; break;
+		case NxRenderSpriteSemantic::SUBTEXTURE:	elements = 1 << E::SUBTEXTURE_FLOAT1; break;
+		case NxRenderSpriteSemantic::ORIENTATION:	elements = 1 << E::ORIENTATION_FLOAT1; break;
+		case NxRenderSpriteSemantic::USER_DATA:		elements = 1 << E::USER_DATA_UINT1; break;
+		default:									break;
+		}
+		if ((requested & (1 << s)) && !(elements & layoutSemantics))
+		{
+			missing |= 1 << s;
+		}
+	}
+	return missing;
+}
+
+// The layout of the shared memory sprite ring.  A header is followed by slotCount frame
+// slots of slotBytes each; every slot is a slot header followed by the sprite data.
+//
+// Each slot carries a sequence number used as a seqlock: it is odd while the writer fills
+// the slot (2 * frame + 1) and even once the frame is published (2 * frame + 2).  Readers
+// access the sprite data in place and check the sequence again afterwards; a changed
+// sequence means the writer lapped them and the data they read is torn.
+namespace AppSharedSprites
+{
+	static const PxU32 MAGIC = 0x4d545350;	// "MTSP"
+	static const PxU32 VERSION = 1;
+	static const PxU32 MAX_READERS = 16;
+	static const PxU32 ALIGNMENT = 64;
+	static const PxU64 MAX_RING_BYTES = PxU64(1) << 30;	// the ring is mapped whole, by 32 bit readers too
+
+	struct Header
+	{
+		PxU32			magic;
+		PxU32			version;
+		PxU32			slotCount;
+		PxU32			slotBytes;
+		PxU32			maxSprites;
+		PxU32			spriteStride;
+		PxU32			semanticOffsets[NxRenderSpriteLayoutElement::NUM_SEMANTICS];	// PX_MAX_U32 when absent
+		volatile LONG	writerClosed;
+		volatile LONGLONG	publishedFrames;		// frames published so far
+		volatile LONG	readerIds[MAX_READERS];	// 0 when free, the reader's process id otherwise
+	};
+
+	struct SlotHeader
+	{
+		volatile LONGLONG	sequence;
+		PxU32				frame;
+		PxU32				spriteCount;
+		PxU32				droppedSprites;	// sprites that did not fit into the slot
+		PxU8				padding[ALIGNMENT - sizeof(LONGLONG) - 3 * sizeof(PxU32)];
+	};
+
+	static PxU32 alignUp(PxU32 size)
+	{
+		return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+	}
+
+	static std::string mappingName(const char* name)
+	{
+		return std::string("Local\\") + name;
+	}
+
+	static std::string readerEventName(const char* name, PxU32 reader)
+	{
+		char suffix[32];
+		sprintf_s(suffix, sizeof(suffix), ".reader%u", reader);
+		return mappingName(name) + suffix;
+	}
+
+	// a reader that crashed never cleared its slot; the slot is free again once its process
+	// is gone.  A process we may not query counts as alive.
+	static bool isReaderGone(LONG processId)
+	{
+		HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, DWORD(processId));
+		if (!process)
+		{
+			return GetLastError() == ERROR_INVALID_PARAMETER;
+		}
+		DWORD exitCode = 0;
+		bool gone = GetExitCodeProcess(process, &exitCode) && exitCode != STILL_ACTIVE;
+		CloseHandle(process);
+		return gone;
+	}
+}
+
+// Publishes every frame's sprites into a named shared memory ring that other processes can
+// map and read in place.  Sprites are appended from the copies the sprite buffers keep of
+// what APEX hands to writeBuffer; attached readers are woken through their own named event
+// when a frame is published.  The writer never waits for readers, slow readers detect the
+// overrun instead.
+class AppSharedSpriteRing
+{
+public:
+	AppSharedSpriteRing()
+		: mMapping(NULL)
+		, mHeader(NULL)
+		, mFrame(0)
+		, mCursor(0)
+		, mSlot(NULL)
+	{
+		for (PxU32 i = 0; i < AppSharedSprites::MAX_READERS; i++)
+		{
+			mReaderEvents[i] = NULL;
+			mReaderIds[i] = 0;
+		}
+	}
+
+	~AppSharedSpriteRing()
+	{
+		close();
+	}
+
+	bool open(const char* name, PxU32 slotCount, PxU32 maxSprites, PxU32 spriteStride, const PxU32* semanticOffsets)
+	{
+		using namespace AppSharedSprites;
+		PxU64 slotBytes = (sizeof(SlotHeader) + PxU64(maxSprites) * spriteStride + ALIGNMENT - 1) & ~PxU64(ALIGNMENT - 1);
+		PxU64 totalBytes = alignUp(sizeof(Header)) + PxU64(slotCount) * slotBytes;
+		if (totalBytes > MAX_RING_BYTES)
+		{
+			printf("Error: the shared sprite ring %s would take %llu MB, at most %llu MB are supported\n",
+				name, totalBytes >> 20, MAX_RING_BYTES >> 20);
+			return false;
+		}
+
+		mName = name;
+		mMapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, DWORD(totalBytes >> 32), DWORD(totalBytes), mappingName(name).c_str());
+		if (!mMapping)
+		{
+			printf("Error: cannot create the shared sprite ring %s\n", name);
+			return false;
+		}
+		// a ring of that name belongs to another simulation (or a rank that did not exit),
+		// its readers would see us clear it under them
+		if (GetLastError() == ERROR_ALREADY_EXISTS)
+		{
+			printf("Error: the shared sprite ring %s is already in use\n", name);
+			close();
+			return false;
+		}
+		mHeader = static_cast<Header*>(MapViewOfFile(mMapping, FILE_MAP_ALL_ACCESS, 0, 0, SIZE_T(totalBytes)));
+		if (!mHeader)
+		{
+			printf("Error: cannot map the shared sprite ring %s\n", name);
+			close();
+			return false;
+		}
+
+		memset(mHeader, 0, SIZE_T(totalBytes));
+		mHeader->version = VERSION;
+		mHeader->slotCount = slotCount;
+		mHeader->slotBytes = PxU32(slotBytes);
+		mHeader->maxSprites = maxSprites;
+		mHeader->spriteStride = spriteStride;
+		memcpy(mHeader->semanticOffsets, semanticOffsets, sizeof(mHeader->semanticOffsets));
+		MemoryBarrier();
+		mHeader->magic = MAGIC;
+		return true;
+	}
+
+	void close()
+	{
+		if (mHeader)
+		{
+			InterlockedExchange(&mHeader->writerClosed, 1);
+			signalReaders();
+			UnmapViewOfFile(mHeader);
+			mHeader = NULL;
+		}
+		for (PxU32 i = 0; i < AppSharedSprites::MAX_READERS; i++)
+		{
+			if (mReaderEvents[i])
+			{
+				CloseHandle(mReaderEvents[i]);
+				mReaderEvents[i] = NULL;
+			}
+		}
+		if (mMapping)
+		{
+			CloseHandle(mMapping);
+			mMapping = NULL;
+		}
+	}
+
+	bool isOpen() const
+	{
+		return mHeader != NULL;
+	}
+
+	// Claims the slot for the frame and marks it as being written
+	void beginFrame(PxU32 frame)
+	{
+		mFrame = frame;
+		mCursor = 0;
+		mSlot = slotHeader(frame % mHeader->slotCount);
+		mSlot->droppedSprites = 0;
+		InterlockedExchange64(&mSlot->sequence, LONGLONG(frame) * 2 + 1);
+	}
+
+	// Converts sprites into the ring's layout, which must be Dst, and copies them into the
+	// current slot; safe to call from several threads at once
+	template <class Dst, class Src>
+	void append(const Src* sprites, PxU32 count)
+	{
+		PxU32 fits = 0;
+		PxU8* dst = reserve(count, fits);
+		if (fits)
+		{
+			AppSpriteConvert<Dst, Src>::run(reinterpret_cast<Dst*>(dst), sprites, fits);
+		}
+	}
+
+	// Publishes the current slot and wakes the attached readers
+	void endFrame()
+	{
+		if (!mSlot)
+		{
+			return;
+		}
+
+		mSlot->frame = mFrame;
+		mSlot->spriteCount = PxMin(PxU32(mCursor), mHeader->maxSprites);
+		InterlockedExchange64(&mSlot->sequence, LONGLONG(mFrame) * 2 + 2);
+		InterlockedExchange64(&mHeader->publishedFrames, LONGLONG(mFrame) + 1);
+		mSlot = NULL;
+		signalReaders();
+	}
+
+private:
+	// Claims room for count sprites in the current slot, fits is how many of them got room
+	PxU8* reserve(PxU32 count, PxU32& fits)
+	{
+		fits = 0;
+		if (!mSlot || count == 0)
+		{
+			return NULL;
+		}
+
+		PxU32 first = PxU32(InterlockedExchangeAdd(&mCursor, LONG(count)));
+		fits = first < mHeader->maxSprites ? PxMin(count, mHeader->maxSprites - first) : 0;
+		if (fits < count)
+		{
+			InterlockedExchangeAdd(reinterpret_cast<volatile LONG*>(&mSlot->droppedSprites), LONG(count - fits));
+		}
+		return fits ? reinterpret_cast<PxU8*>(mSlot + 1) + first * mHeader->spriteStride : NULL;
+	}
+
+	AppSharedSprites::SlotHeader* slotHeader(PxU32 slot) const
+	{
+		PxU8* base = reinterpret_cast<PxU8*>(mHeader) + AppSharedSprites::alignUp(sizeof(AppSharedSprites::Header));
+		return reinterpret_cast<AppSharedSprites::SlotHeader*>(base + slot * mHeader->slotBytes);
+	}
+
+	// reader events are opened lazily and reopened when a slot changes hands
+	void signalReaders()
+	{
+		for (PxU32 i = 0; i < AppSharedSprites::MAX_READERS; i++)
+		{
+			LONG id = mHeader->readerIds[i];
+			if (id != mReaderIds[i])
+			{
+				if (mReaderEvents[i])
+				{
+					CloseHandle(mReaderEvents[i]);
+				}
+				mReaderEvents[i] = id ? OpenEvent(EVENT_MODIFY_STATE, FALSE, AppSharedSprites::readerEventName(mName.c_str(), i).c_str()) : NULL;
+				mReaderIds[i] = id;
+			}
+			if (mReaderEvents[i])
+			{
+				SetEvent(mReaderEvents[i]);
+			}
+		}
+	}
+
+	std::string						mName;
+	HANDLE							mMapping;
+	AppSharedSprites::Header*		mHeader;
+	PxU32							mFrame;
+	volatile LONG					mCursor;
+	AppSharedSprites::SlotHeader*	mSlot;
+	HANDLE							mReaderEvents[AppSharedSprites::MAX_READERS];
+	LONG							mReaderIds[AppSharedSprites::MAX_READERS];
+};
+
+// The consumer side of AppSharedSpriteRing.  Any number of readers (up to MAX_READERS) can
+// attach to a ring; each maps it read-only and gets its own wake-up event.
+class AppSharedSpriteReader
+{
+public:
+	AppSharedSpriteReader()
+		: mMapping(NULL)
+		, mHeader(NULL)
+		, mEvent(NULL)
+		, mReader(PX_MAX_U32)
+		, mNextFrame(0)
+		, mLostFrames(0)
+	{}
+
+	~AppSharedSpriteReader()
+	{
+		detach();
+	}
+
+	bool attach(const char* name)
+	{
+		using namespace AppSharedSprites;
+		mMapping = OpenFileMapping(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, mappingName(name).c_str());
+		if (!mMapping)
+		{
+			printf("Error: no shared sprite ring named %s\n", name);
+			return false;
+		}
+
+		// map the header first to learn the size of the whole ring
+		Header* header = static_cast<Header*>(MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, sizeof(Header)));
+		if (!header || header->magic != MAGIC || header->version != VERSION)
+		{
+			printf("Error: %s is not a compatible shared sprite ring\n", name);
+			if (header)
+			{
+				UnmapViewOfFile(header);
+			}
+			detach();
+			return false;
+		}
+		SIZE_T totalBytes = alignUp(sizeof(Header)) + SIZE_T(header->slotCount) * header->slotBytes;
+		UnmapViewOfFile(header);
+
+		// the view is writable only so the reader can claim a reader slot in the header
+		mHeader = static_cast<Header*>(MapViewOfFile(mMapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, totalBytes));
+		if (!mHeader)
+		{
+			detach();
+			return false;
+		}
+
+		// the event of a reclaimed slot may still exist while the writer holds it open, the
+		// slot's new owner just takes it over
+		LONG processId = LONG(GetCurrentProcessId());
+		for (PxU32 i = 0; i < MAX_READERS && mReader == PX_MAX_U32; i++)
+		{
+			LONG owner = mHeader->readerIds[i];
+			if (owner && isReaderGone(owner))
+			{
+				InterlockedCompareExchange(&mHeader->readerIds[i], 0, owner);
+			}
+			if (InterlockedCompareExchange(&mHeader->readerIds[i], processId, 0) != 0)
+			{
+				continue;
+			}
+
+			mEvent = CreateEvent(NULL, FALSE, FALSE, readerEventName(name, i).c_str());
+			if (mEvent)
+			{
+				mReader = i;
+			}
+			else
+			{
+				InterlockedExchange(&mHeader->readerIds[i], 0);
+			}
+		}
+		if (mReader == PX_MAX_U32)
+		{
+			printf("Error: all %u reader slots of %s are taken\n", MAX_READERS, name);
+			detach();
+			return false;
+		}
+
+		// start with the next frame to be published
+		mNextFrame = PxU32(mHeader->publishedFrames);
+		return true;
+	}
+
+	void detach()
+	{
+		if (mHeader && mReader != PX_MAX_U32)
+		{
+			InterlockedExchange(&mHeader->readerIds[mReader], 0);
+		}
+		mReader = PX_MAX_U32;
+		if (mEvent)
+		{
+			CloseHandle(mEvent);
+			mEvent = NULL;
+		}
+		if (mHeader)
+		{
+			UnmapViewOfFile(mHeader);
+			mHeader = NULL;
+		}
+		if (mMapping)
+		{
+			CloseHandle(mMapping);
+			mMapping = NULL;
+		}
+	}
+
+	const AppSharedSprites::Header& getHeader() const
+	{
+		return *mHeader;
+	}
+
+	// A frame that is read in place; the data stays valid until the writer laps the
+	// reader, which isValid() reports after the fact
+	struct Frame
+	{
+		const AppSharedSprites::SlotHeader*	slot;
+		LONGLONG							sequence;
+		const PxU8*							sprites;
+
+		bool isValid() const
+		{
+			return slot->sequence == sequence;
+		}
+	};
+
+	// Waits for the next frame.  Returns false on timeout or once the writer has closed
+	// the ring and every published frame was read.
+	bool acquire(Frame& frame, DWORD timeoutMs)
+	{
+		using namespace AppSharedSprites;
+		for (;;)
+		{
+			LONGLONG published = mHeader->publishedFrames;
+			if (published - LONGLONG(mNextFrame) > LONGLONG(mHeader->slotCount))
+			{
+				// the writer lapped us, skip to the oldest frame still in the ring
+				PxU32 oldest = PxU32(published - mHeader->slotCount);
+				mLostFrames += oldest - mNextFrame;
+				mNextFrame = oldest;
+			}
+
+			if (LONGLONG(mNextFrame) < published)
+			{
+				const SlotHeader* slot = slotHeader(mNextFrame % mHeader->slotCount);
+				LONGLONG sequence = slot->sequence;
+				MemoryBarrier();
+				if (sequence == LONGLONG(mNextFrame) * 2 + 2)
+				{
+					frame.slot = slot;
+					frame.sequence = sequence;
+					frame.sprites = reinterpret_cast<const PxU8*>(slot + 1);
+					mNextFrame++;
+					return true;
+				}
+
+				// overwritten between reading publishedFrames and the slot, try again
+				mLostFrames++;
+				mNextFrame++;
+				continue;
+			}
+
+			if (mHeader->writerClosed)
+			{
+				return false;
+			}
+			if (WaitForSingleObject(mEvent, timeoutMs) != WAIT_OBJECT_0)
+			{
+				return false;
+			}
+		}
+	}
+
+	PxU32 getLostFrames() const
+	{
+		return mLostFrames;
+	}
+
+private:
+	const AppSharedSprites::SlotHeader* slotHeader(PxU32 slot) const
+	{
+		const PxU8* base = reinterpret_cast<const PxU8*>(mHeader) + AppSharedSprites::alignUp(sizeof(AppSharedSprites::Header));
+		return reinterpret_cast<const AppSharedSprites::SlotHeader*>(base + slot * mHeader->slotBytes);
+	}
+
+	HANDLE						mMapping;
+	AppSharedSprites::Header*	mHeader;
+	HANDLE						mEvent;
+	PxU32						mReader;
+	PxU32						mNextFrame;
+	PxU32						mLostFrames;
+};
+
+// Point to point messaging between the processes of a multi-process run.  Ranks are
+// numbered 0..rankCount-1 and only talk to their direct neighbours.  Other transports (TCP
+// between nodes, say) only need to implement exchange.
+class AppTransport
+{
+public:
+	virtual ~AppTransport() {}
+
+	// Sends outgoing to the peer and receives the peer's message into incoming; returns
+	// once both have happened, so every exchange also synchronizes the two ranks
+	virtual bool exchange(PxU32 peer, const std::vector<PxU8>& outgoing, std::vector<PxU8>& incoming) = 0;
+
+	virtual PxU32 getRank() const = 0;
+	virtual PxU32 getRankCount() const = 0;
+};
+
+// Neighbours connected through local named pipes.  Rank r serves the link to r+1 on
+// \\.\pipe\MinimalTurbulence.<session>.<r> and connects to the one rank r-1 serves.
+// Messages are a byte count followed by the bytes.
+class AppPipeTransport : public AppTransport
+{
+public:
+	AppPipeTransport()
+		: mRank(0)
+		, mRankCount(1)
+		, mLeft(INVALID_HANDLE_VALUE)
+		, mRight(INVALID_HANDLE_VALUE)
+	{}
+
+	~AppPipeTransport()
+	{
+		close();
+	}
+
+	bool connect(const char* session, PxU32 rank, PxU32 rankCount)
+	{
+		mRank = rank;
+		mRankCount = rankCount;
+
+		// serving the right link first cannot deadlock: the last rank only connects, which
+		// releases its left neighbour to connect in turn, and so on down the chain
+		if (rank + 1 < rankCount)
+		{
+			std::string name = pipeName(session, rank);
+			mRight = CreateNamedPipe(name.c_str(), PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+				1, PIPE_BUFFER_SIZE, PIPE_BUFFER_SIZE, 0, NULL);
+			if (mRight == INVALID_HANDLE_VALUE)
+			{
+				printf("Error: cannot create the pipe %s\n", name.c_str());
+				return false;
+			}
+			if (!ConnectNamedPipe(mRight, NULL) && GetLastError() != ERROR_PIPE_CONNECTED)
+			{
+				printf("Error: rank %u did not connect\n", rank + 1);
+				return false;
+			}
+		}
+
+		if (rank > 0)
+		{
+			std::string name = pipeName(session, rank - 1);
+			for (PxU32 waitedMs = 0; mLeft == INVALID_HANDLE_VALUE; waitedMs += CONNECT_RETRY_MS)
+			{
+				mLeft = CreateFile(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+				if (mLeft == INVALID_HANDLE_VALUE)
+				{
+					if (waitedMs >= CONNECT_TIMEOUT_MS)
+					{
+						printf("Error: cannot connect to rank %u\n", rank - 1);
+						return false;
+					}
+					Sleep(CONNECT_RETRY_MS);
+				}
+			}
+		}
+		return true;
+	}
+
+	void close()
+	{
+		if (mLeft != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(mLeft);
+			mLeft = INVALID_HANDLE_VALUE;
+		}
+		if (mRight != INVALID_HANDLE_VALUE)
+		{
+			FlushFileBuffers(mRight);
+			DisconnectNamedPipe(mRight);
+			CloseHandle(mRight);
+			mRight = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	// the lower rank writes first, so that two large messages never block each other
+	virtual bool exchange(PxU32 peer, const std::vector<PxU8>& outgoing, std::vector<PxU8>& incoming)
+	{
+		HANDLE pipe = peer == mRank + 1 ? mRight : (peer + 1 == mRank ? mLeft : INVALID_HANDLE_VALUE);
+		if (pipe == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+		if (mRank < peer)
+		{
+			return writeMessage(pipe, outgoing) && readMessage(pipe, incoming);
+		}
+		return readMessage(pipe, incoming) && writeMessage(pipe, outgoing);
+	}
+
+	virtual PxU32 getRank() const
+	{
+		return mRank;
+	}
+
+	virtual PxU32 getRankCount() const
+	{
+		return mRankCount;
+	}
+
+private:
+	static const PxU32 PIPE_BUFFER_SIZE = 64 * 1024;
+	static const PxU32 CONNECT_RETRY_MS = 10;
+	static const PxU32 CONNECT_TIMEOUT_MS = 30000;
+
+	static std::string pipeName(const char* session, PxU32 rank)
+	{
+		char suffix[32];
+		sprintf_s(suffix, sizeof(suffix), ".%u", rank);
+		return std::string("\\\\.\\pipe\\MinimalTurbulence.") + session + suffix;
+	}
+
+	static bool writeAll(HANDLE pipe, const void* data, PxU32 size)
+	{
+		const PxU8* bytes = static_cast<const PxU8*>(data);
+		while (size)
+		{
+			DWORD written = 0;
+			if (!WriteFile(pipe, bytes, size, &written, NULL))
+			{
+				return false;
+			}
+			bytes += written;
+			size -= written;
+		}
+		return true;
+	}
+
+	static bool readAll(HANDLE pipe, void* data, PxU32 size)
+	{
+		PxU8* bytes = static_cast<PxU8*>(data);
+		while (size)
+		{
+			DWORD read = 0;
+			if (!ReadFile(pipe, bytes, size, &read, NULL) || read == 0)
+			{
+				return false;
+			}
+			bytes += read;
+			size -= read;
+		}
+		return true;
+	}
+
+	static bool writeMessage(HANDLE pipe, const std::vector<PxU8>& message)
+	{
+		PxU32 size = PxU32(message.size());
+		return writeAll(pipe, &size, sizeof(size)) && (size == 0 || writeAll(pipe, &message[0], size));
+	}
+
+	static bool readMessage(HANDLE pipe, std::vector<PxU8>& message)
+	{
+		PxU32 size = 0;
+		if (!readAll(pipe, &size, sizeof(size)))
+		{
+			return false;
+		}
+		message.resize(size);
+		return size == 0 || readAll(pipe, &message[0], size);
+	}
+
+	PxU32	mRank;
+	PxU32	mRankCount;
+	HANDLE	mLeft;
+	HANDLE	mRight;
+};
+
+// Splits the domain into slabs along one axis, one per rank.  The first and last slabs
+// extend to infinity, so every position has exactly one owner.  The ranks simulate CPU
+// particles (AppCpuParticles), which can be removed one by one: a particle that leaves a
+// slab is taken out of the rank's particles, queued as an emigrant with its whole state and
+// adopted by the neighbour in that direction at the next exchange, so every particle lives
+// on exactly one rank.  Every rank exchanges with both neighbours every frame, even with
+// nothing to send, which keeps the ranks in lock step.
+class AppSlabDecomposition
+{
+public:
+	struct Migrant
+	{
+		PxVec3	position;
+		PxVec3	velocity;
+		PxF32	life;
+		PxU32	id;
+	};
+
+	AppSlabDecomposition()
+		: mTransport(NULL)
+		, mAxis(0)
+		, mMin(-PX_MAX_F32)
+		, mMax(PX_MAX_F32)
+		, mMigrated(0)
+	{}
+
+	// Splits [domainMin, domainMax) along the axis evenly between the transport's ranks
+	void init(AppTransport& transport, PxU32 axis, PxF32 domainMin, PxF32 domainMax)
+	{
+		PxU32 rank = transport.getRank();
+		PxU32 rankCount = transport.getRankCount();
+		PxF32 width = (domainMax - domainMin) / rankCount;
+
+		mTransport = &transport;
+		mAxis = axis;
+		mMin = rank > 0 ? domainMin + rank * width : -PX_MAX_F32;
+		mMax = rank + 1 < rankCount ? domainMin + (rank + 1) * width : PX_MAX_F32;
+	}
+
+	bool isEnabled() const
+	{
+		return mTransport != NULL;
+	}
+
+	bool owns(const PxVec3& position) const
+	{
+		return position[mAxis] >= mMin && position[mAxis] < mMax;
+	}
+
+	// Queues a particle that is no longer in this slab for the neighbour toward it
+	void emigrate(const Migrant& migrant)
+	{
+		mOutgoing[migrant.position[mAxis] < mMin ? 0 : 1].push_back(migrant);
+	}
+
+	// Sends the queued emigrants and collects the neighbours' into immigrants.  An
+	// immigrant that already moved on past this slab is adopted all the same, it keeps
+	// simulating here and emigrates again at the next exchange.  Links between ranks r and
+	// r+1 with even r go first, then the odd ones, so no rank waits on a chain.
+	bool exchange(PxU32 frame, std::vector<Migrant>& immigrants)
+	{
+		immigrants.clear();
+		PxU32 rank = mTransport->getRank();
+		PxU32 rankCount = mTransport->getRankCount();
+		for (PxU32 phase = 0; phase < 2; phase++)
+		{
+			bool right = (rank & 1) == phase;
+			if (right ? rank + 1 >= rankCount : rank == 0)
+			{
+				continue;
+			}
+
+			std::vector<Migrant>& outgoing = mOutgoing[right ? 1 : 0];
+			pack(frame, outgoing, mMessage);
+			mMigrated += PxU32(outgoing.size());
+			outgoing.clear();
+
+			if (!mTransport->exchange(right ? rank + 1 : rank - 1, mMessage, mReceived) || !unpack(frame, mReceived, immigrants))
+			{
+				printf("Error exchanging particles with rank %u\n", right ? rank + 1 : rank - 1);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	PxU32 getAxis() const
+	{
+		return mAxis;
+	}
+
+	PxU32 getRank() const
+	{
+		return mTransport ? mTransport->getRank() : 0;
+	}
+
+	PxU32 getMigratedCount() const
+	{
+		return mMigrated;
+	}
+
+private:
+	// frame, count, then the migrants
+	static void pack(PxU32 frame, const std::vector<Migrant>& migrants, std::vector<PxU8>& message)
+	{
+		PxU32 header[2] = { frame, PxU32(migrants.size()) };
+		message.resize(sizeof(header) + migrants.size() * sizeof(Migrant));
+		memcpy(&message[0], header, sizeof(header));
+		if (!migrants.empty())
+		{
+			memcpy(&message[sizeof(header)], &migrants[0], migrants.size() * sizeof(Migrant));
+		}
+	}
+
+	static bool unpack(PxU32 frame, const std::vector<PxU8>& message, std::vector<Migrant>& migrants)
+	{
+		PxU32 header[2];
+		if (message.size() < sizeof(header))
+		{
+			return false;
+		}
+		memcpy(header, &message[0], sizeof(header));
+		if (header[0] != frame || message.size() != sizeof(header) + header[1] * sizeof(Migrant))
+		{
+			printf("Error: the ranks are out of step (frame %u, got %u)\n", frame, header[0]);
+			return false;
+		}
+
+		size_t first = migrants.size();
+		migrants.resize(first + header[1]);
+		if (header[1])
+		{
+			memcpy(&migrants[first], &message[sizeof(header)], header[1] * sizeof(Migrant));
+		}
+		return true;
+	}
+
+	AppTransport*			mTransport;
+	PxU32					mAxis;
+	PxF32					mMin;
+	PxF32					mMax;
+	PxU32					mMigrated;
+	std::vector<Migrant>	mOutgoing[2];	// toward the lower and the higher slabs
+	std::vector<PxU8>		mMessage;
+	std::vector<PxU8>		mReceived;
+};
+
+// A perspective camera for the preview output, y-up and right handed.  Its view and
+// projection go to the APEX scene matrices; its frustum culls and depth sorts the sprites.
+class AppCamera
+{
+public:
+	struct Config
+	{
+		Config()
+			: eye(0.0f, 10.0f, 40.0f)
+			, target(0.0f, 10.0f, 0.0f)
+			, fovY(60.0f)
+			, nearZ(0.1f)
+			, farZ(1000.0f)
+			, width(1280)
+			, height(720)
+			, spriteRadius(0.5f)
+		{}
+
+		PxVec3	eye;
+		PxVec3	target;
+		PxF32	fovY;			// degrees
+		PxF32	nearZ;
+		PxF32	farZ;
+		PxU32	width;			// viewport, for the aspect ratio
+		PxU32	height;
+		PxF32	spriteRadius;	// sprites touching the frustum count as visible
+	};
+
+	AppCamera()
+		: mEnabled(false)
+	{}
+
+	void init(const Config& config)
+	{
+		mConfig = config;
+		mForward = (config.target - config.eye).getNormalized();
+		// y is up, unless the camera looks straight up or down; then the top of the
+		// image points along -z
+		PxVec3 up = PxAbs(mForward.y) > 0.999f ? PxVec3(0.0f, 0.0f, -1.0f) : PxVec3(0.0f, 1.0f, 0.0f);
+		mRight = mForward.cross(up).getNormalized();
+		mUp = mRight.cross(mForward);
+		mTanY = PxTan(config.fovY * PxPi / 360.0f);
+		mTanX = mTanY * config.width / config.height;
+
+		// inward facing planes: near, far, left, right, bottom, top
+		setPlane(0, mForward, config.eye + mForward * config.nearZ);
+		setPlane(1, -mForward, config.eye + mForward * config.farZ);
+		setPlane(2, (mRight + mForward * mTanX).getNormalized(), config.eye);
+		setPlane(3, (-mRight + mForward * mTanX).getNormalized(), config.eye);
+		setPlane(4, (mUp + mForward * mTanY).getNormalized(), config.eye);
+		setPlane(5, (-mUp + mForward * mTanY).getNormalized(), config.eye);
+		mEnabled = true;
+	}
+
+	bool isEnabled() const
+	{
+		return mEnabled;
+	}
+
+	const Config& getConfig() const
+	{
+		return mConfig;
+	}
+
+	// distance along the view direction
+	PxF32 getDepth(const PxVec3& position) const
+	{
+		return mForward.dot(position - mConfig.eye);
+	}
+
+	bool isVisible(const PxVec3& position) const
+	{
+		for (PxU32 i = 0; i < 6; i++)
+		{
+			if (mPlaneNormals[i].dot(position) + mPlaneDistances[i] < -mConfig.spriteRadius)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// the box around the frustum's corners
+	PxBounds3 getBounds() const
+	{
+		PxBounds3 bounds;
+		bounds.setEmpty();
+		const PxF32 depths[2] = { mConfig.nearZ, mConfig.farZ };
+		for (PxU32 d = 0; d < 2; d++)
+		{
+			PxVec3 center = mConfig.eye + mForward * depths[d];
+			PxVec3 x = mRight * (mTanX * depths[d]);
+			PxVec3 y = mUp * (mTanY * depths[d]);
+			bounds.include(center - x - y);
+			bounds.include(center + x - y);
+			bounds.include(center - x + y);
+			bounds.include(center + x + y);
+		}
+		return bounds;
+	}
+
+	// right handed look-at
+	PxMat44 getViewMatrix() const
+	{
+		const PxVec3& eye = mConfig.eye;
+		return PxMat44(PxVec4(mRight.x, mUp.x, -mForward.x, 0.0f),
+		               PxVec4(mRight.y, mUp.y, -mForward.y, 0.0f),
+		               PxVec4(mRight.z, mUp.z, -mForward.z, 0.0f),
+		               PxVec4(-mRight.dot(eye), -mUp.dot(eye), mForward.dot(eye), 1.0f));
+	}
+
+	// right handed perspective, depth mapped to [0, 1]
+	PxMat44 getProjMatrix() const
+	{
+		PxF32 n = mConfig.nearZ;
+		PxF32 f = mConfig.farZ;
+		return PxMat44(PxVec4(1.0f / mTanX, 0.0f, 0.0f, 0.0f),
+		               PxVec4(0.0f, 1.0f / mTanY, 0.0f, 0.0f),
+		               PxVec4(0.0f, 0.0f, f / (n - f), -1.0f),
+		               PxVec4(0.0f, 0.0f, n * f / (n - f), 0.0f));
+	}
+
+private:
+	void setPlane(PxU32 index, const PxVec3& normal, const PxVec3& point)
+	{
+		mPlaneNormals[index] = normal;
+		mPlaneDistances[index] = -normal.dot(point);
+	}
+
+	Config	mConfig;
+	bool	mEnabled;
+	PxVec3	mForward;
+	PxVec3	mRight;
+	PxVec3	mUp;
+	PxF32	mTanX;
+	PxF32	mTanY;
+	PxVec3	mPlaneNormals[6];
+	PxF32	mPlaneDistances[6];
+};
+
+// Frustum culls a batch of sprites and sorts the visible ones back to front for blending.
+// The output culls the sprites of all buffers of a frame as one batch, so the order holds
+// across the whole frame.  Culling runs in chunks on the worker pool, each chunk compacts
+// its survivors to an offset from a prefix sum over the chunk counts, and the depths go
+// through the parallel radix sort.
+class AppSpriteCuller
+{
+public:
+	// Returns the number of visible sprites, whose indices getOrder lists farthest first
+	template <class Sprite>
+	PxU32 process(AppWorkerPool& pool, const AppCamera& camera, const Sprite* sprites, PxU32 count)
+	{
+		mKeys.resize(count);
+		mVisible.resize(count);
+		mVisibleKeys.resize(count);
+		mVisibleIndices.resize(count);
+		mOrder.resize(count);
+		if (count == 0)
+		{
+			return 0;
+		}
+
+		PxU32 chunkSize = pool.suggestChunkSize(count, 1024);
+		PxU32 numChunks = (count + chunkSize - 1) / chunkSize;
+		mChunkOffsets.resize(numChunks + 1);
+
+		CullBody<Sprite> cull(*this, camera, sprites);
+		pool.parallelFor(count, chunkSize, cull);
+
+		for (PxU32 c = 0, offset = 0; c <= numChunks; c++)
+		{
+			PxU32 n = c < numChunks ? mChunkOffsets[c] : 0;
+			mChunkOffsets[c] = offset;
+			offset += n;
+		}
+
+		CompactBody compact(*this);
+		pool.parallelFor(count, chunkSize, compact);
+
+		PxU32 visibleCount = mChunkOffsets[numChunks];
+		mSort.sort(pool, &mVisibleKeys[0], visibleCount);
+		const PxU32* permutation = mSort.getPermutation();
+		for (PxU32 i = 0; i < visibleCount; i++)
+		{
+			mOrder[i] = mVisibleIndices[permutation[i]];
+		}
+		return visibleCount;
+	}
+
+	const PxU32* getOrder() const
+	{
+		return mOrder.empty() ? NULL : &mOrder[0];
+	}
+
+private:
+	// Flags the visible sprites, computes their sort keys and counts them per chunk
+	template <class Sprite>
+	class CullBody : public AppRangeBody
+	{
+	public:
+		CullBody(AppSpriteCuller& culler, const AppCamera& camera, const Sprite* sprites)
+			: mCuller(culler)
+			, mCamera(camera)
+			, mSprites(sprites)
+		{}
+
+		void run(PxU32 chunk, PxU32 begin, PxU32 end)
+		{
+			PxU32 visible = 0;
+			for (PxU32 i = begin; i < end; i++)
+			{
+				// sprites reaching through the near plane pass the frustum test but are dropped
+				// here, the depth keys need depths of at least nearZ, which is positive
+				const PxVec3& position = mSprites[i].position();
+				PxF32 depth = mCamera.getDepth(position);
+				bool keep = depth >= mCamera.getConfig().nearZ && mCamera.isVisible(position);
+				mCuller.mVisible[i] = keep ? 1 : 0;
+				if (keep)
+				{
+					// ascending keys must mean descending depth; positive floats order their
+					// bits like their values
+					PxU32 bits;
+					memcpy(&bits, &depth, sizeof(bits));
+					mCuller.mKeys[i] = ~bits;
+					visible++;
+				}
+			}
+			mCuller.mChunkOffsets[chunk] = visible;
+		}
+
+	private:
+		AppSpriteCuller&	mCuller;
+		const AppCamera&	mCamera;
+		const Sprite*		mSprites;
+	};
+
+	// Moves each chunk's survivors to its offset, keeping their order
+	class CompactBody : public AppRangeBody
+	{
+	public:
+		CompactBody(AppSpriteCuller& culler)
+			: mCuller(culler)
+		{}
+
+		void run(PxU32 chunk, PxU32 begin, PxU32 end)
+		{
+			PxU32 out = mCuller.mChunkOffsets[chunk];
+			for (PxU32 i = begin; i < end; i++)
+			{
+				if (mCuller.mVisible[i])
+				{
+					mCuller.mVisibleKeys[out] = mCuller.mKeys[i];
+					mCuller.mVisibleIndices[out] = i;
+					out++;
+				}
+			}
+		}
+
+	private:
+		AppSpriteCuller&	mCuller;
+	};
+
+	AppRadixSort		mSort;
+	std::vector<PxU32>	mKeys;
+	std::vector<PxU8>	mVisible;
+	std::vector<PxU32>	mVisibleKeys;
+	std::vector<PxU32>	mVisibleIndices;
+	std::vector<PxU32>	mChunkOffsets;	// visible counts per chunk, then their offsets
+	std::vector<PxU32>	mOrder;
+};
+
+// Where and how the frame's sprites are output, AppSpriteFrame::output reads them
+struct AppSpriteBufferSettings
+{
+	AppSpriteBufferSettings()
+		: sharedRing(NULL)
+		, camera(NULL)
+		, cullingPool(NULL)
+	{}
+
+	AppSharedSpriteRing*	sharedRing;	// NULL unless sprites are published to other processes
+	const AppCamera*		camera;		// NULL writes every sprite, in storage order
+	AppWorkerPool*			cullingPool;
+};
+
+// An allocator callback for APEX and PhysX
+class AppAlloc : public PxAllocatorCallback
+{
+public:
+	AppAlloc()
+		: mBytes(0)
+		, mAllocations(0)
+	{}
+
+	// what PhysX and APEX hold right now, including the heap's rounding
+	LONGLONG getBytes()
+	{
+		return InterlockedCompareExchange64(&mBytes, 0, 0);
+	}
+
+	LONG getAllocations() const
+	{
+		return mAllocations;
+	}
+
+private:
+	// PhysX3 PxAllocatorCallback interface
+	void* allocate(size_t size, const char* /*typeName*/, const char* /*filename*/, int /*line*/)
+	{
+		void* ptr = ::_aligned_malloc(size, 16);
+		if (ptr)
+		{
+			InterlockedExchangeAdd64(&mBytes, LONGLONG(::_aligned_msize(ptr, 16, 0)));
+			InterlockedIncrement(&mAllocations);
+		}
+		return ptr;
+	}
+
+	void deallocate(void* ptr)
+	{
+		if (ptr)
+		{
+			InterlockedExchangeAdd64(&mBytes, -LONGLONG(::_aligned_msize(ptr, 16, 0)));
+			InterlockedDecrement(&mAllocations);
+		}
+		return ::_aligned_free(ptr);
+	}
+
+	volatile LONGLONG	mBytes;
+	volatile LONG		mAllocations;
+};
+
+// Counters for the metrics endpoint.  The frame loop and its workers update them with
+// interlocked operations and the server thread reads them when a scrape comes in, so
+// neither side ever waits for the other.
+class AppMetrics
+{
+public:
+	static const PxU32 MAX_PHASES = 16;
+	static const PxU32 FRAME_BUCKETS = 9;	// the last one is +Inf
+
+	AppMetrics()
+		: mFrames(0)
+		, mFrameMicros(0)
+		, mLiveParticles(0)
+		, mEmittedParticles(0)
+		, mPhaseCount(0)
+		, mAllocator(NULL)
+	{
+		for (PxU32 i = 0; i < FRAME_BUCKETS; i++)
+		{
+			mFrameBuckets[i] = 0;
+		}
+		for (PxU32 i = 0; i < MAX_PHASES; i++)
+		{
+			mPhaseNames[i] = NULL;
+			mPhaseMicros[i] = 0;
+		}
+	}
+
+	// Phases are added up front, before the server starts; the name must outlive the metrics
+	PxU32 addPhase(const char* name)
+	{
+		PX_ASSERT(mPhaseCount < MAX_PHASES);
+		mPhaseNames[mPhaseCount] = name;
+		return mPhaseCount++;
+	}
+
+	void setAllocator(AppAlloc* allocator)
+	{
+		mAllocator = allocator;
+	}
+
+	void recordFrame(double ms)
+	{
+		PxU32 bucket = 0;
+		while (bucket < FRAME_BUCKETS - 1 && ms > frameBucketMs(bucket))
+		{
+			bucket++;
+		}
+		InterlockedIncrement64(&mFrameBuckets[bucket]);
+		InterlockedExchangeAdd64(&mFrameMicros, LONGLONG(ms * 1000.0));
+		InterlockedIncrement64(&mFrames);
+	}
+
+	void recordPhase(PxU32 phase, double ms)
+	{
+		InterlockedExchangeAdd64(&mPhaseMicros[phase], LONGLONG(ms * 1000.0));
+	}
+
+	void addEmittedParticles(PxU32 count)
+	{
+		InterlockedExchangeAdd64(&mEmittedParticles, LONGLONG(count));
+	}
+
+	void setLiveParticles(PxU32 count)
+	{
+		InterlockedExchange(&mLiveParticles, LONG(count));
+	}
+
+	// The Prometheus text exposition format
+	std::string format()
+	{
+		std::string out;
+		char line[256];
+
+		out += "# HELP minimal_turbulence_frame_seconds Wall time of a frame's job graph.\n";
+		out += "# TYPE minimal_turbulence_frame_seconds histogram\n";
+		LONGLONG cumulative = 0;
+		for (PxU32 i = 0; i < FRAME_BUCKETS; i++)
+		{
+			cumulative += read(mFrameBuckets[i]);
+			if (i < FRAME_BUCKETS - 1)
+			{
+				sprintf_s(line, sizeof(line), "minimal_turbulence_frame_seconds_bucket{le=\"%g\"} %lld\n", frameBucketMs(i) / 1000.0, cumulative);
+			}
+			else
+			{
+				sprintf_s(line, sizeof(line), "minimal_turbulence_frame_seconds_bucket{le=\"+Inf\"} %lld\n", cumulative);
+			}
+			out += line;
+		}
+		sprintf_s(line, sizeof(line), "minimal_turbulence_frame_seconds_sum %.6f\nminimal_turbulence_frame_seconds_count %lld\n",
+			read(mFrameMicros) / 1e6, read(mFrames));
+		out += line;
+
+		out += "# HELP minimal_turbulence_phase_seconds_total Time spent in each phase of the frame. A phase named a/b is part of phase a, do not add the two.\n";
+		out += "# TYPE minimal_turbulence_phase_seconds_total counter\n";
+		for (PxU32 i = 0; i < mPhaseCount; i++)
+		{
+			sprintf_s(line, sizeof(line), "minimal_turbulence_phase_seconds_total{phase=\"%s\"} %.6f\n", mPhaseNames[i], read(mPhaseMicros[i]) / 1e6);
+			out += line;
+		}
+
+		out += "# HELP minimal_turbulence_particles_live Particles extracted in the last frame.\n";
+		out += "# TYPE minimal_turbulence_particles_live gauge\n";
+		sprintf_s(line, sizeof(line), "minimal_turbulence_particles_live %ld\n", mLiveParticles);
+		out += line;
+
+		out += "# HELP minimal_turbulence_particles_emitted_total Particles handed to the emitters.\n";
+		out += "# TYPE minimal_turbulence_particles_emitted_total counter\n";
+		sprintf_s(line, sizeof(line), "minimal_turbulence_particles_emitted_total %lld\n", read(mEmittedParticles));
+		out += line;
+
+		if (mAllocator)
+		{
+			out += "# HELP minimal_turbulence_allocator_bytes Heap memory held by PhysX and APEX.\n";
+			out += "# TYPE minimal_turbulence_allocator_bytes gauge\n";
+			sprintf_s(line, sizeof(line), "minimal_turbulence_allocator_bytes %lld\n", mAllocator->getBytes());
+			out += line;
+			out += "# HELP minimal_turbulence_allocator_allocations Live PhysX and APEX allocations.\n";
+			out += "# TYPE minimal_turbulence_allocator_allocations gauge\n";
+			sprintf_s(line, sizeof(line), "minimal_turbulence_allocator_allocations %ld\n", mAllocator->getAllocations());
+			out += line;
+		}
+
+		out += "# HELP minimal_turbulence_log_queue_depth Log records waiting to be written out.\n";
+		out += "# TYPE minimal_turbulence_log_queue_depth gauge\n";
+		sprintf_s(line, sizeof(line), "minimal_turbulence_log_queue_depth %u\n", AppLog::getQueueDepth());
+		out += line;
+		return out;
+	}
+
+private:
+	// upper bounds of the frame time buckets, around the usual frame budgets
+	static double frameBucketMs(PxU32 bucket)
+	{
+		static const double bounds[FRAME_BUCKETS - 1] = { 1.0, 2.0, 4.0, 8.0, 16.7, 33.3, 66.7, 133.3 };
+		return bounds[bucket];
+	}
+
+	// a 64-bit read that can't tear on 32-bit builds
+	static LONGLONG read(volatile LONGLONG& value)
+	{
+		return InterlockedCompareExchange64(&value, 0, 0);
+	}
+
+	volatile LONGLONG	mFrameBuckets[FRAME_BUCKETS];
+	volatile LONGLONG	mFrames;
+	volatile LONGLONG	mFrameMicros;
+	volatile LONG		mLiveParticles;
+	volatile LONGLONG	mEmittedParticles;
+	const char*			mPhaseNames[MAX_PHASES];
+	volatile LONGLONG	mPhaseMicros[MAX_PHASES];
+	PxU32				mPhaseCount;
+	AppAlloc*			mAllocator;
+};
+
+// Serves AppMetrics over plain HTTP on localhost.  A single thread accepts and answers one
+// scrape at a time; stop closes the listening socket, which ends that thread's accept.
+class AppMetricsServer
+{
+public:
+	AppMetricsServer()
+		: mSocket(INVALID_SOCKET)
+		, mThread(NULL)
+		, mMetrics(NULL)
+		, mWinsockStarted(false)
+	{}
+
+	~AppMetricsServer()
+	{
+		stop();
+	}
+
+	bool start(AppMetrics& metrics, PxU32 port)
+	{
+		WSADATA wsaData;
+		if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+		{
+			printf("Error starting Winsock for the metrics server\n");
+			return false;
+		}
+		mWinsockStarted = true;
+
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons(u_short(port));
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		mSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (mSocket == INVALID_SOCKET ||
+			bind(mSocket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR ||
+			listen(mSocket, SOMAXCONN) == SOCKET_ERROR)
+		{
+			printf("Error listening for metrics scrapes on port %u (%d)\n", port, WSAGetLastError());
+			stop();
+			return false;
+		}
+
+		mMetrics = &metrics;
+		mThread = CreateThread(NULL, 0, serverThreadMain, this, 0, NULL);
+		if (!mThread)
+		{
+			printf("Error creating the metrics server thread\n");
+			stop();
+			return false;
+		}
+
+		printf("Serving metrics on http://127.0.0.1:%u/metrics\n", port);
+		return true;
+	}
+
+	void stop()
+	{
+		if (mSocket != INVALID_SOCKET)
+		{
+			closesocket(mSocket);
+			mSocket = INVALID_SOCKET;
+		}
+		if (mThread)
+		{
+			WaitForSingleObject(mThread, INFINITE);
+			CloseHandle(mThread);
+			mThread = NULL;
+		}
+		if (mWinsockStarted)
+		{
+			WSACleanup();
+			mWinsockStarted = false;
+		}
+	}
+
+private:
+	static DWORD WINAPI serverThreadMain(LPVOID param)
+	{
+		AppMetricsServer* server = static_cast<AppMetricsServer*>(param);
+		SOCKET listener = server->mSocket;
+		for (;;)
+		{
+			SOCKET client = accept(listener, NULL, NULL);
+			if (client == INVALID_SOCKET)
+			{
+				break;
+			}
+			server->serve(client);
+			closesocket(client);
+		}
+		return 0;
+	}
+
+	void serve(SOCKET client)
+	{
+		// don't let a client that never sends its request hold up the next scrape
+		DWORD timeoutMs = 1000;
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeoutMs), sizeof(timeoutMs));
+
+		char request[1024];
+		int received = recv(client, request, sizeof(request) - 1, 0);
+		if (received <= 0)
+		{
+			return;
+		}
+		request[received] = 0;
+
+		bool found = !strncmp(request, "GET /metrics ", 13) || !strncmp(request, "GET / ", 6);
+		std::string body = found ? mMetrics->format() : std::string("Not found\n");
+
+		char header[192];
+		sprintf_s(header, sizeof(header),
+			"HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+			found ? "200 OK" : "404 Not Found", PxU32(body.size()));
+		if (sendAll(client, header, strlen(header)))
+		{
+			sendAll(client, body.c_str(), body.size());
+		}
+	}
+
+	static bool sendAll(SOCKET client, const char* data, size_t size)
+	{
+		while (size > 0)
+		{
+			int sent = send(client, data, int(size), 0);
+			if (sent == SOCKET_ERROR)
+			{
+				return false;
+			}
+			data += sent;
+			size -= size_t(sent);
+		}
+		return true;
+	}
+
+	SOCKET			mSocket;
+	HANDLE			mThread;
+	AppMetrics*		mMetrics;
+	bool			mWinsockStarted;
+};
+
+// An error callback for APEX and PhysX
+class AppErrorCallback : public PxErrorCallback
+{
+	// PhysX3 foundation PxErrorCallback interface
+	void reportError(PxErrorCode::Enum code, const char* message, const char* file, int line)
+	{
+		printf("ErrorCallback in file: %s(%i):\n%s\n", file, line, message);
+	}
+
+};
+
+class DummyMaterial
+{};
+
+// A resource callback for APEX (APEX will ask for assets, materials, etc through this interface)
+class AppApexResourceCallback : public NxResourceCallback
+{
+public:
+	AppApexResourceCallback::AppApexResourceCallback()
+		: mApexSDK(NULL)
+		, mLegacyModule(NULL)
+		, mProfiler(NULL)
+	{
+		mPathToMedia[0] = 0;
+	}
+
+	void setApexSDK(NxApexSDK * apexSDK)
+	{
+		mApexSDK = apexSDK;
+	}
+
+	// Loads the Legacy module into legacyModule the first time an asset fails to deserialize
+	void setLegacyOnDemand(NxModule*& legacyModule, AppStartupProfiler& profiler)
+	{
+		mLegacyModule = &legacyModule;
+		mProfiler = &profiler;
+	}
+
+	// This method is intended to find the specified path (in this case "media") in 
+	// a folder above the current folder.
+	// It will typically leave something like "../../../../../media" in the outBuffer
+	bool searchForPath(const char* path, char* outBuffer, int outBufferSize, int maxRecursion)
+	{
+		char* tmpBuffer = (char*)alloca(outBufferSize);
+		strcpy_s(outBuffer, outBufferSize, path);
+		for(int i = 0; i < maxRecursion; i++)
+		{
+			if(GetFileAttributes(outBuffer) == INVALID_FILE_ATTRIBUTES)
+			{
+				sprintf_s(tmpBuffer, outBufferSize, "../%s", outBuffer);
+				strcpy_s(outBuffer, outBufferSize, tmpBuffer);
+			}
+			else 
+				return true;
+		}
+		return false;
+	}
+
+	// This method is called by APEX to retrieve resources
+	void* requestResource(const char* nameSpace, const char* name)
+	{
+		ConsoleTextColor consoleColor(FOREGROUND_GREEN);
+		if(!mApexSDK)
+		{
+			return NULL;
+		}
+
+		printf("requestResource called for <%s> %s\n", nameSpace, name);
+
+		if (!strcmp(nameSpace, APEX_MATERIALS_NAME_SPACE))
+		{
+			return &material;
+		}
+		// These strings should be pulled from the module headers
+		else if (!strcmp(nameSpace, NX_APEX_EMITTER_AUTHORING_TYPE_NAME) ||
+			!strcmp(nameSpace, NX_IOFX_AUTHORING_TYPE_NAME) ||
+			!strcmp(nameSpace, NX_BASIC_IOS_AUTHORING_TYPE_NAME) ||
+			!strcmp(nameSpace, NX_TURBULENCE_FS_AUTHORING_TYPE_NAME))
+		{
+			// find the path to the APEX media folder
+			if (mPathToMedia[0] == 0)
+			{
+				if (!searchForPath("media", mPathToMedia, sizeof(mPathToMedia), 20))
+				{
+					printf("Error: requestResources cannot find the media folder\n");
+					return NULL;
+				}
+			}
+
+			// make a file stream for the asset file
+			std::string filename;
+			filename += mPathToMedia;
+			filename += ASSET_PATH_UNDER_MEDIA;
+			filename += "/MinimalTurbulence/";
+			filename += name;
+			filename += ".apx";
+			PxFileBuf* fileStream = mApexSDK->createStream(filename.c_str(), PxFileBuf::OPEN_READ_ONLY);
+			if(!fileStream->isOpen())
+			{
+				printf("Error: requestResources failed to open %s\n", filename.c_str());
+				return NULL;
+			}
+
+			// deserialize the asset into an NxParameterized object
+			NxParameterized::Traits* traits = mApexSDK->getParameterizedTraits();
+			NxParameterized::Serializer* serializer = mApexSDK->createSerializer(NxParameterized::Serializer::NST_XML, traits);
+			
+			NxParameterized::Serializer::DeserializedData deserializedData;
+			NxParameterized::Serializer::ErrorType error = serializer->deserialize(*fileStream, deserializedData);
+			if (error != NxParameterized::Serializer::ERROR_NONE && loadLegacyModule())
+			{
+				// the Legacy module upgrades older asset versions, read the file again now it's here
+				fileStream->seek(0);
+				serializer->deserialize(*fileStream, deserializedData);
+			}
+			if (1 != deserializedData.size())
+			{
+				printf("Error: requestResources found %i objects in %s\n", deserializedData.size(), filename.c_str());
+				return NULL;
+			}
+
+			NxApexAsset* asset = mApexSDK->createAsset(deserializedData[0], name);
+			if (!asset)
+			{
+				printf("Error: requestResources failed to create asset from %s\n", filename.c_str());
+				return NULL;
+			}
+
+			return asset;
+		}
+		else
+		{
+			printf("requestResource: <%s> %s\n", nameSpace, name);
+		}
+
+		return NULL;
+	}
+
+	void releaseResource(const char* nameSpace, const char* name, void* resource)
+	{
+		ConsoleTextColor consoleColor(FOREGROUND_GREEN);
+		if(!mApexSDK)
+		{
+			return;
+		}
+		
+		printf("releaseResources called for <%s> %s\n", nameSpace, name);
+
+		if (!strcmp(nameSpace, NX_APEX_EMITTER_AUTHORING_TYPE_NAME) ||
+			!strcmp(nameSpace, NX_IOFX_AUTHORING_TYPE_NAME) ||
+			!strcmp(nameSpace, NX_BASIC_IOS_AUTHORING_TYPE_NAME) ||
+			!strcmp(nameSpace, NX_TURBULENCE_FS_AUTHORING_TYPE_NAME))
+		{
+			NxApexAsset* asset = reinterpret_cast<NxApexAsset*>(resource);
+			asset->release();
+		}
+	}
+
+	// false when the module isn't loaded on demand or was already loaded
+	bool loadLegacyModule()
+	{
+		if (!mLegacyModule || *mLegacyModule)
+		{
+			return false;
+		}
+
+		AppTimer timer;
+		*mLegacyModule = mApexSDK->createModule("Legacy");
+		mProfiler->record("Legacy module (on demand)", timer.elapsedMs());
+		return *mLegacyModule != NULL;
+	}
+
+	NxApexSDK*	mApexSDK;
+	char		mPathToMedia[MAX_PATH];
+	DummyMaterial material;
+	NxModule**	mLegacyModule;	// NULL unless the Legacy module is loaded on demand
+	AppStartupProfiler*	mProfiler;
+};
+
+// A part of the domain with its own render volume.  APEX hands every particle to the
+// highest priority volume containing it, so each region extracts only its own particles
+// and regions can be extracted concurrently.  A region can publish its sprites to its own
+// shared memory ring, so a consumer only maps the regions it is interested in.
+struct AppRenderRegion
+{
+	AppRenderRegion()
+		: priority(0)
+		, volume(NULL)
+		, sharedRing(NULL)
+		, objectCount(0)
+	{}
+
+	std::string				name;
+	PxBounds3				bounds;
+	PxU32					priority;
+	NxApexRenderVolume*		volume;			// NULL while the region is clipped away
+	AppSharedSpriteRing*	sharedRing;		// NULL unless the region is published on its own
+	PxU32					objectCount;	// as of the last extraction
+};
+
+// A callback sprite buffer class for APEX rendering, with room for the sprites the IOFX
+// asked for in getSpriteLayoutData
+class AppSpriteBuffer : public NxUserRenderSpriteBuffer
+{
+public:
+	AppSpriteBuffer() : mRegion(NULL), mSpriteCount(0), mOutputBegin(0), mOutputEnd(0)
+	{}
+
+	// Only copies the sprites, extraction runs on the main thread; the output job gathers
+	// them into the frame's AppSpriteFrame later
+	void writeBuffer(const void* data, physx::PxU32 firstSprite, physx::PxU32 numSprites)
+	{
+		if (mRegion)
+		{
+			APP_LOG_INFO(FOREGROUND_RED, "writeBuffer called for %i sprites in region %s\n", numSprites - firstSprite, mRegion->name.c_str());
+		}
+		else
+		{
+			APP_LOG_INFO(FOREGROUND_RED, "writeBuffer called for %i sprites with no context\n", numSprites - firstSprite);
+		}
+		
+		/* print position from data */
+		PxU32 maxSprites = PxU32(mSpriteData.size());
+		if (firstSprite >= maxSprites)
+		{
+			APP_LOG_WARN_LIMITED(4, FOREGROUND_RED, "Warning, writeBuffer called with firstSprite = %d\n", firstSprite);
+			return;
+		}
+
+		if ((firstSprite + numSprites) > maxSprites)
+		{
+			APP_LOG_WARN_LIMITED(4, FOREGROUND_RED, "Warning, writeBuffer called with %d sprites\n", numSprites);
+			numSprites = maxSprites - firstSprite;
+		}
+
+		AppSpriteConvert<SpriteData, SpriteData>::run(&mSpriteData[firstSprite], static_cast<const SpriteData*>(data), numSprites);
+		mSpriteCount = firstSprite + numSprites;
+
+		// several writes in one extraction widen the range that is output
+		if (mOutputBegin == mOutputEnd)
+		{
+			mOutputBegin = firstSprite;
+			mOutputEnd = mSpriteCount;
+		}
+		else
+		{
+			mOutputBegin = PxMin(mOutputBegin, firstSprite);
+			mOutputEnd = PxMax(mOutputEnd, mSpriteCount);
+		}
+	}
+
+	typedef AppApexSpriteLayout SpriteData;
+
+	std::vector<SpriteData>	mSpriteData;	// maxSprites of the buffer description
+	const AppRenderRegion*	mRegion;	// the region whose render volume created the buffer
+	PxU32				mSpriteCount;	// as of the last writeBuffer
+	PxU32				mOutputBegin;	// the sprites written since the last output
+	PxU32				mOutputEnd;
+};
+
+// The sprites of a frame, gathered from every sprite buffer and written out together.  With
+// a camera they are culled and depth sorted once for the whole frame, so sprites of
+// different buffers and regions blend in the right order.  The frame goes to the shared
+// ring, to the rings of the regions that have their own (in the same order) and to the log.
+class AppSpriteFrame
+{
+public:
+	typedef AppSpriteBuffer::SpriteData SpriteData;
+
+	void clear()
+	{
+		mSprites.clear();
+		mRegions.clear();
+	}
+
+	// Appends the sprites a buffer wrote since the last output and empties its range
+	void add(AppSpriteBuffer& buffer)
+	{
+		if (buffer.mOutputBegin != buffer.mOutputEnd)
+		{
+			add(&buffer.mSpriteData[buffer.mOutputBegin], buffer.mOutputEnd - buffer.mOutputBegin, buffer.mRegion);
+		}
+		buffer.mOutputBegin = buffer.mOutputEnd = 0;
+	}
+
+	void add(const SpriteData* sprites, PxU32 count, const AppRenderRegion* region)
+	{
+		mSprites.insert(mSprites.end(), sprites, sprites + count);
+		mRegions.insert(mRegions.end(), count, region);
+	}
+
+	PxU32 getCount() const
+	{
+		return PxU32(mSprites.size());
+	}
+
+	// Culls and sorts the frame, then publishes and logs what is left
+	void output(const AppSpriteBufferSettings& settings, const std::vector<AppRenderRegion>& regions)
+	{
+		selectOutput(settings);
+
+		// everything goes to the frame's ring, and to a region's ring when it has its own
+		if (settings.sharedRing && !mOrder.empty())
+		{
+			gatherPublished(NULL);
+			settings.sharedRing->append<AppSharedSpriteLayout>(&mPublished[0], PxU32(mPublished.size()));
+		}
+		for (PxU32 r = 0; r < regions.size(); r++)
+		{
+			if (regions[r].sharedRing)
+			{
+				gatherPublished(&regions[r]);
+				if (!mPublished.empty())
+				{
+					regions[r].sharedRing->append<AppSharedSpriteLayout>(&mPublished[0], PxU32(mPublished.size()));
+				}
+			}
+		}
+
+		if (mOrder.empty())
+		{
+			return;
+		}
+		APP_LOG_INFO(FOREGROUND_RED, "Position Data: \n");
+		for (PxU32 i = 0; i < mOrder.size(); i++)
+		{
+			const PxVec3& pos = mSprites[mOrder[i]].position();
+			APP_LOG_INFO(FOREGROUND_RED, " (%.1f, %.1f, %.1f)\n", pos.x, pos.y, pos.z);
+		}
+	}
+
+	// The sprites output by the last output(), as indices into the frame, farthest first
+	// with a camera and in the order they were added otherwise
+	PxU32 getOutputCount() const
+	{
+		return PxU32(mOrder.size());
+	}
+
+	const PxU32* getOutputOrder() const
+	{
+		return mOrder.empty() ? NULL : &mOrder[0];
+	}
+
+private:
+	void selectOutput(const AppSpriteBufferSettings& settings)
+	{
+		PxU32 count = getCount();
+		if (settings.camera)
+		{
+			PxU32 visibleCount = mCuller.process(*settings.cullingPool, *settings.camera, count ? &mSprites[0] : NULL, count);
+			mOrder.assign(mCuller.getOrder(), mCuller.getOrder() + visibleCount);
+			return;
+		}
+
+		mOrder.resize(count);
+		for (PxU32 i = 0; i < count; i++)
+		{
+			mOrder[i] = i;
+		}
+	}
+
+	// the output sprites of one region, or all of them, in output order
+	void gatherPublished(const AppRenderRegion* region)
+	{
+		mPublished.clear();
+		for (PxU32 i = 0; i < mOrder.size(); i++)
+		{
+			if (!region || mRegions[mOrder[i]] == region)
+			{
+				mPublished.push_back(mSprites[mOrder[i]]);
+			}
+		}
+	}
+
+	std::vector<SpriteData>				mSprites;
+	std::vector<const AppRenderRegion*>	mRegions;	// of every sprite
+	std::vector<PxU32>					mOrder;
+	std::vector<SpriteData>				mPublished;	// scratch for the rings
+	AppSpriteCuller						mCuller;
+};
+
+// A render resource callback class for APEX rendering
+class AppRenderResource : public NxUserRenderResource
+{
+public:
+	AppRenderResource::AppRenderResource()
+		: mSpriteBuffer(NULL)
+	{}
+
+	/** \brief Set vertex buffer range */
+	virtual void setVertexBufferRange(physx::PxU32 firstVertex, physx::PxU32 numVerts) {}
+	/** \brief Set index buffer range */
+	virtual void setIndexBufferRange(physx::PxU32 firstIndex, physx::PxU32 numIndices) {}
+	/** \brief Set bone buffer range */
+	virtual void setBoneBufferRange(physx::PxU32 firstBone, physx::PxU32 numBones) {}
+	/** \brief Set instance buffer range */
+	virtual void setInstanceBufferRange(physx::PxU32 firstInstance, physx::PxU32 numInstances) {}
+	/** \brief Set sprite buffer range */
+	virtual void setSpriteBufferRange(physx::PxU32 firstSprite, physx::PxU32 numSprites) 
+	{
+		APP_LOG_INFO(FOREGROUND_RED | FOREGROUND_INTENSITY, "setSpriteBufferRange: first(%i) count(%i)\n", firstSprite, numSprites);
+	}
+
+	/** \brief Set material */
+	virtual void setMaterial(void* material) 
+	{}
+
+	/** \brief Get number of vertex buffers */
+	virtual physx::PxU32				getNbVertexBuffers() const 
+	{
+		return 0;
+	}
+	/** \brief Get vertex buffer */
+	virtual NxUserRenderVertexBuffer*	getVertexBuffer(physx::PxU32 index) const 
+	{
+		return NULL;
+	}
+
+	/** \brief Get index buffer */
+	virtual NxUserRenderIndexBuffer*	getIndexBuffer() const
+	{
+		return NULL;
+	}
+
+	/** \brief Get bone buffer */
+	virtual NxUserRenderBoneBuffer*		getBoneBuffer() const 
+	{
+		return NULL;
+	}
+
+	/** \brief Get instance buffer */
+	virtual NxUserRenderInstanceBuffer*	getInstanceBuffer() const
+	{
+		return NULL;
+	}
+
+	/** \brief Get sprite buffer */
+	virtual NxUserRenderSpriteBuffer*	getSpriteBuffer() const
+	{
+		return mSpriteBuffer;
+	}
+
+	// directly accessed by the Render Resource Manager
+	NxUserRenderSpriteBuffer*	mSpriteBuffer;
+};
+
+// A render resource manager for APEX (APEX will create render buffers through this interface)
+class AppRenderResourceManager : public NxUserRenderResourceManager
+{
+public:
+	AppRenderResourceManager()
+	{
+		InitializeCriticalSection(&mListLock);
+	}
+
+	~AppRenderResourceManager()
+	{
+		DeleteCriticalSection(&mListLock);
+	}
+
+	// We're not using vertex, index, bone, or instance buffers in this exercise
+	virtual NxUserRenderVertexBuffer*   createVertexBuffer(const NxUserRenderVertexBufferDesc& desc)     
+	{
+		return NULL;
+	}
+	virtual void                        releaseVertexBuffer(NxUserRenderVertexBuffer& buffer)            
+	{}
+
+	virtual NxUserRenderIndexBuffer*    createIndexBuffer(const NxUserRenderIndexBufferDesc& desc)       
+	{
+		return NULL;
+	}
+	virtual void                        releaseIndexBuffer(NxUserRenderIndexBuffer& buffer)              
+	{}
+
+	virtual NxUserRenderBoneBuffer*     createBoneBuffer(const NxUserRenderBoneBufferDesc& desc)         
+	{
+		return NULL;
+	}
+	virtual void                        releaseBoneBuffer(NxUserRenderBoneBuffer& buffer)                
+	{}
+
+	virtual NxUserRenderInstanceBuffer* createInstanceBuffer(const NxUserRenderInstanceBufferDesc& desc) 
+	{
+		return NULL;
+	}
+	virtual void                        releaseInstanceBuffer(NxUserRenderInstanceBuffer& buffer)        
+	{}
+
+	virtual NxUserRenderSurfaceBuffer* createSurfaceBuffer(const NxUserRenderSurfaceBufferDesc& desc) 
+	{
+		return NULL;
+	}
+	virtual void                        releaseSurfaceBuffer(NxUserRenderSurfaceBuffer& buffer)        
+	{}
+
+	// Just a predicate for removing the released buffers and resources from our stl lists
+	class AppMatchesRenderResource
+	{
+	public:
+		AppMatchesRenderResource::AppMatchesRenderResource(NxUserRenderResource* rr)
+			: mToBeRemovedResource(rr)
+		{}
+
+		bool operator() (const AppRenderResource& value)
+		{
+			const NxUserRenderResource* rr = reinterpret_cast<const NxUserRenderResource*>(&value);
+			return (rr == mToBeRemovedResource);
+		}
+
+		AppMatchesRenderResource::AppMatchesRenderResource(NxUserRenderSpriteBuffer* rr)
+			: mToBeRemovedSpriteBuffer(rr)
+		{}
+
+		bool operator() (const AppSpriteBuffer& value)
+		{
+			const NxUserRenderSpriteBuffer* rr = reinterpret_cast<const NxUserRenderSpriteBuffer*>(&value);
+			return (rr == mToBeRemovedSpriteBuffer);
+		}
+
+		NxUserRenderResource*		mToBeRemovedResource;
+		NxUserRenderSpriteBuffer*	mToBeRemovedSpriteBuffer;
+	};
+
+
+	virtual NxUserRenderSpriteBuffer*   createSpriteBuffer(const NxUserRenderSpriteBufferDesc& desc)     
+	{
+		APP_LOG_INFO(FOREGROUND_BLUE|FOREGROUND_RED, "NxUserRenderResourceManager::createSpriteBuffer called\n");
+		EnterCriticalSection(&mListLock);
+		mSpriteBufferList.push_back(AppSpriteBuffer());
+		AppSpriteBuffer* spriteBuffer = &(mSpriteBufferList.back());
+		spriteBuffer->mSpriteData.resize(desc.maxSprites);
+		LeaveCriticalSection(&mListLock);
+		return spriteBuffer;
+	}
+
+	virtual void                        releaseSpriteBuffer(NxUserRenderSpriteBuffer& buffer)            
+	{
+		APP_LOG_INFO(FOREGROUND_BLUE|FOREGROUND_RED, "NxUserRenderResourceManager::releaseSpriteBuffer called\n");
+		EnterCriticalSection(&mListLock);
+		mSpriteBufferList.remove_if(AppMatchesRenderResource(&buffer));
+		LeaveCriticalSection(&mListLock);
+	}
+
+	virtual NxUserRenderResource*       createResource(const NxUserRenderResourceDesc& desc)             
+	{
+		APP_LOG_INFO(FOREGROUND_GREEN|FOREGROUND_RED, "NxUserRenderResourceManager::createResource called\n");
+		EnterCriticalSection(&mListLock);
+		mRenderResourceList.push_back(AppRenderResource());
+		AppRenderResource* resource = &(mRenderResourceList.back());
+		resource->mSpriteBuffer = desc.spriteBuffer;
+		LeaveCriticalSection(&mListLock);
+		
+		// Let's setup the context so the sprite buffer's 'writeBuffer' method will know who it is,
+		// the render data is the region passed to updateRenderResources
+		AppSpriteBuffer* spriteBuffer = reinterpret_cast<AppSpriteBuffer*>(desc.spriteBuffer);
+		spriteBuffer->mRegion = static_cast<const AppRenderRegion*>(desc.userRenderData);
+		
+		return resource;
+	}
+
+	virtual void                        releaseResource(NxUserRenderResource& resource)                  
+	{
+		APP_LOG_INFO(FOREGROUND_GREEN|FOREGROUND_RED, "NxUserRenderResourceManager::releaseResource called\n");
+		EnterCriticalSection(&mListLock);
+		mRenderResourceList.remove_if(AppMatchesRenderResource(&resource));
+		LeaveCriticalSection(&mListLock);
+	}
+
+	virtual physx::PxU32                getMaxBonesForMaterial(void* material) 
+	{
+		return PX_MAX_U32;
+	}
+
+	/** \brief Get the sprite layout data */
+	virtual bool getSpriteLayoutData(physx::PxU32 spriteCount, physx::PxU32 spriteSemanticsBitmap, physx::apex::NxUserRenderSpriteBufferDesc* bufferDesc)
+	{
+		// the IOFX asks for what its modifiers output, our layout is fixed at compile time
+		PxU32 missing = missingSpriteSemantics(spriteSemanticsBitmap, AppSpriteBuffer::SpriteData::SEMANTICS);
+		if (missing)
+		{
+			APP_LOG_WARN(FOREGROUND_GREEN|FOREGROUND_RED, "Warning, the sprite layout lacks the requested semantics 0x%x\n", missing);
+		}
+
+		AppSpriteBuffer::SpriteData::describe(bufferDesc->semanticOffsets);
+		bufferDesc->stride = sizeof(AppSpriteBuffer::SpriteData);
+		bufferDesc->maxSprites = spriteCount;
+		bufferDesc->registerInCUDA = false;
+		bufferDesc->textureCount = 0;
+		return true;
+	}
+
+	/** \brief Get the instance layout data */
+	virtual bool getInstanceLayoutData(physx::PxU32 /*spriteCount*/, physx::PxU32 /*spriteSemanticsBitmap*/, physx::apex::NxUserRenderInstanceBufferDesc* /*instanceDescArray*/)
+	{
+		PX_ALWAYS_ASSERT(); // TODO TODO TODO : This needs to be implemented.
+		return false;
+	}
+
+
+	// These lists aren't required, but I thought it would be nice at some point
+	// to know what resources are out there...
+	std::list<AppRenderResource>	mRenderResourceList;
+	std::list<AppSpriteBuffer>		mSpriteBufferList;
+	CRITICAL_SECTION				mListLock;	// render volumes are extracted concurrently
+
+	AppSpriteBufferSettings			mSpriteBufferSettings;
+};
+
+
+// A callback class for APEX that handles the "dispatch render resources" calls
+class AppRenderer : public NxUserRenderer
+{
+	virtual void renderResource(const NxApexRenderContext& context)
+	{
+		//printf("renderResource called\n");
+	}
+};
+
+
+// A dense, cell-centered copy of a velocity field on a regular grid
+class AppVelocityGrid
+{
+public:
+	AppVelocityGrid()
+		: origin(0.0f)
+		, spacing(1.0f)
+	{
+		dims[0] = dims[1] = dims[2] = 0;
+	}
+
+	void resize(PxU32 x, PxU32 y, PxU32 z)
+	{
+		dims[0] = x;
+		dims[1] = y;
+		dims[2] = z;
+		velocity.resize(x * y * z);
+	}
+
+	PxU32 cellIndex(PxU32 x, PxU32 y, PxU32 z) const
+	{
+		return (z * dims[1] + y) * dims[0] + x;
+	}
+
+	// Copies the turbulence actor's current velocity field.  The actor hands out one
+	// float4 per cell (x varying fastest) for a grid centered on the pose we gave it.
+	bool capture(NxTurbulenceFSActor& actor, const PxVec3& gridCenter)
+	{
+		void* field = NULL;
+		PxU32 sizeX = 0, sizeY = 0, sizeZ = 0;
+		actor.getVelocityField(&field, sizeX, sizeY, sizeZ);
+		if (!field || !sizeX || !sizeY || !sizeZ)
+		{
+			return false;
+		}
+
+		resize(sizeX, sizeY, sizeZ);
+		PxVec3 gridSize = actor.getGridSize();
+		spacing = PxVec3(gridSize.x / sizeX, gridSize.y / sizeY, gridSize.z / sizeZ);
+		origin = gridCenter - gridSize * 0.5f + spacing * 0.5f;
+
+		const PxVec4* src = static_cast<const PxVec4*>(field);
+		for (PxU32 i = 0; i < velocity.size(); i++)
+		{
+			velocity[i] = src[i].getXYZ();
+		}
+		return true;
+	}
+
+	// the box the cells cover
+	PxBounds3 getBounds() const
+	{
+		PxVec3 low = origin - spacing * 0.5f;
+		return PxBounds3(low, low + PxVec3(dims[0] * spacing.x, dims[1] * spacing.y, dims[2] * spacing.z));
+	}
+
+	// Trilinearly interpolates the field at a world position, clamped to the grid
+	PxVec3 sample(const PxVec3& pos) const
+	{
+		PxU32 x0, x1, y0, y1, z0, z1;
+		PxF32 tx, ty, tz;
+		splitCoord((pos.x - origin.x) / spacing.x, dims[0], x0, x1, tx);
+		splitCoord((pos.y - origin.y) / spacing.y, dims[1], y0, y1, ty);
+		splitCoord((pos.z - origin.z) / spacing.z, dims[2], z0, z1, tz);
+
+		PxVec3 v00 = velocity[cellIndex(x0, y0, z0)] * (1.0f - tx) + velocity[cellIndex(x1, y0, z0)] * tx;
+		PxVec3 v10 = velocity[cellIndex(x0, y1, z0)] * (1.0f - tx) + velocity[cellIndex(x1, y1, z0)] * tx;
+		PxVec3 v01 = velocity[cellIndex(x0, y0, z1)] * (1.0f - tx) + velocity[cellIndex(x1, y0, z1)] * tx;
+		PxVec3 v11 = velocity[cellIndex(x0, y1, z1)] * (1.0f - tx) + velocity[cellIndex(x1, y1, z1)] * tx;
+		PxVec3 v0 = v00 * (1.0f - ty) + v10 * ty;
+		PxVec3 v1 = v01 * (1.0f - ty) + v11 * ty;
+		return v0 * (1.0f - tz) + v1 * tz;
+	}
+
+	PxU32				dims[3];
+	PxVec3				origin;		// center of cell (0,0,0)
+	PxVec3				spacing;
+	std::vector<PxVec3>	velocity;
+
+private:
+	static void splitCoord(PxF32 g, PxU32 dim, PxU32& i0, PxU32& i1, PxF32& t)
+	{
+		g = PxClamp(g, 0.0f, PxF32(dim - 1));
+		i0 = PxU32(g);
+		i1 = PxMin(i0 + 1, dim - 1);
+		t = g - PxF32(i0);
+	}
+};
+
+
+// A sparse velocity grid for domains much larger than the turbulence box.  The domain is
+// split into bricks of BRICK_DIM^3 cells that are only allocated where particles or
+// emitter sources are, and freed again after a number of frames without either, so memory
+// follows the occupied volume instead of the bounding volume.  Bricks are found through an
+// open addressing hash table keyed by brick coordinates.
+//
+// Each step relaxes the cells toward the dense turbulence field where the turbulence box
+// covers them, and toward the background (external) velocity everywhere else.  The CPU
+// particles (AppCpuParticles) are carried by the field.
+class AppSparseVelocityGrid
+{
+public:
+	static const PxI32 BRICK_DIM = 8;
+	static const PxU32 BRICK_CELLS = BRICK_DIM * BRICK_DIM * BRICK_DIM;
+
+	struct Brick
+	{
+		PxI32	coord[3];
+		PxU32	lastTouched;
+		PxVec3	velocity[BRICK_CELLS];
+	};
+
+	AppSparseVelocityGrid()
+		: mCellSize(1.0f)
+		, mInvCellSize(1.0f)
+		, mIdleFrames(30)
+		, mRelaxTime(0.25f)
+		, mFrame(0)
+		, mBackground(0.0f)
+		, mTableMask(0)
+	{}
+
+	~AppSparseVelocityGrid()
+	{
+		clear();
+	}
+
+	void init(PxF32 cellSize, PxU32 idleFrames)
+	{
+		clear();
+		mCellSize = cellSize;
+		mInvCellSize = 1.0f / cellSize;
+		mIdleFrames = PxMax(idleFrames, 1u);
+		rebuildTable(64);
+	}
+
+	void clear()
+	{
+		for (PxU32 i = 0; i < mBricks.size(); i++)
+		{
+			delete mBricks[i];
+		}
+		for (PxU32 i = 0; i < mFreeBricks.size(); i++)
+		{
+			delete mFreeBricks[i];
+		}
+		mBricks.clear();
+		mFreeBricks.clear();
+		mTable.clear();
+		mTableMask = 0;
+	}
+
+	bool isEnabled() const
+	{
+		return !mTable.empty();
+	}
+
+	void setBackground(const PxVec3& velocity)
+	{
+		mBackground = velocity;
+	}
+
+	// Keeps the brick containing pos alive this frame.  Bricks across a face within one cell
+	// are kept as well, so that trilinear sampling never straddles a missing brick.
+	void touch(const PxVec3& pos)
+	{
+		PxI32 cell[3], lo[3], hi[3];
+		for (PxU32 a = 0; a < 3; a++)
+		{
+			cell[a] = PxI32(PxFloor(pos[a] * mInvCellSize));
+			PxI32 inBrick = cell[a] - brickOf(cell[a]) * BRICK_DIM;
+			lo[a] = inBrick == 0 ? -1 : 0;
+			hi[a] = inBrick == BRICK_DIM - 1 ? 1 : 0;
+		}
+
+		for (PxI32 z = lo[2]; z <= hi[2]; z++)
+		{
+			for (PxI32 y = lo[1]; y <= hi[1]; y++)
+			{
+				for (PxI32 x = lo[0]; x <= hi[0]; x++)
+				{
+					Brick* brick = findOrAllocate(brickOf(cell[0]) + x, brickOf(cell[1]) + y, brickOf(cell[2]) + z);
+					brick->lastTouched = mFrame;
+				}
+			}
+		}
+	}
+
+	// Advances the field by dt and frees the bricks that went idle.  dense may be NULL.
+	void step(AppWorkerPool& pool, PxF32 dt, const AppVelocityGrid* dense)
+	{
+		StepBody body(*this, 1.0f - PxExp(-dt / mRelaxTime), dense);
+		pool.parallelFor(PxU32(mBricks.size()), 1, body);
+
+		bool freed = false;
+		for (PxU32 i = 0; i < mBricks.size(); )
+		{
+			if (mFrame - mBricks[i]->lastTouched >= mIdleFrames)
+			{
+				releaseBrick(mBricks[i]);
+				mBricks[i] = mBricks.back();
+				mBricks.pop_back();
+				freed = true;
+			}
+			else
+			{
+				i++;
+			}
+		}
+		if (freed)
+		{
+			rebuildTable(PxU32(mTable.size()));
+		}
+		mFrame++;
+	}
+
+	// Trilinearly interpolates the field at a world position; unallocated space reads as
+	// the background velocity
+	PxVec3 sample(const PxVec3& pos) const
+	{
+		PxI32 i0[3];
+		PxF32 t[3];
+		for (PxU32 a = 0; a < 3; a++)
+		{
+			PxF32 g = pos[a] * mInvCellSize - 0.5f;
+			PxF32 f = PxFloor(g);
+			i0[a] = PxI32(f);
+			t[a] = g - f;
+		}
+
+		PxVec3 result(0.0f);
+		for (PxU32 corner = 0; corner < 8; corner++)
+		{
+			PxU32 dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+			PxF32 w = (dx ? t[0] : 1.0f - t[0]) * (dy ? t[1] : 1.0f - t[1]) * (dz ? t[2] : 1.0f - t[2]);
+			result += cellVelocity(i0[0] + dx, i0[1] + dy, i0[2] + dz) * w;
+		}
+		return result;
+	}
+
+	PxU32 getBrickCount() const
+	{
+		return PxU32(mBricks.size());
+	}
+
+	size_t getMemoryBytes() const
+	{
+		return (mBricks.size() + mFreeBricks.size()) * sizeof(Brick) + mTable.size() * sizeof(PxU32);
+	}
+
+private:
+	static const PxU32 MAX_FREE_BRICKS = 64;
+
+	class StepBody : public AppRangeBody
+	{
+	public:
+		StepBody(AppSparseVelocityGrid& grid, PxF32 blend, const AppVelocityGrid* dense)
+			: mGrid(grid), mBlend(blend), mDense(dense)
+		{
+			if (dense)
+			{
+				PxBounds3 bounds = dense->getBounds();
+				mDenseMin = bounds.minimum;
+				mDenseMax = bounds.maximum;
+			}
+		}
+
+		void run(PxU32 /*chunk*/, PxU32 begin, PxU32 end)
+		{
+			for (PxU32 b = begin; b < end; b++)
+			{
+				Brick& brick = *mGrid.mBricks[b];
+				PxVec3 base = PxVec3(PxF32(brick.coord[0]), PxF32(brick.coord[1]), PxF32(brick.coord[2])) * PxF32(BRICK_DIM);
+				PxVec3* v = brick.velocity;
+				for (PxI32 z = 0; z < BRICK_DIM; z++)
+				{
+					for (PxI32 y = 0; y < BRICK_DIM; y++)
+					{
+						for (PxI32 x = 0; x < BRICK_DIM; x++, v++)
+						{
+							PxVec3 pos = (base + PxVec3(x + 0.5f, y + 0.5f, z + 0.5f)) * mGrid.mCellSize;
+							PxVec3 target = mGrid.mBackground;
+							if (mDense && pos.x >= mDenseMin.x && pos.y >= mDenseMin.y && pos.z >= mDenseMin.z &&
+								pos.x < mDenseMax.x && pos.y < mDenseMax.y && pos.z < mDenseMax.z)
+							{
+								target = mDense->sample(pos);
+							}
+							*v += (target - *v) * mBlend;
+						}
+					}
+				}
+			}
+		}
+
+		AppSparseVelocityGrid&	mGrid;
+		PxF32					mBlend;
+		const AppVelocityGrid*	mDense;
+		PxVec3					mDenseMin;
+		PxVec3					mDenseMax;
+
+	private:
+		StepBody& operator=(const StepBody&);
+	};
+
+	static PxI32 brickOf(PxI32 cell)
+	{
+		return cell >= 0 ? cell / BRICK_DIM : (cell - BRICK_DIM + 1) / BRICK_DIM;
+	}
+
+	static PxU32 hash(PxI32 x, PxI32 y, PxI32 z)
+	{
+		PxU32 h = PxU32(x) * 73856093u ^ PxU32(y) * 19349663u ^ PxU32(z) * 83492791u;
+		return h ^ (h >> 16);
+	}
+
+	// table slots hold brick index + 1, zero marks an empty slot
+	const Brick* find(PxI32 x, PxI32 y, PxI32 z) const
+	{
+		for (PxU32 slot = hash(x, y, z) & mTableMask; mTable[slot]; slot = (slot + 1) & mTableMask)
+		{
+			const Brick* brick = mBricks[mTable[slot] - 1];
+			if (brick->coord[0] == x && brick->coord[1] == y && brick->coord[2] == z)
+			{
+				return brick;
+			}
+		}
+		return NULL;
+	}
+
+	Brick* findOrAllocate(PxI32 x, PxI32 y, PxI32 z)
+	{
+		const Brick* existing = find(x, y, z);
+		if (existing)
+		{
+			return const_cast<Brick*>(existing);
+		}
+
+		Brick* brick = NULL;
+		if (!mFreeBricks.empty())
+		{
+			brick = mFreeBricks.back();
+			mFreeBricks.pop_back();
+		}
+		else
+		{
+			brick = new Brick;
+		}
+		brick->coord[0] = x;
+		brick->coord[1] = y;
+		brick->coord[2] = z;
+		for (PxU32 i = 0; i < BRICK_CELLS; i++)
+		{
+			brick->velocity[i] = mBackground;
+		}
+		mBricks.push_back(brick);
+
+		// keep the load factor under one half
+		if (mBricks.size() * 2 > mTable.size())
+		{
+			rebuildTable(PxU32(mTable.size()) * 2);
+		}
+		else
+		{
+			insert(PxU32(mBricks.size()) - 1);
+		}
+		return brick;
+	}
+
+	void insert(PxU32 index)
+	{
+		const Brick* brick = mBricks[index];
+		PxU32 slot = hash(brick->coord[0], brick->coord[1], brick->coord[2]) & mTableMask;
+		while (mTable[slot])
+		{
+			slot = (slot + 1) & mTableMask;
+		}
+		mTable[slot] = index + 1;
+	}
+
+	void rebuildTable(PxU32 size)
+	{
+		mTable.assign(size, 0);
+		mTableMask = size - 1;
+		for (PxU32 i = 0; i < mBricks.size(); i++)
+		{
+			insert(i);
+		}
+	}
+
+	void releaseBrick(Brick* brick)
+	{
+		if (mFreeBricks.size() < MAX_FREE_BRICKS)
+		{
+			mFreeBricks.push_back(brick);
+		}
+		else
+		{
+			delete brick;
+		}
+	}
+
+	PxVec3 cellVelocity(PxI32 x, PxI32 y, PxI32 z) const
+	{
+		PxI32 bx = brickOf(x), by = brickOf(y), bz = brickOf(z);
+		const Brick* brick = find(bx, by, bz);
+		if (!brick)
+		{
+			return mBackground;
+		}
+		return brick->velocity[((z - bz * BRICK_DIM) * BRICK_DIM + (y - by * BRICK_DIM)) * BRICK_DIM + (x - bx * BRICK_DIM)];
+	}
+
+	PxF32				mCellSize;
+	PxF32				mInvCellSize;
+	PxU32				mIdleFrames;
+	PxF32				mRelaxTime;		// seconds for the cells to close ~63% of the gap to their target
+	PxU32				mFrame;
+	PxVec3				mBackground;
+	std::vector<Brick*>	mBricks;
+	std::vector<Brick*>	mFreeBricks;
+	std::vector<PxU32>	mTable;
+	PxU32				mTableMask;
+};
+
+
+// Writes snapshots of a velocity grid as chunked Zarr (v2) arrays, one array per exported
+// frame in a group at the export directory, so they can be opened with zarr, xarray or
+// ParaView.  The region of interest and stride are applied on the simulation thread (a
+// cheap strided copy); the chunks are cut and written on a background thread so the frame
+// never waits on the disk.
+class AppVolumeExporter
+{
+public:
+	struct Config
+	{
+		Config()
+			: everyNFrames(1)
+			, stride(1)
+			, chunkSize(32)
+		{
+			roiMin[0] = roiMin[1] = roiMin[2] = 0;
+			roiMax[0] = roiMax[1] = roiMax[2] = PX_MAX_U32;
+		}
+
+		std::string	directory;
+		PxU32		everyNFrames;
+		PxU32		stride;
+		PxU32		chunkSize;
+		PxU32		roiMin[3];	// in grid cells
+		PxU32		roiMax[3];	// exclusive, clamped to the grid
+	};
+
+	AppVolumeExporter()
+		: mThread(NULL)
+		, mWakeEvent(NULL)
+		, mQuit(0)
+		, mDropped(0)
+	{
+		InitializeCriticalSection(&mLock);
+	}
+
+	~AppVolumeExporter()
+	{
+		stop();
+		DeleteCriticalSection(&mLock);
+	}
+
+	bool start(const Config& config)
+	{
+		mConfig = config;
+		mConfig.everyNFrames = PxMax(mConfig.everyNFrames, 1u);
+		mConfig.stride = PxMax(mConfig.stride, 1u);
+		mConfig.chunkSize = PxMax(mConfig.chunkSize, 1u);
+
+		if (!CreateDirectory(mConfig.directory.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+		{
+			printf("Error: volume export cannot create directory %s\n", mConfig.directory.c_str());
+			return false;
+		}
+
+		// the directory is the Zarr group the frame arrays are opened through
+		const char group[] = "{\"zarr_format\": 2}\n";
+		if (!writeFile(mConfig.directory + "/.zgroup", group, sizeof(group) - 1))
+		{
+			return false;
+		}
+
+		mQuit = 0;
+		mWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		mThread = CreateThread(NULL, 0, writerThreadMain, this, 0, NULL);
+		return mThread != NULL;
+	}
+
+	// Waits for the queued snapshots to be written, then stops the writer thread
+	void stop()
+	{
+		if (!mThread)
+		{
+			return;
+		}
+
+		InterlockedExchange(&mQuit, 1);
+		SetEvent(mWakeEvent);
+		WaitForSingleObject(mThread, INFINITE);
+		CloseHandle(mThread);
+		CloseHandle(mWakeEvent);
+		mThread = NULL;
+		mWakeEvent = NULL;
+
+		if (mDropped)
+		{
+			printf("Warning, volume export dropped %u frames because the writer fell behind\n", mDropped);
+		}
+	}
+
+	bool isExportFrame(PxU32 frame) const
+	{
+		return mThread != NULL && (frame % mConfig.everyNFrames) == 0;
+	}
+
+	// Queues the configured region of the grid for writing.  The frame is dropped rather
+	// than stalling the simulation when the writer already has MAX_PENDING snapshots queued.
+	void submit(PxU32 frame, PxF32 time, const AppVelocityGrid& grid)
+	{
+		Snapshot* snapshot = new Snapshot;
+		snapshot->frame = frame;
+		snapshot->time = time;
+
+		PxU32 roiMin[3];
+		for (PxU32 a = 0; a < 3; a++)
+		{
+			PxU32 roiMax = PxMin(mConfig.roiMax[a], grid.dims[a]);
+			roiMin[a] = PxMin(mConfig.roiMin[a], roiMax);
+			snapshot->dims[a] = (roiMax - roiMin[a] + mConfig.stride - 1) / mConfig.stride;
+		}
+		snapshot->origin = grid.origin + PxVec3(roiMin[0] * grid.spacing.x, roiMin[1] * grid.spacing.y, roiMin[2] * grid.spacing.z);
+		snapshot->spacing = grid.spacing * PxF32(mConfig.stride);
+
+		snapshot->data.resize(snapshot->dims[0] * snapshot->dims[1] * snapshot->dims[2] * 3);
+		PxF32* dst = snapshot->data.empty() ? NULL : &snapshot->data[0];
+		for (PxU32 z = 0; z < snapshot->dims[2]; z++)
+		{
+			for (PxU32 y = 0; y < snapshot->dims[1]; y++)
+			{
+				for (PxU32 x = 0; x < snapshot->dims[0]; x++)
+				{
+					const PxVec3& v = grid.velocity[grid.cellIndex(roiMin[0] + x * mConfig.stride, roiMin[1] + y * mConfig.stride, roiMin[2] + z * mConfig.stride)];
+					*dst++ = v.x;
+					*dst++ = v.y;
+					*dst++ = v.z;
+				}
+			}
+		}
+
+		bool queued = false;
+		EnterCriticalSection(&mLock);
+		if (mQueue.size() < MAX_PENDING)
+		{
+			mQueue.push_back(snapshot);
+			queued = true;
+		}
+		LeaveCriticalSection(&mLock);
+
+		if (queued)
+		{
+			SetEvent(mWakeEvent);
+		}
+		else
+		{
+			mDropped++;
+			delete snapshot;
+		}
+	}
+
+private:
+	struct Snapshot
+	{
+		PxU32				frame;
+		PxF32				time;
+		PxU32				dims[3];	// x, y, z
+		PxVec3				origin;
+		PxVec3				spacing;
+		std::vector<PxF32>	data;		// z, y, x, component (C order)
+	};
+
+	static const PxU32 MAX_PENDING = 4;
+
+	static DWORD WINAPI writerThreadMain(LPVOID param)
+	{
+		AppVolumeExporter* exporter = static_cast<AppVolumeExporter*>(param);
+		for (;;)
+		{
+			Snapshot* snapshot = NULL;
+			EnterCriticalSection(&exporter->mLock);
+			if (!exporter->mQueue.empty())
+			{
+				snapshot = exporter->mQueue.front();
+				exporter->mQueue.pop_front();
+			}
+			LeaveCriticalSection(&exporter->mLock);
+
+			if (snapshot)
+			{
+				exporter->writeSnapshot(*snapshot);
+				delete snapshot;
+			}
+			else if (exporter->mQuit)
+			{
+				break;
+			}
+			else
+			{
+				WaitForSingleObject(exporter->mWakeEvent, INFINITE);
+			}
+		}
+		return 0;
+	}
+
+	static bool writeFile(const std::string& path, const void* data, size_t size)
+	{
+		FILE* file = NULL;
+		if (fopen_s(&file, path.c_str(), "wb") != 0 || !file)
+		{
+			printf("Error: volume export cannot write %s\n", path.c_str());
+			return false;
+		}
+		bool ok = fwrite(data, 1, size, file) == size;
+		fclose(file);
+		return ok;
+	}
+
+	// Writes one frame as <directory>/velocity_<frame>.zarr, an uncompressed float32
+	// array of shape (z, y, x, 3) split into chunkSize^3 tiles
+	void writeSnapshot(const Snapshot& snapshot)
+	{
+		char name[64];
+		sprintf_s(name, sizeof(name), "/velocity_%06u.zarr", snapshot.frame);
+		std::string arrayPath = mConfig.directory + name;
+		if (!CreateDirectory(arrayPath.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+		{
+			printf("Error: volume export cannot create directory %s\n", arrayPath.c_str());
+			return;
+		}
+
+		PxU32 chunk[3];
+		for (PxU32 a = 0; a < 3; a++)
+		{
+			chunk[a] = PxMax(PxMin(mConfig.chunkSize, snapshot.dims[a]), 1u);
+		}
+
+		char meta[512];
+		int len = sprintf_s(meta, sizeof(meta),
+			"{\"zarr_format\": 2, \"shape\": [%u, %u, %u, 3], \"chunks\": [%u, %u, %u, 3], "
+			"\"dtype\": \"<f4\", \"compressor\": null, \"fill_value\": 0.0, \"order\": \"C\", \"filters\": null}\n",
+			snapshot.dims[2], snapshot.dims[1], snapshot.dims[0], chunk[2], chunk[1], chunk[0]);
+		writeFile(arrayPath + "/.zarray", meta, len);
+
+		len = sprintf_s(meta, sizeof(meta),
+			"{\"frame\": %u, \"time\": %g, \"origin\": [%g, %g, %g], \"spacing\": [%g, %g, %g], "
+			"\"axes\": [\"z\", \"y\", \"x\", \"component\"]}\n",
+			snapshot.frame, snapshot.time,
+			snapshot.origin.z, snapshot.origin.y, snapshot.origin.x,
+			snapshot.spacing.z, snapshot.spacing.y, snapshot.spacing.x);
+		writeFile(arrayPath + "/.zattrs", meta, len);
+
+		// Zarr requires edge chunks to be stored at full size, padded with the fill value
+		std::vector<PxF32> tile(chunk[0] * chunk[1] * chunk[2] * 3);
+		for (PxU32 cz = 0; cz * chunk[2] < snapshot.dims[2]; cz++)
+		{
+			for (PxU32 cy = 0; cy * chunk[1] < snapshot.dims[1]; cy++)
+			{
+				for (PxU32 cx = 0; cx * chunk[0] < snapshot.dims[0]; cx++)
+				{
+					std::fill(tile.begin(), tile.end(), 0.0f);
+					PxU32 nx = PxMin(chunk[0], snapshot.dims[0] - cx * chunk[0]);
+					PxU32 ny = PxMin(chunk[1], snapshot.dims[1] - cy * chunk[1]);
+					PxU32 nz = PxMin(chunk[2], snapshot.dims[2] - cz * chunk[2]);
+					for (PxU32 z = 0; z < nz; z++)
+					{
+						for (PxU32 y = 0; y < ny; y++)
+						{
+							PxU32 src = ((cz * chunk[2] + z) * snapshot.dims[1] + cy * chunk[1] + y) * snapshot.dims[0] + cx * chunk[0];
+							PxU32 dst = (z * chunk[1] + y) * chunk[0];
+							memcpy(&tile[dst * 3], &snapshot.data[src * 3], nx * 3 * sizeof(PxF32));
+						}
+					}
+
+					char key[64];
+					sprintf_s(key, sizeof(key), "/%u.%u.%u.0", cz, cy, cx);
+					writeFile(arrayPath + key, &tile[0], tile.size() * sizeof(PxF32));
+				}
+			}
+		}
+	}
+
+	Config					mConfig;
+	std::list<Snapshot*>	mQueue;
+	CRITICAL_SECTION		mLock;
+	HANDLE					mThread;
+	HANDLE					mWakeEvent;
+	volatile LONG			mQuit;
+	PxU32					mDropped;
+};
+
+
+// A procedural wind field: the sum of curl noise, vortices turning around vertical axes and
+// a wind that shears linearly with height.  Points are evaluated four at a time with SSE.
+// Particles sample a cache of the field that is refreshed once per frame on a grid over
+// the domain; only points outside of the grid are evaluated directly.
+class AppWindField
+{
+public:
+	struct Vortex
+	{
+		PxVec3	center;		// any point on the axis
+		PxF32	strength;	// speed at one radius from the axis, counterclockwise seen from above
+		PxF32	radius;
+	};
+
+	struct Config
+	{
+		Config()
+			: curlAmplitude(0.0f)
+			, curlScale(8.0f)
+			, curlSpeed(1.0f)
+			, shearBase(0.0f)
+			, shearGradient(0.0f)
+			, gridCells(32)
+		{}
+
+		bool isEnabled() const
+		{
+			return curlAmplitude > 0.0f || !vortices.empty() || !shearBase.isZero() || !shearGradient.isZero();
+		}
+
+		PxF32				curlAmplitude;	// 0 disables the curl noise
+		PxF32				curlScale;		// size of the largest noise features
+		PxF32				curlSpeed;		// how fast the noise changes, radians per second
+		PxVec3				shearBase;		// velocity at y = 0
+		PxVec3				shearGradient;	// change of velocity per unit of height
+		std::vector<Vortex>	vortices;
+		PxU32				gridCells;		// cache nodes along each axis
+	};
+
+	AppWindField()
+		: mPool(NULL)
+		, mCells(0)
+		, mTime(0.0f)
+		, mMean(0.0f)
+	{}
+
+	void init(const Config& config, const PxBounds3& domain, AppWorkerPool& pool)
+	{
+		mConfig = config;
+		mPool = &pool;
+		mCells = PxMax(config.gridCells, 2u);
+		mOrigin = domain.minimum;
+		mSpacing = (domain.maximum - domain.minimum) * (1.0f / (mCells - 1));
+		mInvSpacing = PxVec3(1.0f / mSpacing.x, 1.0f / mSpacing.y, 1.0f / mSpacing.z);
+		mCache.resize(mCells * mCells * mCells);
+		mRowSums.resize(mCells * mCells);
+	}
+
+	bool isEnabled() const
+	{
+		return mPool != NULL;
+	}
+
+	PxU32 getNodeCount() const
+	{
+		return PxU32(mCache.size());
+	}
+
+	// Refreshes the cache for the given time, once per frame and while nobody samples
+	void update(PxF32 time)
+	{
+		mTime = time;
+		CacheBody body(*this);
+		PxU32 rows = mCells * mCells;
+		mPool->parallelFor(rows, mPool->suggestChunkSize(rows, 16), body);
+
+		PxVec3 sum(0.0f);
+		for (PxU32 i = 0; i < rows; i++)
+		{
+			sum += mRowSums[i];
+		}
+		mMean = sum * (1.0f / mCache.size());
+	}
+
+	// the field averaged over the grid, as of the last update
+	const PxVec3& getMean() const
+	{
+		return mMean;
+	}
+
+	// The field at each position as of the last update: interpolated from the cache inside
+	// the grid, evaluated directly outside of it.  Several threads may sample at once.
+	void sample(const PxVec3* positions, PxVec3* velocities, PxU32 count) const
+	{
+		// the points outside are gathered and evaluated four at a time
+		PxU32 lanes[4];
+		PxU32 outside = 0;
+		PxF32 last = PxF32(mCells - 1);
+		for (PxU32 i = 0; i < count; i++)
+		{
+			PxVec3 f = (positions[i] - mOrigin).multiply(mInvSpacing);
+			if (f.x >= 0.0f && f.y >= 0.0f && f.z >= 0.0f && f.x <= last && f.y <= last && f.z <= last)
+			{
+				velocities[i] = interpolate(f);
+				continue;
+			}
+
+			lanes[outside++] = i;
+			if (outside == 4)
+			{
+				evaluateLanes(positions, velocities, lanes, 4);
+				outside = 0;
+			}
+		}
+
+		// a short batch repeats its last point
+		if (outside)
+		{
+			for (PxU32 l = outside; l < 4; l++)
+			{
+				lanes[l] = lanes[outside - 1];
+			}
+			evaluateLanes(positions, velocities, lanes, outside);
+		}
+	}
+
+	// lane by lane, a where the mask is set and b elsewhere
+	static __m128 select4(__m128 mask, __m128 a, __m128 b)
+	{
+		return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+	}
+
+	// sin of four lanes to within 2e-4: wrapped to [-pi, pi], folded to [-pi/2, pi/2] and
+	// a 7th order Taylor polynomial from there
+	static __m128 sin4(__m128 x)
+	{
+		const __m128 pi = _mm_set1_ps(3.14159265f);
+		const __m128 halfPi = _mm_set1_ps(1.57079633f);
+		__m128 turns = _mm_cvtepi32_ps(_mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(0.159154943f))));
+		x = _mm_sub_ps(x, _mm_mul_ps(turns, _mm_set1_ps(6.28318531f)));
+		x = select4(_mm_cmpgt_ps(x, halfPi), _mm_sub_ps(pi, x), x);
+		x = select4(_mm_cmplt_ps(x, _mm_sub_ps(_mm_setzero_ps(), halfPi)), _mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), pi), x), x);
+
+		__m128 x2 = _mm_mul_ps(x, x);
+		__m128 p = _mm_set1_ps(-1.0f / 5040.0f);
+		p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(1.0f / 120.0f));
+		p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(-1.0f / 6.0f));
+		p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(1.0f));
+		return _mm_mul_ps(p, x);
+	}
+
+	static __m128 cos4(__m128 x)
+	{
+		return sin4(_mm_add_ps(x, _mm_set1_ps(1.57079633f)));
+	}
+
+private:
+	static const PxU32 CURL_OCTAVES = 3;
+
+	// Fills the cache one row along x at a time, the row index is y + z * cells
+	class CacheBody : public AppRangeBody
+	{
+	public:
+		CacheBody(AppWindField& field)
+			: mField(field)
+		{}
+
+		void run(PxU32 /*chunk*/, PxU32 begin, PxU32 end)
+		{
+			AppWindField& f = mField;
+			const __m128 laneOffsets = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+			for (PxU32 row = begin; row < end; row++)
+			{
+				PxU32 y = row % f.mCells;
+				PxU32 z = row / f.mCells;
+				PxVec3* out = &f.mCache[row * f.mCells];
+				__m128 py = _mm_set1_ps(f.mOrigin.y + y * f.mSpacing.y);
+				__m128 pz = _mm_set1_ps(f.mOrigin.z + z * f.mSpacing.z);
+
+				PxVec3 sum(0.0f);
+				for (PxU32 x = 0; x < f.mCells; x += 4)
+				{
+					__m128 px = _mm_add_ps(_mm_set1_ps(f.mOrigin.x + x * f.mSpacing.x), _mm_mul_ps(laneOffsets, _mm_set1_ps(f.mSpacing.x)));
+					__m128 vx, vy, vz;
+					f.evaluate4(px, py, pz, vx, vy, vz);
+
+					PxU32 lanes[4] = { x, x + 1, x + 2, x + 3 };
+					PxU32 valid = PxMin(4u, f.mCells - x);
+					store4(vx, vy, vz, out, lanes, valid);
+					for (PxU32 l = 0; l < valid; l++)
+					{
+						sum += out[x + l];
+					}
+				}
+				f.mRowSums[row] = sum;
+			}
+		}
+
+	private:
+		CacheBody& operator=(const CacheBody&);
+
+		AppWindField&	mField;
+	};
+
+	// evaluates the points at four indices, the first count of them are stored
+	void evaluateLanes(const PxVec3* p, PxVec3* velocities, const PxU32* lanes, PxU32 count) const
+	{
+		__m128 vx, vy, vz;
+		evaluate4(_mm_setr_ps(p[lanes[0]].x, p[lanes[1]].x, p[lanes[2]].x, p[lanes[3]].x),
+			_mm_setr_ps(p[lanes[0]].y, p[lanes[1]].y, p[lanes[2]].y, p[lanes[3]].y),
+			_mm_setr_ps(p[lanes[0]].z, p[lanes[1]].z, p[lanes[2]].z, p[lanes[3]].z), vx, vy, vz);
+		store4(vx, vy, vz, velocities, lanes, count);
+	}
+
+	static void store4(__m128 vx, __m128 vy, __m128 vz, PxVec3* out, const PxU32* lanes, PxU32 count)
+	{
+		PX_ALIGN(16, PxF32 x[4]);
+		PX_ALIGN(16, PxF32 y[4]);
+		PX_ALIGN(16, PxF32 z[4]);
+		_mm_store_ps(x, vx);
+		_mm_store_ps(y, vy);
+		_mm_store_ps(z, vz);
+		for (PxU32 l = 0; l < count; l++)
+		{
+			out[lanes[l]] = PxVec3(x[l], y[l], z[l]);
+		}
+	}
+
+	// The field at four points at the current time
+	void evaluate4(__m128 x, __m128 y, __m128 z, __m128& vx, __m128& vy, __m128& vz) const
+	{
+		const Config& c = mConfig;
+
+		// shear
+		vx = _mm_add_ps(_mm_set1_ps(c.shearBase.x), _mm_mul_ps(_mm_set1_ps(c.shearGradient.x), y));
+		vy = _mm_add_ps(_mm_set1_ps(c.shearBase.y), _mm_mul_ps(_mm_set1_ps(c.shearGradient.y), y));
+		vz = _mm_add_ps(_mm_set1_ps(c.shearBase.z), _mm_mul_ps(_mm_set1_ps(c.shearGradient.z), y));
+
+		// vortices, the tangential speed 2s(d/r) / (1 + (d/r)^2) peaks at s one radius out
+		const __m128 one = _mm_set1_ps(1.0f);
+		for (PxU32 i = 0; i < c.vortices.size(); i++)
+		{
+			const Vortex& v = c.vortices[i];
+			__m128 rx = _mm_sub_ps(x, _mm_set1_ps(v.center.x));
+			__m128 rz = _mm_sub_ps(z, _mm_set1_ps(v.center.z));
+			__m128 d2 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(rx, rx), _mm_mul_ps(rz, rz)), _mm_set1_ps(1.0f / (v.radius * v.radius)));
+			__m128 scale = _mm_div_ps(_mm_set1_ps(2.0f * v.strength / v.radius), _mm_add_ps(one, d2));
+			vx = _mm_sub_ps(vx, _mm_mul_ps(rz, scale));
+			vz = _mm_add_ps(vz, _mm_mul_ps(rx, scale));
+		}
+
+		// curl noise, the curl of the potential
+		//   (sin(ky + a) cos(kz), sin(kz + b) cos(kx), sin(kx + c) cos(ky))
+		// summed over octaves; a curl has no divergence, so the noise neither gathers
+		// particles nor spreads them out
+		if (c.curlAmplitude <= 0.0f)
+		{
+			return;
+		}
+		PxF32 k = 6.28318531f / c.curlScale;
+		PxF32 weight = c.curlAmplitude / 3.5f;	// the octaves' weights 1 + 1/2 + 1/4, and two terms per axis
+		for (PxU32 o = 0; o < CURL_OCTAVES; o++)
+		{
+			__m128 kk = _mm_set1_ps(k);
+			__m128 kx = _mm_mul_ps(kk, x);
+			__m128 ky = _mm_mul_ps(kk, y);
+			__m128 kz = _mm_mul_ps(kk, z);
+			__m128 a = _mm_add_ps(ky, _mm_set1_ps(mTime * c.curlSpeed + o * 1.7f));
+			__m128 b = _mm_add_ps(kz, _mm_set1_ps(mTime * c.curlSpeed * 1.3f + o * 2.9f));
+			__m128 e = _mm_add_ps(kx, _mm_set1_ps(mTime * c.curlSpeed * 0.7f + o * 4.1f));
+
+			__m128 sinA = sin4(a), cosA = cos4(a);
+			__m128 sinB = sin4(b), cosB = cos4(b);
+			__m128 sinE = sin4(e), cosE = cos4(e);
+			__m128 sinKx = sin4(kx), cosKx = cos4(kx);
+			__m128 sinKy = sin4(ky), cosKy = cos4(ky);
+			__m128 sinKz = sin4(kz), cosKz = cos4(kz);
+
+			__m128 w = _mm_set1_ps(-weight);
+			vx = _mm_add_ps(vx, _mm_mul_ps(w, _mm_add_ps(_mm_mul_ps(sinE, sinKy), _mm_mul_ps(cosB, cosKx))));
+			vy = _mm_add_ps(vy, _mm_mul_ps(w, _mm_add_ps(_mm_mul_ps(sinA, sinKz), _mm_mul_ps(cosE, cosKy))));
+			vz = _mm_add_ps(vz, _mm_mul_ps(w, _mm_add_ps(_mm_mul_ps(sinB, sinKx), _mm_mul_ps(cosA, cosKz))));
+
+			k *= 2.0f;
+			weight *= 0.5f;
+		}
+	}
+
+	// trilinear, f is the position in cells and inside the grid
+	PxVec3 interpolate(const PxVec3& f) const
+	{
+		PxU32 x = PxMin(PxU32(f.x), mCells - 2);
+		PxU32 y = PxMin(PxU32(f.y), mCells - 2);
+		PxU32 z = PxMin(PxU32(f.z), mCells - 2);
+		PxF32 tx = f.x - x, ty = f.y - y, tz = f.z - z;
+
+		const PxVec3* c = &mCache[(z * mCells + y) * mCells + x];
+		PxU32 dy = mCells, dz = mCells * mCells;
+		PxVec3 c00 = c[0] + (c[1] - c[0]) * tx;
+		PxVec3 c10 = c[dy] + (c[dy + 1] - c[dy]) * tx;
+		PxVec3 c01 = c[dz] + (c[dz + 1] - c[dz]) * tx;
+		PxVec3 c11 = c[dz + dy] + (c[dz + dy + 1] - c[dz + dy]) * tx;
+		PxVec3 c0 = c00 + (c10 - c00) * ty;
+		PxVec3 c1 = c01 + (c11 - c01) * ty;
+		return c0 + (c1 - c0) * tz;
+	}
+
+	Config				mConfig;
+	AppWorkerPool*		mPool;
+	PxU32				mCells;
+	PxVec3				mOrigin;
+	PxVec3				mSpacing;
+	PxVec3				mInvSpacing;
+	PxF32				mTime;
+	PxVec3				mMean;
+	std::vector<PxVec3>	mCache;		// x fastest, then y, then z
+	std::vector<PxVec3>	mRowSums;
+};
+
+// Particles simulated on the CPU instead of by the APEX IOS, for velocity fields APEX cannot
+// apply: each step pulls a particle's velocity toward the flow at its position, moves it and
+// ages it, then removes the particles whose life is over.  The state is one array per
+// attribute, so a step streams through it.  Every particle gets an id in emission order that
+// it keeps for its life, also when reorder moves it in storage.
+class AppCpuParticles
+{
+public:
+	struct Config
+	{
+		Config()
+			: capacity(0)
+			, lifetime(5.0f)
+			, dragTime(0.1f)
+		{}
+
+		PxU32	capacity;	// 0 disables the CPU path
+		PxF32	lifetime;	// seconds
+		PxF32	dragTime;	// seconds for a particle to close ~63% of the gap to the flow
+	};
+
+	// What carries the particles: the sparse grid when there is one, it covers the whole
+	// domain, otherwise the dense turbulence field inside its box.  The wind blows on top of
+	// either, everywhere.  Particles that no source reaches keep their velocity.
+	struct Flow
+	{
+		Flow()
+			: sparse(NULL)
+			, dense(NULL)
+			, wind(NULL)
+		{}
+
+		const AppSparseVelocityGrid*	sparse;
+		const AppVelocityGrid*			dense;
+		const AppWindField*				wind;
+	};
+
+	AppCpuParticles()
+		: mNextId(0)
+		, mDropped(0)
+	{}
+
+	void init(const Config& config)
+	{
+		mConfig = config;
+		mPositions.reserve(config.capacity);
+		mVelocities.reserve(config.capacity);
+		mLife.reserve(config.capacity);
+		mIds.reserve(config.capacity);
+	}
+
+	bool isEnabled() const
+	{
+		return mConfig.capacity > 0;
+	}
+
+	// Appends particles with their whole life ahead; the ones that do not fit in the
+	// capacity are dropped.  They are numbered in emission order unless ids are given, as
+	// the ranks of a split domain do so that every rank numbers a particle alike.  Returns
+	// how many were emitted.
+	PxU32 emit(const PxVec3* positions, const PxVec3* velocities, PxU32 count, const PxU32* ids = NULL)
+	{
+		PxU32 emitted = PxMin(count, mConfig.capacity - getCount());
+		mPositions.insert(mPositions.end(), positions, positions + emitted);
+		mVelocities.insert(mVelocities.end(), velocities, velocities + emitted);
+		mLife.insert(mLife.end(), emitted, 1.0f);
+		for (PxU32 i = 0; i < emitted; i++)
+		{
+			addId(ids ? ids[i] : mNextId);
+		}
+		mDropped += count - emitted;
+		return emitted;
+	}
+
+	// Removes the particles outside of the slab and queues them as its emigrants, the
+	// others keep their order.  Returns how many left.
+	PxU32 emigrate(AppSlabDecomposition& slabs)
+	{
+		PxU32 count = getCount();
+		PxU32 kept = 0;
+		for (PxU32 i = 0; i < count; i++)
+		{
+			if (slabs.owns(mPositions[i]))
+			{
+				mPositions[kept] = mPositions[i];
+				mVelocities[kept] = mVelocities[i];
+				mLife[kept] = mLife[i];
+				mIds[kept] = mIds[i];
+				kept++;
+				continue;
+			}
+
+			AppSlabDecomposition::Migrant migrant;
+			migrant.position = mPositions[i];
+			migrant.velocity = mVelocities[i];
+			migrant.life = mLife[i];
+			migrant.id = mIds[i];
+			slabs.emigrate(migrant);
+		}
+		mPositions.resize(kept);
+		mVelocities.resize(kept);
+		mLife.resize(kept);
+		mIds.resize(kept);
+		return count - kept;
+	}
+
+	// Appends the particles another rank handed over, as they were there; the ones that
+	// do not fit are dropped
+	void adopt(const std::vector<AppSlabDecomposition::Migrant>& migrants)
+	{
+		PxU32 adopted = PxMin(PxU32(migrants.size()), mConfig.capacity - getCount());
+		for (PxU32 i = 0; i < adopted; i++)
+		{
+			mPositions.push_back(migrants[i].position);
+			mVelocities.push_back(migrants[i].velocity);
+			mLife.push_back(migrants[i].life);
+			addId(migrants[i].id);
+		}
+		mDropped += PxU32(migrants.size()) - adopted;
+	}
+
+	// Advances every particle by dt, then removes the dead ones; the others keep their order
+	void step(AppWorkerPool& pool, PxF32 dt, const Flow& flow)
+	{
+		PxU32 count = getCount();
+		if (count == 0)
+		{
+			return;
+		}
+
+		StepBody body(*this, dt, flow);
+		pool.parallelFor(count, pool.suggestChunkSize(count, 1024), body);
+
+		PxU32 kept = 0;
+		for (PxU32 i = 0; i < count; i++)
+		{
+			if (mLife[i] > 0.0f)
+			{
+				mPositions[kept] = mPositions[i];
+				mVelocities[kept] = mVelocities[i];
+				mLife[kept] = mLife[i];
+				mIds[kept] = mIds[i];
+				kept++;
+			}
+		}
+		mPositions.resize(kept);
+		mVelocities.resize(kept);
+		mLife.resize(kept);
+		mIds.resize(kept);
+	}
+
+	// Sorts the state by the Morton code of each particle's cell, so the next steps sample
+	// the field cell by cell instead of in emission order
+	void reorder(AppParticleReorder& morton)
+	{
+		PxU32 count = getCount();
+		if (count == 0)
+		{
+			return;
+		}
+
+		morton.sort(&mPositions[0], count);
+		morton.apply(&mPositions[0], count);
+		morton.apply(&mVelocities[0], count);
+		morton.apply(&mLife[0], count);
+		morton.apply(&mIds[0], count);
+	}
+
+	// The storage index of each particle in id (emission) order, the remap from ids to
+	// wherever reorder put the particles.  Valid until the next step or reorder.
+	const PxU32* sortById(AppWorkerPool& pool)
+	{
+		PxU32 idBits = 0;
+		while (idBits < 32 && (mNextId - 1) >> idBits)
+		{
+			idBits++;
+		}
+		mIdSort.sort(pool, getIds(), getCount(), idBits);
+		return mIdSort.getPermutation();
+	}
+
+	// Writes the particles as sprites, in storage order or in the order of the storage
+	// indices given.  The layout takes what it has of the position, velocity, remaining
+	// life and id (as the user data).
+	template <class Sprite>
+	void writeSprites(Sprite* sprites, const PxU32* order = NULL) const
+	{
+		typedef NxRenderSpriteLayoutElement E;
+		for (PxU32 i = 0; i < getCount(); i++)
+		{
+			PxU32 p = order ? order[i] : i;
+			AppFullSpriteLayout sprite;
+			sprite.get<E::POSITION_FLOAT3>() = mPositions[p];
+			sprite.get<E::VELOCITY_FLOAT3>() = mVelocities[p];
+			sprite.get<E::LIFE_REMAIN_FLOAT1>() = mLife[p];
+			sprite.get<E::DENSITY_FLOAT1>() = 0.0f;
+			sprite.get<E::COLOR_RGBA8>() = 0xffffffff;
+			sprite.get<E::USER_DATA_UINT1>() = mIds[p];
+			AppSpriteConvert<Sprite, AppFullSpriteLayout>::run(&sprites[i], &sprite, 1);
+		}
+	}
+
+	PxU32 getCount() const
+	{
+		return PxU32(mPositions.size());
+	}
+
+	// particles that did not fit, over the whole run
+	PxU32 getDroppedCount() const
+	{
+		return mDropped;
+	}
+
+	const PxVec3* getPositions() const
+	{
+		return mPositions.empty() ? NULL : &mPositions[0];
+	}
+
+	const PxVec3* getVelocities() const
+	{
+		return mVelocities.empty() ? NULL : &mVelocities[0];
+	}
+
+	// the fraction of its lifetime each particle has left
+	const PxF32* getLife() const
+	{
+		return mLife.empty() ? NULL : &mLife[0];
+	}
+
+	const PxU32* getIds() const
+	{
+		return mIds.empty() ? NULL : &mIds[0];
+	}
+
+private:
+	// sortById takes the bits of the largest id there is
+	void addId(PxU32 id)
+	{
+		mIds.push_back(id);
+		mNextId = PxMax(mNextId, id + 1);
+	}
+
+	class StepBody : public AppRangeBody
+	{
+	public:
+		StepBody(AppCpuParticles& particles, PxF32 dt, const Flow& flow)
+			: mParticles(particles)
+			, mDt(dt)
+			, mBlend(1.0f - PxExp(-dt / particles.mConfig.dragTime))
+			, mAging(dt / particles.mConfig.lifetime)
+			, mFlow(flow)
+		{
+			if (flow.dense)
+			{
+				mDenseBounds = flow.dense->getBounds();
+			}
+		}
+
+		void run(PxU32 /*chunk*/, PxU32 begin, PxU32 end)
+		{
+			PxVec3* positions = &mParticles.mPositions[0];
+			PxVec3* velocities = &mParticles.mVelocities[0];
+			PxF32* life = &mParticles.mLife[0];
+
+			// the wind is sampled a batch at a time, so its outside points go four to a call
+			PxVec3 wind[WIND_BATCH];
+			for (PxU32 batch = begin; batch < end; batch += WIND_BATCH)
+			{
+				PxU32 batchEnd = PxMin(batch + WIND_BATCH, end);
+				if (mFlow.wind)
+				{
+					mFlow.wind->sample(&positions[batch], wind, batchEnd - batch);
+				}
+
+				for (PxU32 i = batch; i < batchEnd; i++)
+				{
+					PxVec3 target = mFlow.wind ? wind[i - batch] : PxVec3(0.0f);
+					bool carried = mFlow.wind != NULL;
+					if (mFlow.sparse)
+					{
+						target += mFlow.sparse->sample(positions[i]);
+						carried = true;
+					}
+					else if (mFlow.dense && mDenseBounds.contains(positions[i]))
+					{
+						target += mFlow.dense->sample(positions[i]);
+						carried = true;
+					}
+
+					if (carried)
+					{
+						velocities[i] += (target - velocities[i]) * mBlend;
+					}
+					positions[i] += velocities[i] * mDt;
+					life[i] -= mAging;
+				}
+			}
+		}
+
+		static const PxU32 WIND_BATCH = 64;
+
+		AppCpuParticles&	mParticles;
+		PxF32				mDt;
+		PxF32				mBlend;
+		PxF32				mAging;
+		const Flow&			mFlow;
+		PxBounds3			mDenseBounds;
+
+	private:
+		StepBody& operator=(const StepBody&);
+	};
+
+	Config				mConfig;
+	std::vector<PxVec3>	mPositions;
+	std::vector<PxVec3>	mVelocities;
+	std::vector<PxF32>	mLife;
+	std::vector<PxU32>	mIds;
+	PxU32				mNextId;
+	PxU32				mDropped;
+	AppRadixSort		mIdSort;
+};
+
+// A closed loop controller that holds the frame time (simulate + fetch + extract) at a
+// target by adjusting the APEX LOD resource budget, and throttling emission once the
+// budget is at its floor.  It only acts after the smoothed frame time has stayed outside a
+// band around the target for a few frames, and it gives emission back before it raises
+// the budget again, so it settles instead of oscillating under bursty load.
+class AppLodController
+{
+public:
+	struct Config
+	{
+		Config()
+			: targetMs(0.0f)
+			, hysteresis(0.1f)
+			, minBudget(1.0f)
+			, minEmission(0.05f)
+			, dwellFrames(3)
+			, smoothing(0.3f)
+		{}
+
+		PxF32	targetMs;		// 0 disables the controller
+		PxF32	hysteresis;		// fraction of the target that counts as on target
+		PxF32	minBudget;
+		PxF32	minEmission;	// lowest fraction of the requested particles still emitted
+		PxU32	dwellFrames;	// frames outside the band before acting
+		PxF32	smoothing;		// weight of the newest frame in the moving average
+	};
+
+	AppLodController()
+		: mBudget(PX_MAX_F32)
+		, mEmissionScale(1.0f)
+		, mAverageMs(0.0f)
+		, mFramesOver(0)
+		, mFramesUnder(0)
+		, mFrame(0)
+	{}
+
+	void init(const Config& config)
+	{
+		mConfig = config;
+	}
+
+	bool isEnabled() const
+	{
+		return mConfig.targetMs > 0.0f;
+	}
+
+	PxF32 getBudget() const
+	{
+		return mBudget;
+	}
+
+	PxF32 getEmissionScale() const
+	{
+		return mEmissionScale;
+	}
+
+	// Feeds one frame's measurement; returns true when the budget changed
+	bool update(PxF32 frameMs, PxF32 resourceConsumed)
+	{
+		mAverageMs = mFrame == 0 ? frameMs : mAverageMs + (frameMs - mAverageMs) * mConfig.smoothing;
+		PxF32 high = mConfig.targetMs * (1.0f + mConfig.hysteresis);
+		PxF32 low = mConfig.targetMs * (1.0f - mConfig.hysteresis);
+		mFramesOver = mAverageMs > high ? mFramesOver + 1 : 0;
+		mFramesUnder = mAverageMs < low ? mFramesUnder + 1 : 0;
+
+		PxF32 oldBudget = mBudget;
+		const char* action = "hold";
+		if (mFramesOver >= mConfig.dwellFrames)
+		{
+			// scale the budget to what we would have needed to hit the target, never by
+			// more than half in one step; shed emission once the budget bottoms out
+			PxF32 ratio = PxMax(mConfig.targetMs / mAverageMs, 0.5f);
+			PxF32 current = mBudget == PX_MAX_F32 ? PxMax(resourceConsumed, mConfig.minBudget) : mBudget;
+			if (current > mConfig.minBudget)
+			{
+				mBudget = PxMax(current * ratio, mConfig.minBudget);
+				action = "lower budget";
+			}
+			else
+			{
+				mEmissionScale = PxMax(mEmissionScale * ratio, mConfig.minEmission);
+				action = "throttle emission";
+			}
+			mFramesOver = 0;
+		}
+		else if (mFramesUnder >= mConfig.dwellFrames)
+		{
+			// recover gently, emission first, and switch LOD off again once the budget
+			// is comfortably above what the scene consumes
+			if (mEmissionScale < 1.0f)
+			{
+				mEmissionScale = PxMin(mEmissionScale * 1.25f, 1.0f);
+				action = "restore emission";
+			}
+			else if (mBudget != PX_MAX_F32)
+			{
+				mBudget *= 1.1f;
+				if (mBudget > resourceConsumed * 4.0f)
+				{
+					mBudget = PX_MAX_F32;
+				}
+				action = "raise budget";
+			}
+			mFramesUnder = 0;
+		}
+
+		APP_LOG_INFO(0, "LOD frame %u: %.2f ms (avg %.2f, target %.2f) consumed %g budget %g emission %.0f%%: %s\n",
+			mFrame, frameMs, mAverageMs, mConfig.targetMs, resourceConsumed, mBudget, mEmissionScale * 100.0f, action);
+		mFrame++;
+		return mBudget != oldBudget;
+	}
+
+private:
+	Config	mConfig;
+	PxF32	mBudget;
+	PxF32	mEmissionScale;
+	PxF32	mAverageMs;
+	PxU32	mFramesOver;
+	PxU32	mFramesUnder;
+	PxU32	mFrame;
+};
+
+
+// A static collision mesh read from a Wavefront OBJ file.  Only vertices and faces are
+// used; polygons are split into triangle fans.
+class AppCollisionMesh
+{
+public:
+	bool loadObj(const char* path)
+	{
+		FILE* file = NULL;
+		if (fopen_s(&file, path, "r") != 0 || !file)
+		{
+			printf("Error: cannot open the mesh %s\n", path);
+			return false;
+		}
+
+		points.clear();
+		indices.clear();
+		bool ok = true;
+		char line[1024];
+		while (ok && fgets(line, sizeof(line), file))
+		{
+			if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t'))
+			{
+				PxVec3 p;
+				ok = sscanf_s(line + 2, "%f %f %f", &p.x, &p.y, &p.z) == 3;
+				points.push_back(p);
+			}
+			else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t'))
+			{
+				ok = parseFace(line + 2);
+			}
+		}
+		fclose(file);
+
+		if (!ok || indices.empty())
+		{
+			printf("Error: malformed or empty mesh %s\n", path);
+			return false;
+		}
+		return true;
+	}
+
+	PxU32 getTriangleCount() const
+	{
+		return PxU32(indices.size() / 3);
+	}
+
+	std::vector<PxVec3>	points;
+	std::vector<PxU32>	indices;	// three per triangle
+
+private:
+	// "f a b c ...", each corner "v", "v/vt", "v//vn" or "v/vt/vn"; negative indices count
+	// back from the last vertex read
+	bool parseFace(char* text)
+	{
+		PxU32 corners[3];
+		PxU32 cornerCount = 0;
+		char* context = NULL;
+		for (char* corner = strtok_s(text, " \t\r\n", &context); corner != NULL; corner = strtok_s(NULL, " \t\r\n", &context))
+		{
+			long index = strtol(corner, NULL, 10);
+			long resolved = index < 0 ? long(points.size()) + index : index - 1;
+			if (index == 0 || resolved < 0 || resolved >= long(points.size()))
+			{
+				return false;
+			}
+
+			if (cornerCount < 3)
+			{
+				corners[cornerCount] = PxU32(resolved);
+			}
+			else
+			{
+				corners[1] = corners[2];
+				corners[2] = PxU32(resolved);
+			}
+			if (++cornerCount >= 3)
+			{
+				indices.push_back(corners[0]);
+				indices.push_back(corners[1]);
+				indices.push_back(corners[2]);
+			}
+		}
+		return cornerCount >= 3;
+	}
+};
+
+// Cooked triangle meshes kept in a directory, keyed by a hash of the mesh data and the
+// cooking parameters.  A mesh is cooked on its first use and the cooked stream written to
+// the cache; later runs map the cached file and create the mesh straight from it.
+class AppCookedMeshCache
+{
+public:
+	AppCookedMeshCache()
+		: mPhysics(NULL)
+		, mCooking(NULL)
+	{}
+
+	bool init(PxPhysics& physics, PxCooking& cooking, const char* directory)
+	{
+		mPhysics = &physics;
+		mCooking = &cooking;
+		mDirectory = directory;
+		if (!CreateDirectory(mDirectory.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+		{
+			printf("Error: cannot create the mesh cache directory %s\n", directory);
+			return false;
+		}
+		return true;
+	}
+
+	// Returns the mesh from the cache, cooking and storing it on a miss
+	PxTriangleMesh* getMesh(const AppCollisionMesh& mesh, bool& cached)
+	{
+		PxU64 key = computeKey(mesh);
+		char name[32];
+		sprintf_s(name, sizeof(name), "%016llx.pxmesh", key);
+		std::string path = mDirectory + "\\" + name;
+
+		cached = true;
+		PxTriangleMesh* triangleMesh = loadCached(path, key);
+		if (triangleMesh)
+		{
+			return triangleMesh;
+		}
+
+		cached = false;
+		PxTriangleMeshDesc desc;
+		desc.points.count = PxU32(mesh.points.size());
+		desc.points.stride = sizeof(PxVec3);
+		desc.points.data = &mesh.points[0];
+		desc.triangles.count = mesh.getTriangleCount();
+		desc.triangles.stride = 3 * sizeof(PxU32);
+		desc.triangles.data = &mesh.indices[0];
+
+		PxDefaultMemoryOutputStream stream;
+		if (!desc.isValid() || !mCooking->cookTriangleMesh(desc, stream))
+		{
+			printf("Error cooking a triangle mesh\n");
+			return NULL;
+		}
+
+		// a failed store only costs the next run another cooking pass
+		store(path, key, stream.getData(), stream.getSize());
+
+		PxDefaultMemoryInputData input(stream.getData(), stream.getSize());
+		return mPhysics->createTriangleMesh(input);
+	}
+
+private:
+	struct FileHeader
+	{
+		PxU32	magic;
+		PxU32	physicsVersion;
+		PxU64	key;
+		PxU32	size;		// cooked bytes following the header
+		PxU32	reserved;
+	};
+
+	static const PxU32 MAGIC = 0x4d534d43;	// "CMSM"
+
+	// 64 bit FNV-1a over everything that changes the cooked result.  The cooking parameters
+	// are hashed field by field, their padding bytes are undefined; fields that only some
+	// PhysX 3.3 releases have keep their defaults here, and the SDK version is hashed too.
+	PxU64 computeKey(const AppCollisionMesh& mesh) const
+	{
+		PxU64 hash = 14695981039346656037ULL;
+		PxU32 pointCount = PxU32(mesh.points.size());
+		PxU32 indexCount = PxU32(mesh.indices.size());
+		const PxCookingParams& params = mCooking->getParams();
+		hash = hashValue(hash, PxU32(PX_PHYSICS_VERSION));
+		hash = hashValue(hash, PxU32(params.targetPlatform));
+		hash = hashValue(hash, params.skinWidth);
+		hash = hashValue(hash, PxU8(params.suppressTriangleMeshRemapTable));
+		hash = hashValue(hash, PxU8(params.buildTriangleAdjacencies));
+		hash = hashValue(hash, params.scale.length);
+		hash = hashValue(hash, params.scale.mass);
+		hash = hashValue(hash, params.scale.speed);
+		hash = hashBytes(hash, &pointCount, sizeof(pointCount));
+		hash = hashBytes(hash, &mesh.points[0], pointCount * sizeof(PxVec3));
+		hash = hashBytes(hash, &indexCount, sizeof(indexCount));
+		hash = hashBytes(hash, &mesh.indices[0], indexCount * sizeof(PxU32));
+		return hash;
+	}
+
+	static PxU64 hashBytes(PxU64 hash, const void* data, size_t size)
+	{
+		const PxU8* bytes = static_cast<const PxU8*>(data);
+		for (size_t i = 0; i < size; i++)
+		{
+			hash = (hash ^ bytes[i]) * 1099511628211ULL;
+		}
+		return hash;
+	}
+
+	template <class T>
+	static PxU64 hashValue(PxU64 hash, T value)
+	{
+		return hashBytes(hash, &value, sizeof(value));
+	}
+
+	// Maps the cached file and creates the mesh from the mapped bytes; NULL when there is
+	// no usable entry
+	PxTriangleMesh* loadCached(const std::string& path, PxU64 key)
+	{
+		HANDLE file = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return NULL;
+		}
+
+		PxTriangleMesh* triangleMesh = NULL;
+		LARGE_INTEGER fileSize;
+		HANDLE mapping = NULL;
+		const PxU8* view = NULL;
+		if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart >= LONGLONG(sizeof(FileHeader)))
+		{
+			mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		}
+		if (mapping)
+		{
+			view = static_cast<const PxU8*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		}
+		if (view)
+		{
+			const FileHeader* header = reinterpret_cast<const FileHeader*>(view);
+			if (header->magic == MAGIC && header->physicsVersion == PX_PHYSICS_VERSION && header->key == key &&
+				LONGLONG(sizeof(FileHeader)) + header->size == fileSize.QuadPart)
+			{
+				PxDefaultMemoryInputData input(const_cast<PxU8*>(view + sizeof(FileHeader)), header->size);
+				triangleMesh = mPhysics->createTriangleMesh(input);
+			}
+			UnmapViewOfFile(view);
+		}
+		if (mapping)
+		{
+			CloseHandle(mapping);
+		}
+		CloseHandle(file);
+		return triangleMesh;
+	}
+
+	// Writes next to the entry and renames it into place, so that a concurrent or
+	// interrupted run never sees a partial file
+	bool store(const std::string& path, PxU64 key, const PxU8* data, PxU32 size)
+	{
+		char suffix[32];
+		sprintf_s(suffix, sizeof(suffix), ".%u.tmp", GetCurrentProcessId());
+		std::string tempPath = path + suffix;
+
+		HANDLE file = CreateFile(tempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			printf("Warning, cannot write the mesh cache entry %s\n", tempPath.c_str());
+			return false;
+		}
+
+		FileHeader header;
+		header.magic = MAGIC;
+		header.physicsVersion = PX_PHYSICS_VERSION;
+		header.key = key;
+		header.size = size;
+		header.reserved = 0;
+
+		DWORD written = 0;
+		bool ok = WriteFile(file, &header, sizeof(header), &written, NULL) && written == sizeof(header) &&
+			WriteFile(file, data, size, &written, NULL) && written == size;
+		CloseHandle(file);
+
+		if (!ok || !MoveFileEx(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+		{
+			printf("Warning, cannot write the mesh cache entry %s\n", path.c_str());
+			DeleteFile(tempPath.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	PxPhysics*		mPhysics;
+	PxCooking*		mCooking;
+	std::string		mDirectory;
+};
+
+
+// Explicit emitter actors created from one shared asset.  Released emitters are parked with
+// an empty particle list and handed out again instead of being destroyed, since creating an
+// actor costs far more than keeping an idle one.
+//
+// The spawns of all emitters for a frame are submitted together: one counting sort groups
+// them by emitter, then a single sweep hands each emitter its slice.  Emitters with nothing
+// to emit this frame or last frame are not touched at all.
+class AppEmitterPool
+{
+public:
+	static const PxU32 INVALID = PX_MAX_U32;
+
+	AppEmitterPool()
+		: mAsset(NULL)
+		, mScene(NULL)
+		, mCreated(0)
+	{}
+
+	~AppEmitterPool()
+	{
+		destroy();
+	}
+
+	void init(NxApexAsset& asset, NxApexScene& scene)
+	{
+		mAsset = &asset;
+		mScene = &scene;
+	}
+
+	// Creates actors up front so that acquire does not create them mid-frame
+	bool reserve(PxU32 freeCount)
+	{
+		while (mFree.size() < freeCount)
+		{
+			if (!createEmitter())
+			{
+				return false;
+			}
+			mFree.push_back(PxU32(mEmitters.size()) - 1);
+		}
+		return true;
+	}
+
+	// Hands out a parked emitter, or creates one; INVALID on failure
+	PxU32 acquire()
+	{
+		if (mFree.empty() && !reserve(1))
+		{
+			return INVALID;
+		}
+
+		PxU32 handle = mFree.back();
+		mFree.pop_back();
+		mEmitters[handle].active = true;
+		return handle;
+	}
+
+	// Parks the emitter; its particle list is cleared by the next submit
+	void recycle(PxU32 handle)
+	{
+		if (handle < mEmitters.size() && mEmitters[handle].active)
+		{
+			mEmitters[handle].active = false;
+			mFree.push_back(handle);
+		}
+	}
+
+	void destroy()
+	{
+		for (PxU32 i = 0; i < mEmitters.size(); i++)
+		{
+			mEmitters[i].actor->release();
+		}
+		mEmitters.clear();
+		mFree.clear();
+	}
+
+	NxApexEmitterActor* getActor(PxU32 handle) const
+	{
+		return handle < mEmitters.size() ? mEmitters[handle].actor : NULL;
+	}
+
+	PxU32 getActiveCount() const
+	{
+		return PxU32(mEmitters.size() - mFree.size());
+	}
+
+	// actors created over the pool's lifetime, recycled ones are not counted again
+	PxU32 getCreatedCount() const
+	{
+		return mCreated;
+	}
+
+	// Replaces the particle lists of all emitters; spawns for parked or unknown emitters
+	// are dropped.  The grouping is stable, so each emitter keeps the caller's order.
+	void submit(const PxVec3* positions, const PxVec3* velocities, const PxU32* emitters, PxU32 count)
+	{
+		PxU32 emitterCount = PxU32(mEmitters.size());
+		mOffsets.assign(emitterCount + 1, 0);
+		for (PxU32 i = 0; i < count; i++)
+		{
+			if (isActive(emitters[i]))
+			{
+				mOffsets[emitters[i] + 1]++;
+			}
+		}
+		for (PxU32 e = 0; e < emitterCount; e++)
+		{
+			mOffsets[e + 1] += mOffsets[e];
+		}
+
+		mPositions.resize(mOffsets[emitterCount]);
+		mVelocities.resize(mOffsets[emitterCount]);
+		mCursor.assign(mOffsets.begin(), mOffsets.end() - 1);
+		for (PxU32 i = 0; i < count; i++)
+		{
+			if (isActive(emitters[i]))
+			{
+				PxU32 slot = mCursor[emitters[i]]++;
+				mPositions[slot] = positions[i];
+				mVelocities[slot] = velocities[i];
+			}
+		}
+
+		for (PxU32 e = 0; e < emitterCount; e++)
+		{
+			Emitter& emitter = mEmitters[e];
+			PxU32 first = mOffsets[e];
+			PxU32 emitted = mOffsets[e + 1] - first;
+			if (emitted == 0 && emitter.listed == 0)
+			{
+				continue;
+			}
+
+			emitter.geom->resetParticleList();
+			if (emitted)
+			{
+				emitter.geom->addParticleList(emitted, &mPositions[first], &mVelocities[first]);
+			}
+			emitter.listed = emitted;
+		}
+	}
+
+private:
+	struct Emitter
+	{
+		NxApexEmitterActor*		actor;
+		NxEmitterExplicitGeom*	geom;
+		PxU32					listed;	// particles in the emitter's list
+		bool					active;
+	};
+
+	bool isActive(PxU32 handle) const
+	{
+		return handle < mEmitters.size() && mEmitters[handle].active;
+	}
+
+	bool createEmitter()
+	{
+		if (!mAsset || !mScene)
+		{
+			return false;
+		}
+
+		// keep the asset's own particle list out of it, the app supplies every particle
+		NxParameterized::Interface* actorParams = mAsset->getDefaultActorDesc();
+		NxParameterized::setParamBool(*actorParams, "emitAssetParticles", false);
+
+		NxApexEmitterActor* actor = static_cast<NxApexEmitterActor*>(mAsset->createApexActor(*actorParams, *mScene));
+		if (!actor)
+		{
+			printf("Failed to create the APEX Emitter Actor\n");
+			return false;
+		}
+
+		Emitter emitter;
+		emitter.actor = actor;
+		emitter.geom = actor->isExplicitGeom();
+		emitter.listed = 0;
+		emitter.active = false;
+		if (!emitter.geom)
+		{
+			printf("Error: the emitter asset does not have an explicit geometry\n");
+			actor->release();
+			return false;
+		}
+
+		// emit whatever is in the particle list every frame
+		actor->startEmit(true);
+		mEmitters.push_back(emitter);
+		mCreated++;
+		return true;
+	}
+
+	NxApexAsset*			mAsset;
+	NxApexScene*			mScene;
+	PxU32					mCreated;
+	std::vector<Emitter>	mEmitters;
+	std::vector<PxU32>		mFree;
+	std::vector<PxU32>		mOffsets;
+	std::vector<PxU32>		mCursor;
+	std::vector<PxVec3>		mPositions;
+	std::vector<PxVec3>		mVelocities;
+};
+
+
+// Where the simulation may run.  GPU preferred uses CUDA when a context can be created and
+// falls back to the CPU otherwise; CPU only never touches CUDA at all.
+enum AppExecutionPolicy
+{
+	APP_EXECUTION_CPU_ONLY,
+	APP_EXECUTION_GPU_PREFERRED
+};
+
+
+// What the configured scene needs from PhysX and APEX.  By default everything is loaded up
+// front; a lazy start only loads what the options call for, and the Legacy module only
+// once an asset turns out to need upgrading.
+struct AppStartupPlan
+{
+	AppStartupPlan()
+		: lazy(false)
+		, cuda(true)
+		, turbulence(true)
+	{}
+
+	bool	lazy;
+	bool	cuda;		// worth probing for a CUDA device
+	bool	turbulence;	// the TurbulenceFS module
+};
+
+
+// Options parsed from the command line.  Each option is a "name" or "name=value" token;
+// WinMain hands us the whole command line as one argument, so tokens are split on
+// whitespace here as well.
+class AppOptions
+{
+public:
+	AppOptions()
+		: useTurbulence(true)
+		, executionPolicy(APP_EXECUTION_GPU_PREFERRED)
+		, mortonReorderFrames(0)
+		, outputById(false)
+		, benchmarkMorton(false)
+		, sparseCellSize(0.0f)
+		, sparseIdleFrames(30)
+		, sharedSlots(8)
+		, sharedMaxSprites(4096)
+		, emitterCount(1)
+		, benchmarkEmitters(false)
+		, meshCacheDirectory("cookedMeshes")
+		, rankCount(1)
+		, rank(0)
+		, slabDomainMin(0.0f)
+		, slabDomainMax(16.0f)
+		, useCamera(false)
+		, useRenderDomain(false)
+		, renderDomain(PxVec3(0.0f), PxVec3(0.0f))
+		, frameCount(8)
+		, metricsPort(0)
+		, lazyStartup(false)
+	{
+		renderTiles[0] = renderTiles[1] = renderTiles[2] = 1;
+	}
+
+	// Everything up front, unless lazyStartup was passed
+	AppStartupPlan getStartupPlan() const
+	{
+		AppStartupPlan plan;
+		if (lazyStartup)
+		{
+			plan.lazy = true;
+			plan.cuda = useTurbulence;
+			plan.turbulence = useTurbulence;
+		}
+		return plan;
+	}
+
+	bool parse(int argc, char** argv)
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			std::string arg(argv[i]);
+			char* context = NULL;
+			for (char* token = strtok_s(&arg[0], " \t", &context); token != NULL; token = strtok_s(NULL, " \t", &context))
+			{
+				if (!parseOption(token))
+				{
+					printf("Error: unknown or malformed option %s\n", token);
+					return false;
+				}
+			}
+		}
+
+		// the ranks of a split domain must simulate every particle like a single process
+		// would: the sparse grid's bricks and the LOD controller's emission depend on what
+		// each rank holds and how fast it runs
+		if (rankCount > 1 && (sparseCellSize > 0.0f || lod.targetMs > 0.0f))
+		{
+			printf("Error: ranks cannot be combined with sparseGrid or targetFrameMs\n");
+			return false;
+		}
+		return true;
+	}
+
+	bool						useTurbulence;
+	AppExecutionPolicy			executionPolicy;
+	AppVolumeExporter::Config	volumeExport;	// disabled while the directory is empty
+	PxU32						mortonReorderFrames;	// 0 never sorts the CPU particles
+	bool						outputById;		// CPU particles go out in emission order
+	bool						benchmarkMorton;
+	AppCpuParticles::Config		cpuParticles;
+	PxF32						sparseCellSize;	// 0 disables the sparse grid
+	PxU32						sparseIdleFrames;
+	std::string					sharedSprites;			// shared memory ring name, empty when off
+	PxU32						sharedSlots;
+	PxU32						sharedMaxSprites;		// per slot
+	std::string					consumeSharedSprites;	// run as a consumer of this ring instead
+	AppLodController::Config	lod;
+	PxU32						emitterCount;
+	bool						benchmarkEmitters;
+	std::vector<std::string>	colliders;		// OBJ files
+	std::string					meshCacheDirectory;
+	PxU32						rankCount;		// processes splitting the domain
+	PxU32						rank;			// set by the launching process
+	std::string					session;		// likewise, names the pipes of the run
+	PxF32						slabDomainMin;	// split evenly between the ranks
+	PxF32						slabDomainMax;
+	bool						useCamera;
+	AppCamera::Config			camera;
+	PxU32						renderTiles[3];	// 1,1,1 keeps a single render volume
+	bool						useRenderDomain;	// otherwise the tiles cover the turbulence grid
+	PxBounds3					renderDomain;
+	PxU32						frameCount;
+	PxU32						metricsPort;	// 0 disables the metrics server
+	AppWindField::Config		wind;
+	bool						lazyStartup;
+
+private:
+	bool parseOption(const char* token)
+	{
+		const char* value = strchr(token, '=');
+		std::string name(token, value ? value - token : strlen(token));
+		value = value ? value + 1 : "";
+
+		if (!stricmp(name.c_str(), "noTurbulence"))
+		{
+			useTurbulence = false;
+			return true;
+		}
+		else if (!stricmp(name.c_str(), "device"))
+		{
+			executionPolicy = !stricmp(value, "cpu") ? APP_EXECUTION_CPU_ONLY : APP_EXECUTION_GPU_PREFERRED;
+			return !stricmp(value, "cpu") || !stricmp(value, "gpu");
+		}
+		else if (!stricmp(name.c_str(), "exportVolume"))
+		{
+			volumeExport.directory = value;
+			return !volumeExport.directory.empty();
+		}
+		else if (!stricmp(name.c_str(), "exportEvery"))
+		{
+			return sscanf_s(value, "%u", &volumeExport.everyNFrames) == 1;
+		}
+		else if (!stricmp(name.c_str(), "exportStride"))
+		{
+			return sscanf_s(value, "%u", &volumeExport.stride) == 1;
+		}
+		else if (!stricmp(name.c_str(), "exportChunk"))
+		{
+			return sscanf_s(value, "%u", &volumeExport.chunkSize) == 1;
+		}
+		else if (!stricmp(name.c_str(), "exportRoi"))
+		{
+			AppVolumeExporter::Config& c = volumeExport;
+			return sscanf_s(value, "%u,%u,%u,%u,%u,%u",
+				&c.roiMin[0], &c.roiMin[1], &c.roiMin[2], &c.roiMax[0], &c.roiMax[1], &c.roiMax[2]) == 6;
+		}
+		else if (!stricmp(name.c_str(), "mortonReorder"))
+		{
+			// only the CPU particles can be sorted
+			if (!cpuParticles.capacity)
+			{
+				cpuParticles.capacity = 65536;
+			}
+			mortonReorderFrames = 10;
+			return !*value || (sscanf_s(value, "%u", &mortonReorderFrames) == 1 && mortonReorderFrames > 0);
+		}
+		else if (!stricmp(name.c_str(), "outputOrder"))
+		{
+			outputById = !stricmp(value, "id");
+			return outputById || !stricmp(value, "storage");
+		}
+		else if (!stricmp(name.c_str(), "benchmarkMorton"))
+		{
+			benchmarkMorton = true;
+			return true;
+		}
+		else if (!stricmp(name.c_str(), "cpuParticles"))
+		{
+			cpuParticles.capacity = 65536;
+			return !*value || (sscanf_s(value, "%u", &cpuParticles.capacity) == 1 && cpuParticles.capacity > 0);
+		}
+		else if (!stricmp(name.c_str(), "sparseGrid"))
+		{
+			// the grid carries the CPU particles, a cpuParticles option may size them
+			if (!cpuParticles.capacity)
+			{
+				cpuParticles.capacity = 65536;
+			}
+			sparseCellSize = 1.0f;
+			return !*value || (sscanf_s(value, "%f", &sparseCellSize) == 1 && sparseCellSize > 0.0f);
+		}
+		else if (!stricmp(name.c_str(), "sparseIdle"))
+		{
+			return sscanf_s(value, "%u", &sparseIdleFrames) == 1;
+		}
+		else if (!stricmp(name.c_str(), "shm"))
+		{
+			sharedSprites = value;
+			return !sharedSprites.empty();
+		}
+		else if (!stricmp(name.c_str(), "shmSlots"))
+		{
+			return sscanf_s(value, "%u", &sharedSlots) == 1 && sharedSlots > 1;
+		}
+		else if (!stricmp(name.c_str(), "shmMaxSprites"))
+		{
+			return sscanf_s(value, "%u", &sharedMaxSprites) == 1 && sharedMaxSprites > 0;
+		}
+		else if (!stricmp(name.c_str(), "consumeShm"))
+		{
+			consumeSharedSprites = value;
+			return !consumeSharedSprites.empty();
+		}
+		else if (!stricmp(name.c_str(), "targetFrameMs"))
+		{
+			return sscanf_s(value, "%f", &lod.targetMs) == 1 && lod.targetMs > 0.0f;
+		}
+		else if (!stricmp(name.c_str(), "lodHysteresis"))
+		{
+			return sscanf_s(value, "%f", &lod.hysteresis) == 1 && lod.hysteresis >= 0.0f && lod.hysteresis < 1.0f;
+		}
+		else if (!stricmp(name.c_str(), "emitters"))
+		{
+			return sscanf_s(value, "%u", &emitterCount) == 1 && emitterCount > 0;
+		}
+		else if (!stricmp(name.c_str(), "benchmarkEmitters"))
+		{
+			benchmarkEmitters = true;
+			return true;
+		}
+		else if (!stricmp(name.c_str(), "collider"))
+		{
+			colliders.push_back(value);
+			return !colliders.back().empty();
+		}
+		else if (!stricmp(name.c_str(), "meshCache"))
+		{
+			meshCacheDirectory = value;
+			return !meshCacheDirectory.empty();
+		}
+		else if (!stricmp(name.c_str(), "ranks"))
+		{
+			// only the CPU particles can move between ranks, a cpuParticles option may size them
+			if (!cpuParticles.capacity)
+			{
+				cpuParticles.capacity = 65536;
+			}
+			return sscanf_s(value, "%u", &rankCount) == 1 && rankCount > 0;
+		}
+		else if (!stricmp(name.c_str(), "rank"))
+		{
+			return sscanf_s(value, "%u", &rank) == 1;
+		}
+		else if (!stricmp(name.c_str(), "session"))
+		{
+			session = value;
+			return !session.empty();
+		}
+		else if (!stricmp(name.c_str(), "camera"))
+		{
+			AppCamera::Config& c = camera;
+			useCamera = true;
+			return !*value || (sscanf_s(value, "%f,%f,%f,%f,%f,%f",
+				&c.eye.x, &c.eye.y, &c.eye.z, &c.target.x, &c.target.y, &c.target.z) == 6 && !(c.eye - c.target).isZero());
+		}
+		else if (!stricmp(name.c_str(), "fov"))
+		{
+			return sscanf_s(value, "%f", &camera.fovY) == 1 && camera.fovY > 0.0f && camera.fovY < 180.0f;
+		}
+		else if (!stricmp(name.c_str(), "viewport"))
+		{
+			return sscanf_s(value, "%ux%u", &camera.width, &camera.height) == 2 && camera.width > 0 && camera.height > 0;
+		}
+		else if (!stricmp(name.c_str(), "clip"))
+		{
+			return sscanf_s(value, "%f,%f", &camera.nearZ, &camera.farZ) == 2 && camera.nearZ > 0.0f && camera.farZ > camera.nearZ;
+		}
+		else if (!stricmp(name.c_str(), "slabDomain"))
+		{
+			return sscanf_s(value, "%f,%f", &slabDomainMin, &slabDomainMax) == 2 && slabDomainMax > slabDomainMin;
+		}
+		else if (!stricmp(name.c_str(), "renderTiles"))
+		{
+			return sscanf_s(value, "%u,%u,%u", &renderTiles[0], &renderTiles[1], &renderTiles[2]) == 3 &&
+				renderTiles[0] > 0 && renderTiles[1] > 0 && renderTiles[2] > 0;
+		}
+		else if (!stricmp(name.c_str(), "renderDomain"))
+		{
+			PxBounds3& b = renderDomain;
+			useRenderDomain = true;
+			return sscanf_s(value, "%f,%f,%f,%f,%f,%f",
+				&b.minimum.x, &b.minimum.y, &b.minimum.z, &b.maximum.x, &b.maximum.y, &b.maximum.z) == 6 &&
+				b.maximum.x > b.minimum.x && b.maximum.y > b.minimum.y && b.maximum.z > b.minimum.z;
+		}
+		else if (!stricmp(name.c_str(), "windCurl"))
+		{
+			int fields = sscanf_s(value, "%f,%f,%f", &wind.curlAmplitude, &wind.curlScale, &wind.curlSpeed);
+			return fields >= 1 && wind.curlAmplitude > 0.0f && wind.curlScale > 0.0f;
+		}
+		else if (!stricmp(name.c_str(), "windVortex"))
+		{
+			wind.vortices.push_back(AppWindField::Vortex());
+			AppWindField::Vortex& b = wind.vortices.back();
+			return sscanf_s(value, "%f,%f,%f,%f,%f", &b.center.x, &b.center.y, &b.center.z, &b.strength, &b.radius) == 5 && b.radius > 0.0f;
+		}
+		else if (!stricmp(name.c_str(), "windShear"))
+		{
+			AppWindField::Config& c = wind;
+			return sscanf_s(value, "%f,%f,%f,%f,%f,%f",
+				&c.shearBase.x, &c.shearBase.y, &c.shearBase.z, &c.shearGradient.x, &c.shearGradient.y, &c.shearGradient.z) == 6;
+		}
+		else if (!stricmp(name.c_str(), "windCells"))
+		{
+			return sscanf_s(value, "%u", &wind.gridCells) == 1 && wind.gridCells >= 2;
+		}
+		else if (!stricmp(name.c_str(), "lazyStartup"))
+		{
+			lazyStartup = true;
+			return true;
+		}
+		else if (!stricmp(name.c_str(), "frames"))
+		{
+			return sscanf_s(value, "%u", &frameCount) == 1 && frameCount > 0;
+		}
+		else if (!stricmp(name.c_str(), "metrics"))
+		{
+			metricsPort = 9464;
+			return !*value || (sscanf_s(value, "%u", &metricsPort) == 1 && metricsPort > 0 && metricsPort < 65536);
+		}
+		return false;
+	}
+};
+
+
+// This class contains all of the different pointers and stuff for the program
+// so we don't make a bunch of globals
+class AppContext
+{
+public:
+	AppContext::AppContext()
+		: mFoundationSDK(NULL)
+		, mPhysxSDK(NULL)
+		, mPhysxCooking(NULL)
+		, mPhysxScene(NULL)
+		, mThreadPool(NULL)
+		, mCudaContext(NULL)
+		, mColliderMaterial(NULL)
+		, mApexSDK(NULL)
+		, mApexScene(NULL)
+		, mParticlesModule(NULL)
+		, mTurbulenceFSModule(NULL)
+		, mIofxModule(NULL)
+		, mLegacyModule(NULL)
+		, mViewMatrixId(0)
+		, mProjMatrixId(0)
+		, mEmitterAsset(NULL)
+		, mTurbulenceAsset(NULL)
+		, mTurbulenceActor(NULL)
+		, mTurbulenceCenter(0.0f)
+		, mExternalVelocity(0.0f)
+		, mCpuOutputById(false)
+		, mReorderFrames(1)
+		, mFrame(0)
+		, mNextSpawnId(0)
+		, mEmissionCredit(0.0f)
+		, mStageJob(*this, &AppContext::stageParticles)
+		, mSubmitJob(*this, &AppContext::submitSpawnList)
+		, mSimulateJob(*this, &AppContext::simulateStage)
+		, mExtractJob(*this, &AppContext::extractFrame)
+		, mOutputJob(*this, &AppContext::outputFrame)
+		, mSimulateNode(0)
+		, mExtractNode(0)
+		, mFrameDt(0.0f)
+		, mExtractedFrame(PX_MAX_U32)
+		, mVelocityCaptured(false)
+		, mParticleExtractPhase(PX_MAX_U32)
+	{
+		mMetrics.setAllocator(&mAppAllocator);
+	}
+
+	// The plan decides which of the optional subsystems initPhysX and initAPEX load
+	void setStartupPlan(const AppStartupPlan& plan)
+	{
+		mStartupPlan = plan;
+	}
+
+	bool initPhysX(AppExecutionPolicy policy)
+	{
+		// Create the PhysX foundation
+		AppTimer timer;
+		mFoundationSDK = PxCreateFoundation(PX_PHYSICS_VERSION, mAppAllocator, mAppErrorCallback);
+		if (!mFoundationSDK)
+		{
+			printf("Error initializing the foundation\n");
+			return false;
+		}
+		mStartup.record("PhysX foundation", timer.elapsedMs());
+
+		// Create the PhysX SDK
+		timer.reset();
+		mPhysxSDK = PxCreatePhysics(PX_PHYSICS_VERSION, *mFoundationSDK, PxTolerancesScale());
+		if (!mPhysxSDK)
+		{
+			printf("Error initializing PhysXSDK\n");
+			return false;
+		}
+		mStartup.record("PhysX SDK", timer.elapsedMs());
+
+		// APEX needs cooking in its SDK descriptor, with or without colliders
+		timer.reset();
+		mPhysxCooking = PxCreateCooking(PX_PHYSICS_VERSION, mPhysxSDK->getFoundation(), PxCookingParams(mPhysxSDK->getTolerancesScale()));
+		if (!mPhysxCooking)
+		{
+			printf("Error initializing PhysXSDK Cooking\n");
+			return false;
+		}
+		mStartup.record("PhysX cooking", timer.elapsedMs());
+
+		// Create the CUDA context manager (APEX will use this as well, it retrieves it from PhysX)
+		if (policy != APP_EXECUTION_GPU_PREFERRED)
+		{
+			mStartup.skip("CUDA probe", "device=cpu");
+		}
+		else if (!mStartupPlan.cuda)
+		{
+			mStartup.skip("CUDA probe", "only turbulence needs CUDA");
+		}
+		else
+		{
+			timer.reset();
+			physx::PxCudaContextManagerDesc ctxMgrDesc;
+			// this call simply returns NULL on platforms and configurations that don't support CUDA
+			mCudaContext = PxCreateCudaContextManager(mPhysxSDK->getFoundation(), ctxMgrDesc, mPhysxSDK->getProfileZoneManager());
+			if (mCudaContext && !mCudaContext->contextIsValid())
+			{
+				mCudaContext->release();
+				mCudaContext = NULL;
+			}
+			if (!mCudaContext)
+			{
+				printf("No usable CUDA device, running on the CPU\n");
+			}
+			mStartup.record("CUDA probe", timer.elapsedMs());
+		}
+
+		// Create the PhysX SDK CPU Thread Pool.  Without CUDA the IOS and all other APEX tasks
+		// run on it, so it gets a thread per core then.
+		PxU32 threadCount = 4;
+		if (!mCudaContext)
+		{
+			SYSTEM_INFO info;
+			GetSystemInfo(&info);
+			threadCount = PxMax(PxU32(info.dwNumberOfProcessors), 1u);
+		}
+		timer.reset();
+		mThreadPool = PxDefaultCpuDispatcherCreate(threadCount);
+		if (!mThreadPool)
+		{
+			printf("Error creating the CPU dispatcher\n");
+			return false;
+		}
+		mStartup.record("CPU dispatcher", timer.elapsedMs());
+
+		// Create the PhysX SDK scene
+		timer.reset();
+		PxSceneDesc desc(mPhysxSDK->getTolerancesScale());
+		desc.cpuDispatcher = mThreadPool;
+		desc.gpuDispatcher = mCudaContext ? mCudaContext->getGpuDispatcher() : NULL;
+		desc.filterShader = PxDefaultSimulationFilterShader;
+		if (!desc.isValid())
+		{
+			printf("Error, invalid PhysX scene descriptor\n");
+			return false;
+		}
+
+		mPhysxScene = mPhysxSDK->createScene(desc);
+		if (!mPhysxScene)
+		{
+			printf("Error initializing PhysX scene\n");
+			return false;
+		}
+		mStartup.record("PhysX scene", timer.elapsedMs());
+
+		return true;
+	}
+
+	// Adds the meshes as static colliders to the PhysX scene, which the particles collide with
+	bool initColliders(const std::vector<std::string>& files, const char* cacheDirectory)
+	{
+		if (files.empty())
+		{
+			return true;
+		}
+
+		AppTimer total;
+		if (!mMeshCache.init(*mPhysxSDK, *mPhysxCooking, cacheDirectory))
+		{
+			return false;
+		}
+
+		mColliderMaterial = mPhysxSDK->createMaterial(0.5f, 0.5f, 0.1f);
+		if (!mColliderMaterial)
+		{
+			printf("Error creating the collider material\n");
+			return false;
+		}
+
+		for (PxU32 i = 0; i < files.size(); i++)
+		{
+			AppTimer timer;
+			AppCollisionMesh mesh;
+			if (!mesh.loadObj(files[i].c_str()))
+			{
+				return false;
+			}
+
+			bool cached = false;
+			PxTriangleMesh* triangleMesh = mMeshCache.getMesh(mesh, cached);
+			if (!triangleMesh)
+			{
+				return false;
+			}
+			mColliderMeshes.push_back(triangleMesh);
+
+			PxRigidStatic* actor = mPhysxSDK->createRigidStatic(PxTransform(PxVec3(0.0f)));
+			if (!actor || !actor->createShape(PxTriangleMeshGeometry(triangleMesh), *mColliderMaterial))
+			{
+				printf("Error creating the collider for %s\n", files[i].c_str());
+				if (actor)
+				{
+					actor->release();
+				}
+				return false;
+			}
+			mPhysxScene->addActor(*actor);
+			mColliders.push_back(actor);
+
+			printf("Collider %s: %u triangles, %s in %.2f ms\n", files[i].c_str(), mesh.getTriangleCount(),
+				cached ? "loaded from the cache" : "cooked", timer.elapsedMs());
+		}
+		mStartup.record("Colliders", total.elapsedMs());
+		return true;
+	}
+
+	void destroyColliders()
+	{
+		for (PxU32 i = 0; i < mColliders.size(); i++)
+		{
+			mColliders[i]->release();
+		}
+		mColliders.clear();
+		for (PxU32 i = 0; i < mColliderMeshes.size(); i++)
+		{
+			mColliderMeshes[i]->release();
+		}
+		mColliderMeshes.clear();
+		releaseAndClear(mColliderMaterial);
+	}
+
+	void destroyPhysX()
+	{
+		destroyColliders();
+		releaseAndClear(mPhysxScene);
+		releaseAndClear(mCudaContext);
+		releaseAndClear(mThreadPool);
+		releaseAndClear(mPhysxCooking);
+		releaseAndClear(mPhysxSDK);
+		releaseAndClear(mFoundationSDK);
+	}
+
+	bool initAPEX()
+	{
+		// Create the APEX SDK
+		AppTimer timer;
+		NxApexSDKDesc apexDesc;
+		apexDesc.physXSDK              = mPhysxSDK;
+		apexDesc.cooking               = mPhysxCooking;
+		apexDesc.renderResourceManager = &mApexRenderResourceManager;
+		apexDesc.resourceCallback      = &mApexResourceCallback;
+		apexDesc.wireframeMaterial	   = "materials/simple_unlit.xml";
+		apexDesc.solidShadedMaterial   = "materials/simple_lit_color.xml";
+		NxApexCreateError errorCode;
+		mApexSDK = NxCreateApexSDK(apexDesc, &errorCode);
+		if (!mApexSDK)
+		{
+			printf("Error creating APEX SDK: %i\n", errorCode);
+			return false;
+		}
+
+		mApexResourceCallback.setApexSDK(mApexSDK);
+		mStartup.record("APEX SDK", timer.elapsedMs());
+
+		// Load the necessary particle modules
+		timer.reset();
+		mParticlesModule = static_cast< NxModuleParticles *>(mApexSDK->createModule("Particles"));
+		if (mParticlesModule)
+		{
+			mIofxModule = static_cast<physx::apex::NxModuleIofx*>(mParticlesModule->getModule("IOFX"));
+		}
+		mStartup.record("Particles and IOFX modules", timer.elapsedMs());
+
+		// TurbulenceFS only has a CUDA implementation
+		if (!mCudaContext)
+		{
+			mStartup.skip("TurbulenceFS module", "needs CUDA");
+		}
+		else if (!mStartupPlan.turbulence)
+		{
+			mStartup.skip("TurbulenceFS module", "noTurbulence");
+		}
+		else
+		{
+			timer.reset();
+			mTurbulenceFSModule = mApexSDK->createModule("TurbulenceFS");
+			mStartup.record("TurbulenceFS module", timer.elapsedMs());
+		}
+
+		// Load the legacy modules (in case someone upgrades our asset classes in APEX)
+		if (mStartupPlan.lazy)
+		{
+			mApexResourceCallback.setLegacyOnDemand(mLegacyModule, mStartup);
+			mStartup.skip("Legacy module", "loaded if an asset needs it");
+		}
+		else
+		{
+			timer.reset();
+			mLegacyModule = mApexSDK->createModule("Legacy");
+			mStartup.record("Legacy module", timer.elapsedMs());
+		}
+		
+		if (!mParticlesModule ||
+			!mIofxModule)
+		{
+			printf("Error loading particle modules\n");
+			return false;
+		}
+
+		// Create the APEX scene
+		timer.reset();
+		NxApexSceneDesc apexSceneDesc;
+		apexSceneDesc.scene = mPhysxScene;
+		apexSceneDesc.debugVisualizeLocally = false;
+		apexSceneDesc.debugVisualizeRemotely = false;
+		if (!apexSceneDesc.isValid())
+		{
+			printf("Invalid APEX Scene Desc\n");
+			return false;
+		}
+
+		mApexScene = mApexSDK->createScene(apexSceneDesc);		
+		if (!mApexScene)
+		{
+			printf("Error creating APEX Scene\n");
+			return false;
+		}
+
+		// Allocate the view and projection matrices
+		mViewMatrixId = mApexScene->allocViewMatrix(ViewMatrixType::LOOK_AT_RH);
+		mProjMatrixId = mApexScene->allocProjMatrix(ProjMatrixType::USER_CUSTOMIZED);
+
+		// We don't want LOD messing with us at the moment, the frame time controller
+		// (targetFrameMs) lowers the budget when it needs to
+		mApexScene->setLODResourceBudget(PX_MAX_F32);
+		mStartup.record("APEX scene", timer.elapsedMs());
+
+		// Create a render volume for the particles, initRenderRegions can split it up later
+		timer.reset();
+		PxBounds3 infBounds;
+		infBounds.setMaximal();
+		mRenderRegions.resize(1);
+		mRenderRegions[0].name = "all";
+		mRenderRegions[0].bounds = infBounds;
+		if (!createRegionVolumes(NULL))
+		{
+			return false;
+		}
+		mStartup.record("Render volume", timer.elapsedMs());
+		return true;
+	}
+
+	void destroyAPEX()
+	{
+		destroyRenderRegions();
+			
+		releaseAndClear(mApexScene);
+		releaseAndClear(mParticlesModule);
+		mIofxModule = NULL;
+		releaseAndClear(mTurbulenceFSModule);
+		releaseAndClear(mLegacyModule);
+
+		mApexResourceCallback.setApexSDK(NULL);
+		releaseAndClear(mApexSDK);
+	}
+
+	// This method creates the emitter asset and actor
+	bool initAssetsAndActors(bool useTurbulence, PxU32 emitterCount)
+	{
+		if (!mApexScene)
+		{
+			return false;
+		}
+
+		// Load the emitter asset and create an actor
+		NxResourceProvider* NRP = mApexSDK->getNamedResourceProvider();
+		
+		// emitter asset and actor
+		AppTimer timer;
+		{
+			// This explicit emitter contains no particles in the asset, it is intended
+			// to simply allow the app to create particles explicitely
+			const char* emitterAssetName = "explicitEmitterAsset";
+			mEmitterAsset = reinterpret_cast<NxApexAsset*>(NRP->getResource(NX_APEX_EMITTER_AUTHORING_TYPE_NAME, emitterAssetName));
+			if (mEmitterAsset)
+			{
+				// bump your refcount so that things work smoothly
+				NRP->setResource(NX_APEX_EMITTER_AUTHORING_TYPE_NAME, emitterAssetName, mEmitterAsset, true);
+			}
+			else
+			{
+				printf("Failed to create the APEX Emitter Asset\n");
+				return false;
+			}
+		
+			// the pool creates the actors from the asset's default actor description, with
+			// the asset's particle list switched off (you'll get double the particles if you
+			// don't do this) and emitting whatever the app puts in the list every frame.
+			// We will be using the emitters in a mode where we clear the insertion particle
+			// list every frame and add our own.
+			mEmitterPool.init(*mEmitterAsset, *mApexScene);
+			if (!mEmitterPool.reserve(emitterCount))
+			{
+				return false;
+			}
+			for (PxU32 i = 0; i < emitterCount; i++)
+			{
+				mEmitters.push_back(mEmitterPool.acquire());
+			}
+		}
+		mStartup.record("Emitter asset and actors", timer.elapsedMs());
+
+		// turbulence asset and actor
+		timer.reset();
+		if (useTurbulence && !mTurbulenceFSModule)
+		{
+			printf("The turbulence module needs CUDA, running without turbulence\n");
+		}
+		else if (useTurbulence)
+		{
+			const char* turbulenceAssetName = "turbulenceFSAsset";
+			mTurbulenceAsset = reinterpret_cast<NxApexAsset*>(NRP->getResource(NX_TURBULENCE_FS_AUTHORING_TYPE_NAME, turbulenceAssetName));
+			if (mTurbulenceAsset)
+			{
+				// bump your refcount so that things work smoothly
+				NRP->setResource(NX_TURBULENCE_FS_AUTHORING_TYPE_NAME, turbulenceAssetName, mTurbulenceAsset, true);
+			}
+			else
+			{
+				printf("Failed to create the Turbulence Asset\n");
+				return false;
+			}
+
+			// get the actor creation parameters from the asset
+			NxParameterized::Interface* actorParams = mTurbulenceAsset->getDefaultActorDesc();
+			mTurbulenceActor = mTurbulenceAsset->createApexActor(*actorParams, *mApexScene);
+			if (!mTurbulenceActor)
+			{
+				printf("Failed to create the Turbulence Actor\n");
+				return false;
+			}
+			NxTurbulenceFSActor* actor = reinterpret_cast<NxTurbulenceFSActor*>(mTurbulenceActor);
+			actor->setEnabled(true);
+			
+			// the grid is placed with the bottom just 1 unit above the origin, this way
+			// the particles move up freely for one frame, then begin to slow once they are in the grid
+			PxVec3 gridSize = actor->getGridSize();
+			PxMat44 pose = PxMat44::createIdentity();
+			mTurbulenceCenter = PxVec3(0.0f, gridSize.y * 0.5f + 1.0f, 0.0f);
+			pose.setPosition(mTurbulenceCenter);
+			actor->setPose(pose);
+
+			// an external acceleration gives us a more interesting setup
+			mExternalVelocity = PxVec3(60.0f, 0.0f, 0.0f);
+			actor->setExternalVelocity(mExternalVelocity);
+			mStartup.record("Turbulence asset and actor", timer.elapsedMs());
+		}
+
+		return true;
+	}
+
+	void destroyAssetsAndActors()
+	{
+		mEmitters.clear();
+		mEmitterPool.destroy();
+		// instead of releasing the asset directly, allow the NRP to do it because we used the
+		// NRP to create it
+		if (mEmitterAsset)
+		{
+			NxResourceProvider* NRP = mApexSDK->getNamedResourceProvider();
+			NRP->releaseResource(mEmitterAsset->getObjTypeName(), mEmitterAsset->getName());
+			mEmitterAsset = NULL;
+		}
+
+		releaseAndClear(mTurbulenceActor);
+		// instead of releasing the asset directly, allow the NRP to do it because we used the
+		// NRP to create it
+		if (mTurbulenceAsset)
+		{
+			NxResourceProvider* NRP = mApexSDK->getNamedResourceProvider();
+			NRP->releaseResource(mTurbulenceAsset->getObjTypeName(), mTurbulenceAsset->getName());
+			mTurbulenceAsset = NULL;
+		}
+
+	}
+
+	bool initVolumeExport(const AppVolumeExporter::Config& config)
+	{
+		if (config.directory.empty())
+		{
+			return true;
+		}
+
+		if (!mTurbulenceActor)
+		{
+			printf("Error, volume export requires the turbulence actor\n");
+			return false;
+		}
+
+		return mVolumeExporter.start(config);
+	}
+
+	// flushes the snapshots still queued for writing
+	void destroyVolumeExport()
+	{
+		mVolumeExporter.stop();
+	}
+
+	// Snapshots the turbulence velocity field when the CPU particles or the export need it
+	// this frame.  Reading the field is an APEX call, so this runs with the extraction; the
+	// output job and the next frame's CPU particle step use the snapshot.
+	void captureVelocityField(PxU32 frame)
+	{
+		mVelocityCaptured = false;
+		if (mTurbulenceActor && (mCpuParticles.isEnabled() || mVolumeExporter.isExportFrame(frame)))
+		{
+			mVelocityCaptured = mVelocityGrid.capture(*reinterpret_cast<NxTurbulenceFSActor*>(mTurbulenceActor), mTurbulenceCenter);
+		}
+	}
+
+	// queues the snapshot for writing if this frame is due
+	void exportVolume(PxU32 frame, PxF32 time)
+	{
+		if (mVelocityCaptured && mVolumeExporter.isExportFrame(frame))
+		{
+			mVolumeExporter.submit(frame, time, mVelocityGrid);
+		}
+	}
+
+	// this method just stages a single particle per emitter, shooting straight up (y-up); the
+	// first emitter sits at the origin, others on a square around it in the xz plane.  The
+	// list is handed to the emitters by submitSpawnList.
+	void stageParticles()
+	{
+		if (mEmitters.empty())
+		{
+			APP_LOG_ERROR(0, "Emitter actor is not initialized\n");
+			return;
+		}
+
+		PxU32 side = PxU32(PxCeil(PxSqrt(PxF32(mEmitters.size()))));
+		mSpawnList.clear();
+		for (PxU32 i = 0; i < mEmitters.size(); i++)
+		{
+			SpawnParticle particle;
+			particle.position = PxVec3(PxF32(PxI32(i % side) - PxI32(side / 2)), 0.0f, PxF32(PxI32(i / side) - PxI32(side / 2)));
+			particle.velocity = PxVec3(0.0f, 60.0f, 0.0f);
+			particle.emitter = mEmitters[i];
+			mSpawnList.push_back(particle);
+		}
+		throttleSpawnList();
+
+		// every rank of a split domain stages and numbers the whole frame alike, then keeps
+		// the particles that start in its slab
+		PxU32 kept = 0;
+		for (PxU32 i = 0; i < mSpawnList.size(); i++)
+		{
+			mSpawnList[i].id = mNextSpawnId++;
+			if (!mSlabs.isEnabled() || mSlabs.owns(mSpawnList[i].position))
+			{
+				mSpawnList[kept++] = mSpawnList[i];
+			}
+		}
+		mSpawnList.resize(kept);
+	}
+
+	// Refreshes the wind cache for this frame and adds the wind where the particles spawn to
+	// their velocities, so they leave the emitters with it.  The CPU particles feel the wind
+	// while they step; without them, the turbulence actor only takes a uniform external
+	// velocity and gets the mean of the wind.  Runs on the main thread in the submit job,
+	// after staging and before anything samples the cache.
+	void applyWind()
+	{
+		if (!mWind.isEnabled())
+		{
+			return;
+		}
+
+		mWind.update(mFrame * mFrameDt);
+		if (!mCpuParticles.isEnabled() && mTurbulenceActor)
+		{
+			reinterpret_cast<NxTurbulenceFSActor*>(mTurbulenceActor)->setExternalVelocity(mExternalVelocity + mWind.getMean());
+		}
+
+		PxU32 count = PxU32(mSpawnList.size());
+		mWindPositions.resize(count);
+		mWindVelocities.resize(count);
+		for (PxU32 i = 0; i < count; i++)
+		{
+			mWindPositions[i] = mSpawnList[i].position;
+		}
+		if (count)
+		{
+			mWind.sample(&mWindPositions[0], &mWindVelocities[0], count);
+		}
+		for (PxU32 i = 0; i < count; i++)
+		{
+			mSpawnList[i].velocity += mWindVelocities[i];
+		}
+	}
+
+	// thins the spawn list evenly when the LOD controller throttles emission: every particle
+	// adds the emission scale to a credit and is kept when the credit crosses a whole number,
+	// so every emitter keeps its share.  The remainder carries over so low rates still emit
+	// now and then.
+	void throttleSpawnList()
+	{
+		if (!mLodController.isEnabled())
+		{
+			return;
+		}
+
+		PxF32 scale = mLodController.getEmissionScale();
+		PxU32 kept = 0;
+		for (PxU32 i = 0; i < mSpawnList.size(); i++)
+		{
+			mEmissionCredit += scale;
+			if (mEmissionCredit >= 1.0f)
+			{
+				mEmissionCredit -= 1.0f;
+				mSpawnList[kept++] = mSpawnList[i];
+			}
+		}
+		mSpawnList.resize(kept);
+	}
+
+	// hands the staged spawn list to the emitters in one batch, or to the CPU particles
+	void submitSpawnList()
+	{
+		applyWind();
+
+		PxU32 count = PxU32(mSpawnList.size());
+		mSpawnPositions.resize(count);
+		mSpawnVelocities.resize(count);
+		mSpawnEmitters.resize(count);
+		mSpawnIds.resize(count);
+		for (PxU32 i = 0; i < count; i++)
+		{
+			mSpawnPositions[i] = mSpawnList[i].position;
+			mSpawnVelocities[i] = mSpawnList[i].velocity;
+			mSpawnEmitters[i] = mSpawnList[i].emitter;
+			mSpawnIds[i] = mSpawnList[i].id;
+		}
+
+		if (mCpuParticles.isEnabled())
+		{
+			count = mCpuParticles.emit(count ? &mSpawnPositions[0] : NULL, count ? &mSpawnVelocities[0] : NULL, count,
+				count ? &mSpawnIds[0] : NULL);
+		}
+		else
+		{
+			mEmitterPool.submit(count ? &mSpawnPositions[0] : NULL, count ? &mSpawnVelocities[0] : NULL,
+				count ? &mSpawnEmitters[0] : NULL, count);
+		}
+		mMetrics.addEmittedParticles(count);
+	}
+
+	// Measures how the per-frame emitter work scales with the emitter count.  Every emitter
+	// emits one particle every fourth frame, staggered, like a large scene where most
+	// emitters are quiet at any moment.  The baseline refills every emitter's list one by
+	// one, as the sample used to for its single emitter; the pool submits the frame in one batch.
+	void benchmarkEmitters()
+	{
+		const PxU32 counts[] = { 1, 16, 128, 1024, 4096 };
+		const PxU32 FRAMES = 32;
+		const PxF32 dt = 1.0f/60.0f;
+
+		printf("Emitter scaling, %u frames per count\n", FRAMES);
+		printf("%10s %10s %12s %12s %14s %14s %14s\n", "emitters", "created", "create ms", "reuse ms", "per-emitter us", "batched us", "simulate ms");
+
+		std::vector<PxU32> handles;
+		std::vector<PxVec3> positions;
+		std::vector<PxVec3> velocities(1, PxVec3(0.0f, 60.0f, 0.0f));
+		for (PxU32 c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+		{
+			PxU32 count = counts[c];
+
+			// reserve only creates the actors the smaller counts did not leave parked, so the
+			// create time covers new actors alone; acquire then hands out parked ones
+			PxU32 createdBefore = mEmitterPool.getCreatedCount();
+			AppTimer createTimer;
+			if (!mEmitterPool.reserve(count))
+			{
+				printf("Error creating %u emitter actors\n", count);
+				return;
+			}
+			double createMs = createTimer.elapsedMs();
+			PxU32 created = mEmitterPool.getCreatedCount() - createdBefore;
+
+			AppTimer reuseTimer;
+			for (PxU32 i = 0; i < count; i++)
+			{
+				PxU32 handle = mEmitterPool.acquire();
+				if (handle == AppEmitterPool::INVALID)
+				{
+					printf("Error acquiring emitter %u of %u\n", i, count);
+					for (PxU32 j = 0; j < handles.size(); j++)
+					{
+						mEmitterPool.recycle(handles[j]);
+					}
+					return;
+				}
+				handles.push_back(handle);
+			}
+			double reuseMs = reuseTimer.elapsedMs();
+
+			positions.resize(count);
+			for (PxU32 i = 0; i < count; i++)
+			{
+				positions[i] = PxVec3(PxF32(i % 64), 0.0f, PxF32(i / 64));
+			}
+
+			double baselineMs = 0.0;
+			double batchedMs = 0.0;
+			double simulateMs = 0.0;
+			for (PxU32 frame = 0; frame < 2 * FRAMES; frame++)
+			{
+				AppTimer timer;
+				if (frame < FRAMES)
+				{
+					for (PxU32 i = 0; i < count; i++)
+					{
+						NxEmitterExplicitGeom* geom = mEmitterPool.getActor(handles[i])->isExplicitGeom();
+						geom->resetParticleList();
+						if ((i + frame) % 4 == 0)
+						{
+							geom->addParticleList(1, &positions[i], &velocities[0]);
+						}
+					}
+					baselineMs += timer.elapsedMs();
+				}
+				else
+				{
+					if (frame == FRAMES)
+					{
+						// the pool expects the lists it did not fill to be empty
+						for (PxU32 i = 0; i < count; i++)
+						{
+							mEmitterPool.getActor(handles[i])->isExplicitGeom()->resetParticleList();
+						}
+						timer.reset();
+					}
+
+					mSpawnList.clear();
+					for (PxU32 i = 0; i < count; i++)
+					{
+						if ((i + frame) % 4 == 0)
+						{
+							SpawnParticle particle;
+							particle.position = positions[i];
+							particle.velocity = velocities[0];
+							particle.emitter = handles[i];
+							particle.id = i;
+							mSpawnList.push_back(particle);
+						}
+					}
+					submitSpawnList();
+					batchedMs += timer.elapsedMs();
+				}
+
+				timer.reset();
+				simulateFrame(dt);
+				simulateMs += timer.elapsedMs();
+			}
+
+			printf("%10u %10u %12.3f %12.3f %14.2f %14.2f %14.3f\n", count, created, createMs, reuseMs,
+				baselineMs * 1000.0 / FRAMES, batchedMs * 1000.0 / FRAMES, simulateMs / (2 * FRAMES));
+
+			// park the emitters with empty lists for the next count
+			for (PxU32 i = 0; i < count; i++)
+			{
+				mEmitterPool.recycle(handles[i]);
+			}
+			handles.clear();
+			mSpawnList.clear();
+			submitSpawnList();
+		}
+		printf("%u emitter actors created in total\n", mEmitterPool.getCreatedCount());
 	}
 
-	bool initAPEX()
+	bool initWorkerPool()
 	{
-		// Create the APEX SDK
-		NxApexSDKDesc apexDesc;
-		apexDesc.physXSDK              = mPhysxSDK;
-		apexDesc.cooking               = mPhysxCooking;
-		apexDesc.renderResourceManager = &mApexRenderResourceManager;
-		apexDesc.resourceCallback      = &mApexResourceCallback;
-		apexDesc.wireframeMaterial	   = "materials/simple_unlit.xml";
-		apexDesc.solidShadedMaterial   = "materials/simple_lit_color.xml";
-		NxApexCreateError errorCode;
-		mApexSDK = NxCreateApexSDK(apexDesc, &errorCode);
-		if (!mApexSDK)
+		AppTimer timer;
+		if (!mWorkerPool.start())
 		{
-			printf("Error creating APEX SDK: %i\n", errorCode);
+			printf("Error starting the worker pool\n");
 			return false;
 		}
+		mStartup.record("Worker pool", timer.elapsedMs());
+		return true;
+	}
 
-		mApexResourceCallback.setApexSDK(mApexSDK);
+	void destroyWorkerPool()
+	{
+		mWorkerPool.stop();
+	}
 
-		// Load the necessary particle modules
-		mParticlesModule = static_cast< NxModuleParticles *>(mApexSDK->createModule("Particles"));
-		if (mParticlesModule)
+	// Sorts the CPU particles every few frames by the Morton code of their cell in the
+	// turbulence grid (or a box around the origin without turbulence), after they stepped.
+	// New particles are appended in emission order and drift, so the order decays between
+	// sorts.  The codes use the full 10 bits per axis over the box; finer cells only refine
+	// the same order.
+	void initParticleReorder(PxU32 everyNFrames)
+	{
+		PxVec3 boxMin(-100.0f), boxSize(200.0f);
+		if (mTurbulenceActor)
 		{
-			mIofxModule = static_cast<physx::apex::NxModuleIofx*>(mParticlesModule->getModule("IOFX"));
+			boxSize = reinterpret_cast<NxTurbulenceFSActor*>(mTurbulenceActor)->getGridSize();
+			boxMin = mTurbulenceCenter - boxSize * 0.5f;
 		}
-		mTurbulenceFSModule = mApexSDK->createModule("TurbulenceFS");
 
-		// Load the legacy modules (in case someone upgrades our asset classes in APEX)
-		mLegacyModule = mApexSDK->createModule("Legacy");
-		
-		if (!mParticlesModule ||
-			!mIofxModule)
+		mParticleReorder.init(mWorkerPool);
+		mParticleReorder.setGrid(boxMin, boxSize * (1.0f / 1024.0f));
+		mReorderFrames = everyNFrames;
+	}
+
+	// outputById writes the CPU particles' sprites in emission order, whatever order the
+	// reordering left them in
+	void initCpuParticles(const AppCpuParticles::Config& config, bool outputById)
+	{
+		mCpuParticles.init(config);
+		mCpuOutputById = outputById;
+		printf("Simulating up to %u particles on the CPU\n", config.capacity);
+	}
+
+	void initSparseGrid(PxF32 cellSize, PxU32 idleFrames)
+	{
+		mSparseGrid.init(cellSize, idleFrames);
+		mSparseGrid.setBackground(mTurbulenceActor ? mExternalVelocity : PxVec3(0.0f));
+	}
+
+	// Adds a procedural wind, cached every frame on a grid over the turbulence box (or a box
+	// around the origin without turbulence).  It blows on the emission velocities and on the
+	// CPU particles as they step; without CPU particles the turbulence actor gets its mean
+	// on top of the uniform external velocity.
+	void initWind(const AppWindField::Config& config)
+	{
+		PxBounds3 domain(PxVec3(-100.0f), PxVec3(100.0f));
+		if (mTurbulenceActor)
 		{
-			printf("Error loading particle modules\n");
-			return false;
+			PxVec3 gridSize = reinterpret_cast<NxTurbulenceFSActor*>(mTurbulenceActor)->getGridSize();
+			domain = PxBounds3(mTurbulenceCenter - gridSize * 0.5f, mTurbulenceCenter + gridSize * 0.5f);
 		}
 
-		// Create the APEX scene
-		NxApexSceneDesc apexSceneDesc;
-		apexSceneDesc.scene = mPhysxScene;
-		apexSceneDesc.debugVisualizeLocally = false;
-		apexSceneDesc.debugVisualizeRemotely = false;
-		if (!apexSceneDesc.isValid())
+		mWind.init(config, domain, mWorkerPool);
+		printf("Wind: %u vortices, curl noise amplitude %.1f, %u cached nodes\n",
+			PxU32(config.vortices.size()), config.curlAmplitude, mWind.getNodeCount());
+	}
+
+	void destroySparseGrid()
+	{
+		if (mSparseGrid.isEnabled())
 		{
-			printf("Invalid APEX Scene Desc\n");
-			return false;
+			printf("Sparse grid: %u bricks, %u KB at exit\n", mSparseGrid.getBrickCount(), PxU32(mSparseGrid.getMemoryBytes() / 1024));
+			mSparseGrid.clear();
 		}
+	}
 
-		mApexScene = mApexSDK->createScene(apexSceneDesc);		
-		if (!mApexScene)
+	// Keeps bricks allocated around the CPU particles and this frame's spawn positions,
+	// with the extraction
+	void captureSparseGrid()
+	{
+		if (!mSparseGrid.isEnabled())
 		{
-			printf("Error creating APEX Scene\n");
-			return false;
+			return;
 		}
 
-		// Allocate the view and projection matrices
-		mApexScene->allocViewMatrix(ViewMatrixType::LOOK_AT_RH);
-		mApexScene->allocProjMatrix(ProjMatrixType::USER_CUSTOMIZED);
+		const PxVec3* positions = mCpuParticles.getPositions();
+		for (PxU32 i = 0; i < mCpuParticles.getCount(); i++)
+		{
+			mSparseGrid.touch(positions[i]);
+		}
+		for (PxU32 i = 0; i < mSpawnPositions.size(); i++)
+		{
+			mSparseGrid.touch(mSpawnPositions[i]);
+		}
+	}
 
-		// We don't want LOD messing with us at the moment
-		mApexScene->setLODResourceBudget(PX_MAX_F32);
+	// Advances the sparse field toward the captured turbulence field, after the capture;
+	// the next frame's CPU particle step samples it
+	void stepSparseGrid(PxF32 dt)
+	{
+		if (mSparseGrid.isEnabled())
+		{
+			mSparseGrid.step(mWorkerPool, dt, mVelocityCaptured ? &mVelocityGrid : NULL);
+		}
+	}
 
-		// Create a render volume for the particles
-		PxBounds3 infBounds;
-		infBounds.setMaximal();
-		mRenderVolume = mIofxModule->createRenderVolume(*mApexScene, infBounds, 0, true);
-		return true;
+	void initLodController(const AppLodController::Config& config)
+	{
+		mLodController.init(config);
 	}
 
-	void destroyAPEX()
+	// Feeds the last graph run's simulate + fetch and extract time to the LOD controller,
+	// between runs.  The jobs are timed on their own, so waiting on the output job's I/O
+	// does not count; the next run's stage throttles with the new emission scale.
+	void updateLodBudget()
 	{
-		if (mRenderVolume)
+		if (!mLodController.isEnabled())
 		{
-			mIofxModule->releaseRenderVolume(*mRenderVolume);
-			mRenderVolume = NULL;
+			return;
 		}
-			
-		releaseAndClear(mApexScene);
-		releaseAndClear(mParticlesModule);
-		mIofxModule = NULL;
-		releaseAndClear(mTurbulenceFSModule);
-		releaseAndClear(mLegacyModule);
 
-		mApexResourceCallback.setApexSDK(NULL);
-		releaseAndClear(mApexSDK);
+		PxF32 frameMs = PxF32(mFrameGraph.getJobMs(mSimulateNode) + mFrameGraph.getJobMs(mExtractNode));
+		if (mLodController.update(frameMs, mApexScene->getLODResourceConsumed()))
+		{
+			mApexScene->setLODResourceBudget(mLodController.getBudget());
+		}
 	}
 
-	// This method creates the emitter asset and actor
-	bool initAssetsAndActors(bool useTurbulence)
+	// Publishes the sprites of every frame into the named shared memory ring
+	bool initSharedSprites(const char* name, PxU32 slotCount, PxU32 maxSprites)
 	{
-		if (!mApexScene)
+		PxU32 offsets[NxRenderSpriteLayoutElement::NUM_SEMANTICS];
+		AppSharedSpriteLayout::describe(offsets);
+
+		if (!mSharedSprites.open(name, slotCount, maxSprites, sizeof(AppSharedSpriteLayout), offsets))
 		{
 			return false;
 		}
+		mApexRenderResourceManager.mSpriteBufferSettings.sharedRing = &mSharedSprites;
 
-		// Load the emitter asset and create an actor
-		NxResourceProvider* NRP = mApexSDK->getNamedResourceProvider();
-		
-		// emitter asset and actor
+		// with several regions each one also gets a ring of its own, <name>.<region>
+		for (PxU32 i = 0; mRenderRegions.size() > 1 && i < mRenderRegions.size(); i++)
 		{
-			// This explicit emitter contains no particles in the asset, it is intended
-			// to simply allow the app to create particles explicitely
-			const char* emitterAssetName = "explicitEmitterAsset";
-			mEmitterAsset = reinterpret_cast<NxApexAsset*>(NRP->getResource(NX_APEX_EMITTER_AUTHORING_TYPE_NAME, emitterAssetName));
-			if (mEmitterAsset)
+			AppRenderRegion& region = mRenderRegions[i];
+			region.sharedRing = new AppSharedSpriteRing;
+			std::string regionName = std::string(name) + "." + region.name;
+			if (!region.sharedRing->open(regionName.c_str(), slotCount, maxSprites, sizeof(AppSharedSpriteLayout), offsets))
 			{
-				// bump your refcount so that things work smoothly
-				NRP->setResource(NX_APEX_EMITTER_AUTHORING_TYPE_NAME, emitterAssetName, mEmitterAsset, true);
+				return false;
 			}
-			else
+		}
+		return true;
+	}
+
+	void destroySharedSprites()
+	{
+		mApexRenderResourceManager.mSpriteBufferSettings.sharedRing = NULL;
+		mSharedSprites.close();
+
+		for (PxU32 i = 0; i < mRenderRegions.size(); i++)
+		{
+			delete mRenderRegions[i].sharedRing;
+			mRenderRegions[i].sharedRing = NULL;
+		}
+	}
+
+	// Replaces the single render volume with tiles[0] * tiles[1] * tiles[2] regions over the
+	// domain (by default the turbulence grid, or a box around the origin without turbulence)
+	// and a catch-all region at a lower priority for the particles outside of it.  Call it
+	// before initSharedSprites and initCamera, which set up the regions they find.
+	bool initRenderRegions(const PxU32 tiles[3], const PxBounds3* domain)
+	{
+		PxBounds3 box(PxVec3(-100.0f), PxVec3(100.0f));
+		if (domain)
+		{
+			box = *domain;
+		}
+		else if (mTurbulenceActor)
+		{
+			PxVec3 gridSize = reinterpret_cast<NxTurbulenceFSActor*>(mTurbulenceActor)->getGridSize();
+			box = PxBounds3(mTurbulenceCenter - gridSize * 0.5f, mTurbulenceCenter + gridSize * 0.5f);
+		}
+
+		destroyRenderRegions();
+		mRenderRegions.resize(tiles[0] * tiles[1] * tiles[2] + 1);
+
+		PxVec3 tileSize = box.maximum - box.minimum;
+		tileSize = PxVec3(tileSize.x / tiles[0], tileSize.y / tiles[1], tileSize.z / tiles[2]);
+		PxU32 index = 0;
+		for (PxU32 z = 0; z < tiles[2]; z++)
+		{
+			for (PxU32 y = 0; y < tiles[1]; y++)
 			{
-				printf("Failed to create the APEX Emitter Asset\n");
-				return false;
+				for (PxU32 x = 0; x < tiles[0]; x++)
+				{
+					char name[32];
+					sprintf_s(name, sizeof(name), "tile%u", index);
+
+					AppRenderRegion& region = mRenderRegions[index++];
+					PxVec3 tileMin = box.minimum + PxVec3(x * tileSize.x, y * tileSize.y, z * tileSize.z);
+					region.name = name;
+					region.bounds = PxBounds3(tileMin, tileMin + tileSize);
+					region.priority = 1;
+				}
 			}
-		
-			// get the actor creation parameters from the asset
-			NxParameterized::Interface* actorParams = mEmitterAsset->getDefaultActorDesc();
-		
-			// this will prevent the particles added to the actor from being emitted by the asset's particle list
-			// this is a little confusing, but you'll get double the particles if you don't do this
-			// these parameters can be found in the NxParameterized documentation
-			NxParameterized::setParamBool(*actorParams, "emitAssetParticles", false);
-		
-			mEmitterActor = mEmitterAsset->createApexActor(*actorParams, *mApexScene);
-			if (!mEmitterActor)
+		}
+
+		AppRenderRegion& outside = mRenderRegions[index];
+		outside.name = "outside";
+		outside.bounds.setMaximal();
+		outside.priority = 0;
+
+		if (!createRegionVolumes(NULL))
+		{
+			return false;
+		}
+
+		printf("Rendering %u regions of (%.1f, %.1f, %.1f) over (%.1f, %.1f, %.1f) - (%.1f, %.1f, %.1f)\n",
+			index, tileSize.x, tileSize.y, tileSize.z,
+			box.minimum.x, box.minimum.y, box.minimum.z, box.maximum.x, box.maximum.y, box.maximum.z);
+		return true;
+	}
+
+	// (Re)creates the render volume of every region, limited to clip when it is given;
+	// regions entirely outside of clip get no volume and are skipped
+	bool createRegionVolumes(const PxBounds3* clip)
+	{
+		for (PxU32 i = 0; i < mRenderRegions.size(); i++)
+		{
+			AppRenderRegion& region = mRenderRegions[i];
+			if (region.volume)
+			{
+				mIofxModule->releaseRenderVolume(*region.volume);
+				region.volume = NULL;
+			}
+
+			PxBounds3 bounds = region.bounds;
+			if (clip)
+			{
+				bounds.minimum = PxVec3(PxMax(bounds.minimum.x, clip->minimum.x), PxMax(bounds.minimum.y, clip->minimum.y), PxMax(bounds.minimum.z, clip->minimum.z));
+				bounds.maximum = PxVec3(PxMin(bounds.maximum.x, clip->maximum.x), PxMin(bounds.maximum.y, clip->maximum.y), PxMin(bounds.maximum.z, clip->maximum.z));
+				if (bounds.isEmpty())
+				{
+					continue;
+				}
+			}
+
+			region.volume = mIofxModule->createRenderVolume(*mApexScene, bounds, region.priority, true);
+			if (!region.volume)
 			{
-				printf("Failed to create the APEX Emitter Actor\n");
+				printf("Error creating the render volume of region %s\n", region.name.c_str());
 				return false;
 			}
+		}
+		return true;
+	}
 
-			// tell the emitter to emit the particles it finds in its list every frame
-			// We will be using the emitter in a mode where we clear the insertion particle list every frame
-			// and add one of our own.
-			NxApexEmitterActor* actor = reinterpret_cast<NxApexEmitterActor*>(mEmitterActor);
-			actor->startEmit(true);
+	void destroyRenderRegions()
+	{
+		for (PxU32 i = 0; i < mRenderRegions.size(); i++)
+		{
+			if (mRenderRegions[i].volume)
+			{
+				mIofxModule->releaseRenderVolume(*mRenderRegions[i].volume);
+			}
+			delete mRenderRegions[i].sharedRing;
 		}
+		mRenderRegions.clear();
+	}
 
-		// turbulence asset and actor
-		if (useTurbulence)
+	// this method calls the render API on the IOFX actors of every region's render volume,
+	// the regions are extracted concurrently on the worker pool
+	// our callbacks just copy the sprites, outputParticleData prints them
+	void extractParticleData()
+	{
+		AppTimer timer;
+		ExtractBody extract(*this);
+		mWorkerPool.parallelFor(PxU32(mRenderRegions.size()), 1, extract);
+		extractCpuParticles();
+
+		PxU32 liveParticles = mCpuParticles.getCount();
+		for (PxU32 i = 0; i < mRenderRegions.size(); i++)
 		{
-			const char* turbulenceAssetName = "turbulenceFSAsset";
-			mTurbulenceAsset = reinterpret_cast<NxApexAsset*>(NRP->getResource(NX_TURBULENCE_FS_AUTHORING_TYPE_NAME, turbulenceAssetName));
-			if (mTurbulenceAsset)
+			liveParticles += mRenderRegions[i].objectCount;
+		}
+		mMetrics.setLiveParticles(liveParticles);
+		if (mParticleExtractPhase != PX_MAX_U32)
+		{
+			mMetrics.recordPhase(mParticleExtractPhase, timer.elapsedMs());
+		}
+	}
+
+	// Writes the CPU particles as sprites into their own buffer, which has no region
+	void extractCpuParticles()
+	{
+		PxU32 count = mCpuParticles.getCount();
+		mCpuSprites.mSpriteData.resize(count);
+		if (count)
+		{
+			mCpuParticles.writeSprites(&mCpuSprites.mSpriteData[0], mCpuOutputById ? mCpuParticles.sortById(mWorkerPool) : NULL);
+		}
+		mCpuSprites.mSpriteCount = count;
+		mCpuSprites.mOutputBegin = 0;
+		mCpuSprites.mOutputEnd = count;
+	}
+
+	// Gathers the extracted sprites of every buffer into one frame, which is culled and
+	// sorted as a whole, then printed and published to the shared rings, from the output
+	// job.  The buffer list is locked since APEX may release buffers while it simulates.
+	void outputParticleData(PxU32 frame)
+	{
+		if (mSharedSprites.isOpen())
+		{
+			mSharedSprites.beginFrame(frame);
+		}
+		for (PxU32 i = 0; i < mRenderRegions.size(); i++)
+		{
+			if (mRenderRegions[i].sharedRing)
 			{
-				// bump your refcount so that things work smoothly
-				NRP->setResource(NX_TURBULENCE_FS_AUTHORING_TYPE_NAME, turbulenceAssetName, mTurbulenceAsset, true);
+				mRenderRegions[i].sharedRing->beginFrame(frame);
 			}
-			else
+		}
+
+		mSpriteFrame.clear();
+		EnterCriticalSection(&mApexRenderResourceManager.mListLock);
+		std::list<AppSpriteBuffer>& buffers = mApexRenderResourceManager.mSpriteBufferList;
+		for (std::list<AppSpriteBuffer>::iterator it = buffers.begin(); it != buffers.end(); ++it)
+		{
+			mSpriteFrame.add(*it);
+		}
+		LeaveCriticalSection(&mApexRenderResourceManager.mListLock);
+		mSpriteFrame.add(mCpuSprites);
+		mSpriteFrame.output(mApexRenderResourceManager.mSpriteBufferSettings, mRenderRegions);
+
+		for (PxU32 i = 0; i < mRenderRegions.size(); i++)
+		{
+			if (mRenderRegions[i].sharedRing)
 			{
-				printf("Failed to create the Turbulence Asset\n");
-				return false;
+				mRenderRegions[i].sharedRing->endFrame();
+			}
+			if (mRenderRegions.size() > 1 && mRenderRegions[i].objectCount)
+			{
+				APP_LOG_INFO(0, "Region %s: %u particles\n", mRenderRegions[i].name.c_str(), mRenderRegions[i].objectCount);
+			}
+		}
+		if (mSharedSprites.isOpen())
+		{
+			mSharedSprites.endFrame();
+		}
+	}
+
+	// Updates the render resources of one region's IOFX actors.  The volume and actor locks
+	// keep this safe against other regions being extracted at the same time.
+	void extractRegion(AppRenderRegion& region)
+	{
+		region.objectCount = 0;
+		if (!region.volume)
+		{
+			return;
+		}
+
+		physx::PxU32 numActors;
+		region.volume->lockRenderResources();
+		NxIofxActor* const* actors = region.volume->getIofxActorList(numActors);
+		for (physx::PxU32 j = 0 ; j < numActors ; j++)
+		{
+			actors[j]->lockRenderResources();
+			if (!actors[j]->getBounds().isEmpty() &&
+				(!mCamera.isEnabled() || actors[j]->getBounds().intersects(mCamera.getBounds())))
+			{
+				// the region becomes the context of the sprite buffers the actor creates
+				actors[j]->updateRenderResources(false, &region);
+				// for our purposes (printing the positions to STDOUT), DRR is not required
+				//actors[j]->dispatchRenderResources(mApexRenderer);
+				region.objectCount += actors[j]->getObjectCount();
 			}
+			actors[j]->unlockRenderResources();
+		}
+		region.volume->unlockRenderResources();
+	}
 
-			// get the actor creation parameters from the asset
-			NxParameterized::Interface* actorParams = mTurbulenceAsset->getDefaultActorDesc();
-			mTurbulenceActor = mTurbulenceAsset->createApexActor(*actorParams, *mApexScene);
-			if (!mTurbulenceActor)
+	// Steps the CPU particles on the worker pool with the field of the last extraction, and
+	// sorts them when it is time
+	void stepCpuParticles(PxF32 dt)
+	{
+		if (!mCpuParticles.isEnabled())
+		{
+			return;
+		}
+
+		AppCpuParticles::Flow flow;
+		flow.sparse = mSparseGrid.isEnabled() ? &mSparseGrid : NULL;
+		flow.dense = mVelocityCaptured ? &mVelocityGrid : NULL;
+		flow.wind = mWind.isEnabled() ? &mWind : NULL;
+		mCpuParticles.step(mWorkerPool, dt, flow);
+
+		if (mParticleReorder.isEnabled() && mFrame % mReorderFrames == 0)
+		{
+			mCpuParticles.reorder(mParticleReorder);
+		}
+	}
+
+	// dirt simple simulate-fetchresults, blocking during simulation; the CPU particles step
+	// while APEX simulates
+	void simulateFrame(PxF32 dt)
+	{
+		if (!mApexScene)
+		{
+			APP_LOG_ERROR(0, "Error, no APEX Scene created\n");
+			return;
+		}
+		else
+		{
+			mApexScene->simulate(dt);
+			stepCpuParticles(dt);
+			PxU32 errorState = 0;
+			mApexScene->fetchResults(true, &errorState);
+			if (errorState)
 			{
-				printf("Failed to create the Turbulence Actor\n");
-				return false;
+				APP_LOG_ERROR(0, "Error simulating APEX: %i\n", errorState);
 			}
-			NxTurbulenceFSActor* actor = reinterpret_cast<NxTurbulenceFSActor*>(mTurbulenceActor);
-			actor->setEnabled(true);
-			
-			// the grid is placed with the bottom just 1 unit above the origin, this way
-			// the particles move up freely for one frame, then begin to slow once they are in the grid
-			PxVec3 gridSize = actor->getGridSize();
-			PxMat44 pose = PxMat44::createIdentity();
-			pose.setPosition(PxVec3(0.0f, gridSize.y * 0.5f + 1.0f, 0.0f));
-			actor->setPose(pose);
 
-			// an external acceleration gives us a more interesting setup
-			actor->setExternalVelocity(PxVec3(60.0f, 0.0f, 0.0f));
+			mApexScene->prepareRenderResourceContexts();
+			mFrame++;
+		}
+	}
+
+	// Splits the domain with the other ranks of a multi-process run into slabs along the
+	// dominant axis of the external velocity, which is where particles drift.  The ranks
+	// simulate CPU particles, which migrate between them.
+	bool initDecomposition(const char* session, PxU32 rank, PxU32 rankCount, PxF32 domainMin, PxF32 domainMax)
+	{
+		PxVec3 drift(PxAbs(mExternalVelocity.x), PxAbs(mExternalVelocity.y), PxAbs(mExternalVelocity.z));
+		PxU32 axis = drift.x >= drift.y && drift.x >= drift.z ? 0 : (drift.y >= drift.z ? 1 : 2);
+
+		if (!mTransport.connect(session, rank, rankCount))
+		{
+			return false;
+		}
+		if (!mCpuParticles.isEnabled())
+		{
+			printf("Error: a split domain needs the CPU particles\n");
+			return false;
 		}
+		mSlabs.init(mTransport, axis, domainMin, domainMax);
 
+		printf("Rank %u of %u, slab %u of [%.1f, %.1f) along %c\n", rank, rankCount, rank, domainMin, domainMax, "xyz"[axis]);
 		return true;
 	}
 
-	void destroyAssetsAndActors()
+	void destroyDecomposition()
 	{
-		releaseAndClear(mEmitterActor);
-		// instead of releasing the asset directly, allow the NRP to do it because we used the
-		// NRP to create it
-		if (mEmitterAsset)
+		if (mSlabs.isEnabled())
 		{
-			NxResourceProvider* NRP = mApexSDK->getNamedResourceProvider();
-			NRP->releaseResource(mEmitterAsset->getObjTypeName(), mEmitterAsset->getName());
-			mEmitterAsset = NULL;
+			printf("Rank %u handed %u particles to its neighbours\n", mSlabs.getRank(), mSlabs.getMigratedCount());
 		}
+		mTransport.close();
+	}
 
-		releaseAndClear(mTurbulenceActor);
-		// instead of releasing the asset directly, allow the NRP to do it because we used the
-		// NRP to create it
-		if (mTurbulenceAsset)
+	// Hands the CPU particles that left this slab to the neighbours and adopts theirs,
+	// after the step and before the extraction, so every particle is output by the one rank
+	// that holds it
+	void migrateParticles()
+	{
+		if (!mSlabs.isEnabled())
 		{
-			NxResourceProvider* NRP = mApexSDK->getNamedResourceProvider();
-			NRP->releaseResource(mTurbulenceAsset->getObjTypeName(), mTurbulenceAsset->getName());
-			mTurbulenceAsset = NULL;
+			return;
 		}
 
+		mCpuParticles.emigrate(mSlabs);
+		if (!mSlabs.exchange(mExtractedFrame, mImmigrants))
+		{
+			APP_LOG_ERROR(0, "Particle migration failed in frame %u\n", mExtractedFrame);
+			return;
+		}
+		mCpuParticles.adopt(mImmigrants);
 	}
 
-	// this method just adds a single particle at the origin, shooting straight up (y-up)
-	void addParticle()
+	// Points the APEX scene matrices at the camera and limits extraction and output to what
+	// it sees: the render volumes only take IOFX actors inside the frustum's box, and the
+	// frame output culls and depth sorts what is left
+	bool initCamera(const AppCamera::Config& config)
 	{
-		if (!mEmitterActor)
+		mCamera.init(config);
+		mApexScene->setViewMatrix(mCamera.getViewMatrix(), mViewMatrixId);
+		mApexScene->setProjMatrix(mCamera.getProjMatrix(), mProjMatrixId);
+		mApexScene->setProjParams(config.nearZ, config.farZ, config.fovY, config.width, config.height, mProjMatrixId);
+
+		PxBounds3 frustumBounds = mCamera.getBounds();
+		if (!createRegionVolumes(&frustumBounds))
 		{
-			printf("Emitter actor is not initialized\n");
-			return;
+			return false;
 		}
 
-		NxApexEmitterActor* actor = reinterpret_cast<NxApexEmitterActor*>(mEmitterActor);
-		NxEmitterExplicitGeom* geom = actor->isExplicitGeom();
-		if (geom)
+		AppSpriteBufferSettings& settings = mApexRenderResourceManager.mSpriteBufferSettings;
+		settings.camera = &mCamera;
+		settings.cullingPool = &mWorkerPool;
+		return true;
+	}
+
+	// Sets up the frame as a job graph.  Within a run for frame N:
+	//   submit(N) > simulate(N) > extract(N)		main thread, they call into APEX
+	//   submit(N) > stage(N+1)				worker, overlaps simulate(N)
+	//   output(N-1) > extract(N)				worker, overlaps simulate(N)
+	// stage only fills the spawn list, which submit has already copied out.  extract waits
+	// for output because it refills the data output reads; it also hands the CPU particles
+	// that left the slab to the other ranks and steps the sparse grid, which the next
+	// frame's simulate samples for the CPU particles.
+	void initFrameGraph(PxF32 dt)
+	{
+		mFrameDt = dt;
+		PxU32 output = mFrameGraph.addJob("output", mOutputJob, false);
+		PxU32 submit = mFrameGraph.addJob("submit", mSubmitJob, true);
+		PxU32 stage = mFrameGraph.addJob("stage", mStageJob, false);
+		PxU32 simulate = mFrameGraph.addJob("simulate", mSimulateJob, true);
+		PxU32 extract = mFrameGraph.addJob("extract", mExtractJob, true);
+		mSimulateNode = simulate;
+		mExtractNode = extract;
+		mFrameGraph.addDependency(stage, submit);
+		mFrameGraph.addDependency(stage, output);
+		mFrameGraph.addDependency(simulate, submit);
+		mFrameGraph.addDependency(extract, simulate);
+		mFrameGraph.addDependency(extract, output);
+
+		// every job is a phase of the metrics, and so is the particle extraction, named as a
+		// part of extract since its time is included in extract's
+		for (PxU32 i = 0; i < mFrameGraph.getJobCount(); i++)
 		{
-			PxVec3 pos(0.0f);
-			PxVec3 vel(0.0f, 60.0f, 0.0f);
-			
-			geom->resetParticleList();
-			geom->addParticleList(1, &pos, &vel);
+			mJobPhases.push_back(mMetrics.addPhase(mFrameGraph.getJobName(i)));
 		}
+		mParticleExtractPhase = mMetrics.addPhase("extract/particles");
+
+		// the first frame's particles
+		stageParticles();
 	}
 
-	// this method calls the render API on the render volume's IOFX actors
-	// our callbacks just print the particle positions
-	void printParticleData()
+	void runFrame()
 	{
-		physx::PxU32 numActors;
-		physx::PxU32 drawnParticles = 0;
+		mFrameGraph.run(mWorkerPool);
+		updateLodBudget();
+		mMetrics.recordFrame(mFrameGraph.getWallMs());
+		if (!mStartup.isFinished())
+		{
+			mStartup.record("First frame", mFrameGraph.getWallMs());
+			mStartup.finish();
+		}
+		for (PxU32 i = 0; i < mJobPhases.size(); i++)
+		{
+			mMetrics.recordPhase(mJobPhases[i], mFrameGraph.getJobMs(i));
+		}
+		APP_LOG_INFO(0, "Frame %u: %.2f ms, critical path %.2f ms: %s\n", mFrame - 1,
+			mFrameGraph.getWallMs(), mFrameGraph.getCriticalPathMs(), mFrameGraph.describeCriticalPath().c_str());
+	}
 
-		mRenderVolume->lockRenderResources();
-		NxIofxActor* const* actors = mRenderVolume->getIofxActorList(numActors);
-		for (physx::PxU32 j = 0 ; j < numActors ; j++)
+	// Serves the frame metrics on localhost while the simulation runs
+	bool initMetrics(PxU32 port)
+	{
+		return mMetricsServer.start(mMetrics, port);
+	}
+
+	void destroyMetrics()
+	{
+		mMetricsServer.stop();
+	}
+
+	// The last frame's output has no next frame to overlap with
+	void finishFrames()
+	{
+		outputFrame();
+	}
+
+	void printStartupReport()
+	{
+		mStartup.print();
+	}
+
+	// Reports the device each part of the simulation ran on, as the scene's task manager
+	// dispatched it: APEX runs the IOS and IOFX on CUDA only when the scene has a GPU dispatcher
+	void printExecutionReport()
+	{
+		PxTaskManager* taskManager = mPhysxScene->getTaskManager();
+		bool gpu = taskManager && taskManager->getGpuDispatcher();
+
+		char cpu[64];
+		char cuda[128];
+		sprintf_s(cpu, sizeof(cpu), "CPU (%u dispatcher threads)", mThreadPool->getWorkerCount());
+		sprintf_s(cuda, sizeof(cuda), "GPU (%s)", mCudaContext ? mCudaContext->getDeviceName() : "unknown device");
+
+		printf("Execution:\n");
+		printf("  PhysX scene:  %s%s\n", cpu, gpu ? ", GPU dispatcher attached" : "");
+		printf("  Particle IOS: %s\n", gpu ? cuda : cpu);
+		printf("  IOFX:         %s\n", gpu ? cuda : cpu);
+		printf("  TurbulenceFS: %s\n", mTurbulenceActor ? cuda : (mTurbulenceFSModule ? "not used" : "not loaded, needs CUDA"));
+		if (mCpuParticles.isEnabled())
 		{
-			actors[j]->lockRenderResources();
-			if (!actors[j]->getBounds().isEmpty())
-			{
-				// more explaination of this context required
-				static char* emitterParticleContext = "EmitterParticleDataContext";
-				actors[j]->updateRenderResources(false, emitterParticleContext);
-				// for our purposes (printing the positions to STDOUT), DRR is not required
-				//actors[j]->dispatchRenderResources(mApexRenderer);
-				drawnParticles += actors[j]->getObjectCount();
-			}
-			actors[j]->unlockRenderResources();
+			printf("  CPU particles: CPU (%u worker threads)%s\n", mWorkerPool.getWorkerCount() + 1,
+				mSparseGrid.isEnabled() ? ", sparse grid" : "");
 		}
-		mRenderVolume->unlockRenderResources();
 	}
 
-	// dirt simple simulate-fetchresults, blocking during simulation
-	void simulateFrame(PxF32 dt)
+	// The frame stages run by the job graph
+	void simulateStage()
 	{
-		if (!mApexScene)
+		simulateFrame(mFrameDt);
+	}
+
+	// copies out what the output job needs, everything that touches APEX happens here
+	void extractFrame()
+	{
+		mExtractedFrame = mFrame - 1;
+		migrateParticles();
+		extractParticleData();
+		captureSparseGrid();
+		captureVelocityField(mExtractedFrame);
+		stepSparseGrid(mFrameDt);
+	}
+
+	// writes out the extracted frame while the next one simulates
+	void outputFrame()
+	{
+		// nothing extracted yet before the first frame
+		if (mExtractedFrame != PX_MAX_U32)
 		{
-			printf("Error, no APEX Scene created\n");
-			return;
+			outputParticleData(mExtractedFrame);
+			exportVolume(mExtractedFrame, (mExtractedFrame + 1) * mFrameDt);
 		}
-		else
+	}
+
+	// Binds a stage method to a job graph node
+	class StageJob : public AppWorkerPool::Job
+	{
+	public:
+		typedef void (AppContext::*Stage)();
+
+		StageJob(AppContext& context, Stage stage)
+			: mContext(context)
+			, mStage(stage)
+		{}
+
+		void execute()
 		{
-			mApexScene->simulate(dt);
-			PxU32 errorState = 0;
-			mApexScene->fetchResults(true, &errorState);
-			if (errorState)
+			(mContext.*mStage)();
+		}
+
+	private:
+		AppContext&	mContext;
+		Stage		mStage;
+	};
+
+	// Extracts one render region per index
+	class ExtractBody : public AppRangeBody
+	{
+	public:
+		ExtractBody(AppContext& context)
+			: mContext(context)
+		{}
+
+		void run(PxU32 /*chunk*/, PxU32 begin, PxU32 end)
+		{
+			for (PxU32 i = begin; i < end; i++)
 			{
-				printf("Error simulating APEX: %i\n", errorState);
+				mContext.extractRegion(mContext.mRenderRegions[i]);
 			}
-
-			mApexScene->prepareRenderResourceContexts();
 		}
-	}
+
+	private:
+		ExtractBody& operator=(const ExtractBody&);
+
+		AppContext&	mContext;
+	};
+
+	// Startup
+	AppStartupPlan				mStartupPlan;
+	AppStartupProfiler			mStartup;
 
 	// Callback classes
 	AppAlloc					mAppAllocator;
@@ -950,6 +7614,12 @@ public:
 	PxDefaultCpuDispatcher*		mThreadPool;
 	PxCudaContextManager*		mCudaContext;
 
+	// Static environment colliders
+	AppCookedMeshCache			mMeshCache;
+	PxMaterial*					mColliderMaterial;
+	std::vector<PxTriangleMesh*>	mColliderMeshes;
+	std::vector<PxRigidStatic*>	mColliders;
+
 	// APEX pointers
 	NxApexSDK*					mApexSDK;
 	NxApexScene*				mApexScene;
@@ -957,34 +7627,372 @@ public:
 	NxModule*					mTurbulenceFSModule;
 	NxModuleIofx*				mIofxModule;
 	NxModule*					mLegacyModule;
-	NxApexRenderVolume*			mRenderVolume;
+	std::vector<AppRenderRegion>	mRenderRegions;
+	PxU32						mViewMatrixId;
+	PxU32						mProjMatrixId;
+	AppCamera					mCamera;
 	NxApexAsset*				mEmitterAsset;
-	NxApexActor*				mEmitterActor;
+	AppEmitterPool				mEmitterPool;
+	std::vector<PxU32>			mEmitters;	// pool handles of the scene's emitters
 	NxApexAsset*				mTurbulenceAsset;
 	NxApexActor*				mTurbulenceActor;
+	PxVec3						mTurbulenceCenter;
+	PxVec3						mExternalVelocity;
+
+	// Turbulence field export, the CPU particles and their sparse field
+	AppVelocityGrid				mVelocityGrid;
+	AppVolumeExporter			mVolumeExporter;
+	AppCpuParticles				mCpuParticles;
+	AppSpriteBuffer				mCpuSprites;
+	bool						mCpuOutputById;
+	AppParticleReorder			mParticleReorder;
+	PxU32						mReorderFrames;
+	AppSparseVelocityGrid		mSparseGrid;
+
+	// Sprite output and the feed for other processes
+	AppSpriteFrame				mSpriteFrame;
+	AppSharedSpriteRing			mSharedSprites;
+
+	// Frame time control
+	AppLodController			mLodController;
+	PxF32						mEmissionCredit;
+
+	// Particle staging
+	struct SpawnParticle
+	{
+		PxVec3	position;
+		PxVec3	velocity;
+		PxU32	emitter;	// pool handle
+		PxU32	id;			// the CPU particle's, alike on every rank
+	};
+
+	AppWorkerPool				mWorkerPool;
+	std::vector<SpawnParticle>	mSpawnList;
+	std::vector<PxVec3>			mSpawnPositions;
+	std::vector<PxVec3>			mSpawnVelocities;
+	std::vector<PxU32>			mSpawnEmitters;
+	std::vector<PxU32>			mSpawnIds;
+	PxU32						mFrame;
+	PxU32						mNextSpawnId;
+
+	// Procedural wind
+	AppWindField				mWind;
+	std::vector<PxVec3>			mWindPositions;
+	std::vector<PxVec3>			mWindVelocities;
+
+	// Frame scheduling
+	AppJobGraph					mFrameGraph;
+	StageJob					mStageJob;
+	StageJob					mSubmitJob;
+	StageJob					mSimulateJob;
+	StageJob					mExtractJob;
+	StageJob					mOutputJob;
+	PxU32						mSimulateNode;	// graph nodes the LOD controller times
+	PxU32						mExtractNode;
+	PxF32						mFrameDt;
+	PxU32						mExtractedFrame;	// PX_MAX_U32 before the first extraction
+	bool						mVelocityCaptured;	// mVelocityGrid holds the extracted frame's field
+
+	// Live metrics
+	AppMetrics					mMetrics;
+	AppMetricsServer			mMetricsServer;
+	std::vector<PxU32>			mJobPhases;		// metrics phase of every frame graph job
+	PxU32						mParticleExtractPhase;
+
+	// Domain decomposition between processes
+	AppPipeTransport			mTransport;
+	AppSlabDecomposition		mSlabs;
+	std::vector<AppSlabDecomposition::Migrant>	mImmigrants;
+};
+
+
+// The tests include this file for its classes and bring their own main
+#ifndef APP_NO_MAIN
+
+// Measures the CPU particle step, which samples the turbulence grid once per particle, with
+// the particles in emission order (scattered over the grid, as from many interleaved
+// emitters) and after the Morton reordering
+static int runMortonBenchmark()
+{
+	AppWorkerPool pool;
+	if (!pool.start())
+	{
+		printf("Error starting the worker pool\n");
+		return 1;
+	}
+
+	// a 128^3 field is 24 MB, well beyond the caches
+	const PxU32 GRID_DIM = 128;
+	PxU32 seed = 0x12345678;
+	AppVelocityGrid grid;
+	grid.resize(GRID_DIM, GRID_DIM, GRID_DIM);
+	grid.origin = PxVec3(0.5f);
+	grid.spacing = PxVec3(1.0f);
+	for (PxU32 i = 0; i < grid.velocity.size(); i++)
+	{
+		seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+		grid.velocity[i] = PxVec3(PxF32(seed & 0xff), PxF32((seed >> 8) & 0xff), PxF32((seed >> 16) & 0xff)) * (1.0f / 256.0f);
+	}
+	AppCpuParticles::Flow flow;
+	flow.dense = &grid;
+
+	// steps short enough that the particles stay in their cells and live through the run
+	const PxF32 dt = 1e-3f;
+	const PxU32 STEPS = 4;
+	const PxU32 counts[] = { 10000, 100000, 1000000, 4000000 };
+	printf("CPU particle step throughput, %u^3 grid, %u worker threads\n", GRID_DIM, pool.getWorkerCount() + 1);
+	for (PxU32 c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+	{
+		std::vector<PxVec3> positions(counts[c]);
+		std::vector<PxVec3> velocities(counts[c], PxVec3(0.0f));
+		for (PxU32 i = 0; i < counts[c]; i++)
+		{
+			PxF32 p[3];
+			for (PxU32 a = 0; a < 3; a++)
+			{
+				seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+				p[a] = PxF32(seed % (GRID_DIM * 256)) / 256.0f;
+			}
+			positions[i] = PxVec3(p[0], p[1], p[2]);
+		}
+
+		AppCpuParticles::Config config;
+		config.capacity = counts[c];
+		config.lifetime = 1000.0f;
+		AppCpuParticles particles;
+		particles.init(config);
+		particles.emit(&positions[0], &velocities[0], counts[c]);
+
+		AppTimer timer;
+		for (PxU32 i = 0; i < STEPS; i++)
+		{
+			particles.step(pool, dt, flow);
+		}
+		double emissionMs = timer.elapsedMs() / STEPS;
+
+		AppParticleReorder reorder;
+		reorder.init(pool);
+		reorder.setGrid(PxVec3(0.0f), PxVec3(GRID_DIM / 1024.0f));
+		timer.reset();
+		particles.reorder(reorder);
+		double reorderMs = timer.elapsedMs();
+
+		timer.reset();
+		for (PxU32 i = 0; i < STEPS; i++)
+		{
+			particles.step(pool, dt, flow);
+		}
+		double mortonMs = timer.elapsedMs() / STEPS;
+
+		printf("%9u particles: emission order %8.2f Mparticles/s, morton order %8.2f Mparticles/s, reorder %8.3f ms\n",
+			counts[c], counts[c] / (emissionMs * 1000.0), counts[c] / (mortonMs * 1000.0), reorderMs);
+	}
+
+	pool.stop();
+	return 0;
+}
+
+
+// Starts ranks 1..rankCount-1 of a multi-process run as copies of this process, with the
+// same options plus their rank and the session that names the pipes between them
+static bool launchRanks(int argc, char** argv, const AppOptions& options, std::vector<HANDLE>& processes)
+{
+	char path[MAX_PATH];
+	if (!GetModuleFileName(NULL, path, MAX_PATH))
+	{
+		printf("Error: cannot find the executable to launch the ranks\n");
+		return false;
+	}
+
+	std::string arguments;
+	for (int i = 1; i < argc; i++)
+	{
+		arguments += std::string(" ") + argv[i];
+	}
+
+	for (PxU32 rank = 1; rank < options.rankCount; rank++)
+	{
+		char rankArguments[64];
+		sprintf_s(rankArguments, sizeof(rankArguments), " rank=%u session=%s", rank, options.session.c_str());
+		std::string commandLine = std::string("\"") + path + "\"" + arguments + rankArguments;
+
+		STARTUPINFO startup;
+		PROCESS_INFORMATION process;
+		memset(&startup, 0, sizeof(startup));
+		startup.cb = sizeof(startup);
+		if (!CreateProcess(path, &commandLine[0], NULL, NULL, FALSE, 0, NULL, NULL, &startup, &process))
+		{
+			printf("Error: cannot launch rank %u\n", rank);
+			return false;
+		}
+		CloseHandle(process.hThread);
+		processes.push_back(process.hProcess);
+	}
+	return true;
+}
+
+// Waits for the launched ranks; false if any of them failed
+static bool waitForRanks(std::vector<HANDLE>& processes)
+{
+	bool ok = true;
+	for (PxU32 i = 0; i < processes.size(); i++)
+	{
+		DWORD exitCode = 1;
+		if (WaitForSingleObject(processes[i], INFINITE) != WAIT_OBJECT_0 || !GetExitCodeProcess(processes[i], &exitCode))
+		{
+			exitCode = 1;
+		}
+		CloseHandle(processes[i]);
+		if (exitCode != 0)
+		{
+			printf("Rank %u failed with exit code %u\n", i + 1, PxU32(exitCode));
+			ok = false;
+		}
+	}
+	processes.clear();
+	return ok;
+}
+
+// Terminates the launched ranks nobody waited for when main fails after launching them,
+// they would block on their pipes forever.  waitForRanks leaves it nothing to do.
+class AppRankGuard
+{
+public:
+	AppRankGuard(std::vector<HANDLE>& processes)
+		: mProcesses(processes)
+	{}
+
+	~AppRankGuard()
+	{
+		for (PxU32 i = 0; i < mProcesses.size(); i++)
+		{
+			TerminateProcess(mProcesses[i], 1);
+			WaitForSingleObject(mProcesses[i], INFINITE);
+			CloseHandle(mProcesses[i]);
+		}
+		mProcesses.clear();
+	}
+
+private:
+	AppRankGuard& operator=(const AppRankGuard&);
+
+	std::vector<HANDLE>&	mProcesses;
 };
 
+// Attaches to the shared sprite ring of a running simulation and prints what it reads,
+// until the simulation closes the ring or nothing arrives for a few seconds
+static int runSharedSpriteConsumer(const char* name)
+{
+	AppSharedSpriteReader reader;
+	if (!reader.attach(name))
+	{
+		return 1;
+	}
+
+	const AppSharedSprites::Header& header = reader.getHeader();
+	PxU32 positionOffset = header.semanticOffsets[NxRenderSpriteLayoutElement::POSITION_FLOAT3];
+	AppSharedSpriteReader::Frame frame;
+	while (reader.acquire(frame, 5000))
+	{
+		printf("Frame %u: %u sprites", frame.slot->frame, frame.slot->spriteCount);
+		if (frame.slot->droppedSprites)
+		{
+			printf(" (%u did not fit)", frame.slot->droppedSprites);
+		}
+		printf("\n");
+
+		for (PxU32 i = 0; i < frame.slot->spriteCount && positionOffset != PX_MAX_U32; i++)
+		{
+			const PxVec3& pos = *reinterpret_cast<const PxVec3*>(frame.sprites + i * header.spriteStride + positionOffset);
+			printf(" (%.1f, %.1f, %.1f)\n", pos.x, pos.y, pos.z);
+		}
+
+		if (!frame.isValid())
+		{
+			printf("Warning, frame %u was overwritten while it was read\n", frame.slot->frame);
+		}
+	}
+
+	printf("Consumer done, %u frames lost to overruns\n", reader.getLostFrames());
+	return 0;
+}
+
+// WinMain waits for ENTER before the console closes, except in the ranks another rank
+// launched: nobody watches their consoles and the first rank waits for them to exit
+static bool gPauseOnExit = true;
 
-// command line arg "noTurbulence" will simulate without the turbulence actor
+// command line arg "noTurbulence" will simulate without the turbulence actor, see
+// the program description for the other options
 int main(int argc, char **argv)
 {
 	printf("APEX Particle Sample\n");
 
-	bool useTurbulence = true;
-	if (argc>1)
+	// the frame loop logs through the asynchronous logger, everything else still uses printf
+	AppLog::Session logSession;
+
+	AppOptions options;
+	if (!options.parse(argc, argv))
+	{
+		return 1;
+	}
+	gPauseOnExit = options.rank == 0;
+
+	if (options.benchmarkMorton)
+	{
+		return runMortonBenchmark();
+	}
+
+	if (!options.consumeSharedSprites.empty())
 	{
-		if (!stricmp(argv[1], "noTurbulence"))
+		return runSharedSpriteConsumer(options.consumeSharedSprites.c_str());
+	}
+
+	// The first rank of a multi-process run launches the others.  Every rank publishes
+	// its own sprite ring and only the first exports the (identical) turbulence field.
+	std::vector<HANDLE> rankProcesses;
+	AppRankGuard rankGuard(rankProcesses);
+	if (options.rankCount > 1)
+	{
+		if (options.session.empty())
 		{
-			useTurbulence = false;
+			char session[32];
+			sprintf_s(session, sizeof(session), "%u", GetCurrentProcessId());
+			options.session = session;
+			if (!launchRanks(argc, argv, options, rankProcesses))
+			{
+				return 1;
+			}
+		}
+		if (!options.sharedSprites.empty())
+		{
+			char suffix[32];
+			sprintf_s(suffix, sizeof(suffix), ".rank%u", options.rank);
+			options.sharedSprites += suffix;
+		}
+		if (options.rank > 0)
+		{
+			options.volumeExport.directory.clear();
 		}
 	}
 
 	AppContext app;
-	if (!app.initPhysX())
+	app.setStartupPlan(options.getStartupPlan());
+	if (!app.initPhysX(options.executionPolicy))
 	{
 		printf("PhysX initialization failed, exiting\n");
 		return 1;
 	}
+
+	if (!app.initColliders(options.colliders, options.meshCacheDirectory.c_str()))
+	{
+		printf("Collider initialization failed, exiting\n");
+		return 1;
+	}
+
+	if (!app.initWorkerPool())
+	{
+		return 1;
+	}
 	
 	if (!app.initAPEX())
 	{
@@ -992,25 +8000,111 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	if (!app.initAssetsAndActors(useTurbulence))
+	if (!app.initAssetsAndActors(options.useTurbulence, options.emitterCount))
 	{
 		printf("Asset and Actor initialization failed, exiting\n");
 		return 1;
 	}
 
-	// Simulate 8 frames, add a particle before each frame
-	for(PxU32 i=0; i<8; i++)
+	if (options.benchmarkEmitters)
+	{
+		app.benchmarkEmitters();
+		app.destroyAssetsAndActors();
+		app.destroyAPEX();
+		app.destroyWorkerPool();
+		app.destroyPhysX();
+		return 0;
+	}
+
+	if (!app.initVolumeExport(options.volumeExport))
+	{
+		printf("Volume export initialization failed, exiting\n");
+		return 1;
+	}
+
+	if (options.cpuParticles.capacity)
+	{
+		app.initCpuParticles(options.cpuParticles, options.outputById);
+	}
+
+	if (options.mortonReorderFrames)
+	{
+		app.initParticleReorder(options.mortonReorderFrames);
+	}
+
+	if (options.sparseCellSize > 0.0f)
+	{
+		app.initSparseGrid(options.sparseCellSize, options.sparseIdleFrames);
+	}
+
+	app.initLodController(options.lod);
+
+	if (options.wind.isEnabled())
+	{
+		app.initWind(options.wind);
+	}
+
+	if (options.renderTiles[0] * options.renderTiles[1] * options.renderTiles[2] > 1 &&
+		!app.initRenderRegions(options.renderTiles, options.useRenderDomain ? &options.renderDomain : NULL))
+	{
+		printf("Render region initialization failed, exiting\n");
+		return 1;
+	}
+
+	if (!options.sharedSprites.empty() &&
+		!app.initSharedSprites(options.sharedSprites.c_str(), options.sharedSlots, options.sharedMaxSprites))
+	{
+		printf("Shared sprite ring initialization failed, exiting\n");
+		return 1;
+	}
+
+	if (options.rankCount > 1 &&
+		!app.initDecomposition(options.session.c_str(), options.rank, options.rankCount, options.slabDomainMin, options.slabDomainMax))
+	{
+		printf("Domain decomposition failed, exiting\n");
+		return 1;
+	}
+
+	if (options.useCamera && !app.initCamera(options.camera))
 	{
-		app.addParticle();
-		app.simulateFrame(1.0f/60.0f);
-		app.printParticleData();
+		printf("Camera initialization failed, exiting\n");
+		return 1;
 	}
 
+	// Simulate 8 frames (or 'frames=<count>'), add a particle before each frame.  Each frame
+	// runs as a job graph that stages the next frame's particles and finishes the previous
+	// frame's output while this frame simulates.
+	const PxF32 dt = 1.0f/60.0f;
+	app.initFrameGraph(dt);
+	if (options.metricsPort && !app.initMetrics(options.metricsPort))
+	{
+		printf("Metrics server initialization failed, exiting\n");
+		return 1;
+	}
+	for(PxU32 i=0; i<options.frameCount; i++)
+	{
+		app.runFrame();
+		if (i == 0)
+		{
+			AppLog::flush();
+			app.printExecutionReport();
+			app.printStartupReport();
+		}
+	}
+	app.finishFrames();
+	AppLog::flush();
+
+	app.destroyMetrics();
+	app.destroyDecomposition();
+	app.destroySharedSprites();
+	app.destroySparseGrid();
+	app.destroyVolumeExport();
 	app.destroyAssetsAndActors();
 	app.destroyAPEX();
+	app.destroyWorkerPool();
 	app.destroyPhysX();	
 
-	return 0;
+	return waitForRanks(rankProcesses) ? 0 : 1;
 }
 
 // This project, for no good reason, needs to be a windows executable project, so we'll just wrap the cmd line 
@@ -1041,12 +8135,17 @@ int WINAPI WinMain(HINSTANCE /*hInstance*/, HINSTANCE, LPSTR cmdLine, int show_c
 	int argc = 2;
 	char* argv[2] = {"MinimalTurbulence", cmdLine};
 
-	main(argc, argv);
+	int result = main(argc, argv);
 
-	printf("Press ENTER to exit\n");
-	getc(stdin);
+	if (gPauseOnExit)
+	{
+		printf("Press ENTER to exit\n");
+		getc(stdin);
+	}
 
-	return 0;
+	return result;
 }
 
+#endif //APP_NO_MAIN
+
 #endif //PX_WINDOWS
@@ -0,0 +1,1157 @@
+// Tests for the parts of MinimalTurbulence that run on the CPU alone: option parsing, the
+// volume exporter's Zarr stores, the radix sort, the sparse grid, the CPU particles and
+// their Morton reordering, the wind field, the slab decomposition, the logger's records,
+// sprite layout conversion, the camera and the frame's sprite output, OBJ parsing and the
+// frame job graph.
+//
+// The sample is a single source file, so it is included whole here without its main.  No
+// PhysX or APEX object is created, the tested classes only use the PhysX math types.
+//
+// Prints every failed check and returns the number of failures.
+
+#define APP_NO_MAIN
+#include "../MinimalTurbulence.cpp"
+
+#if defined(PX_WINDOWS) && NX_SDK_VERSION_MAJOR == 3
+
+static PxU32 gFailures = 0;
+
+static void check(bool ok, const char* condition, int line)
+{
+	if (!ok)
+	{
+		printf("FAILED line %d: %s\n", line, condition);
+		gFailures++;
+	}
+}
+
+#define CHECK(condition) check((condition) != 0, #condition, __LINE__)
+
+static bool nearlyEqual(const PxVec3& a, const PxVec3& b, PxF32 tolerance = 1e-4f)
+{
+	return (a - b).magnitude() <= tolerance;
+}
+
+static PxU32 nextRandom(PxU32& state)
+{
+	state = state * 1664525u + 1013904223u;
+	return state >> 8;
+}
+
+static void testOptions()
+{
+	// WinMain passes the whole command line as one argument
+	char program[] = "MinimalTurbulence";
+	char line[] = "noTurbulence  exportVolume=out\texportEvery=4 exportStride=2";
+	char chunk[] = "EXPORTCHUNK=16 exportRoi=1,2,3,10,20,30";
+	char* argv[] = { program, line, chunk };
+
+	AppOptions options;
+	CHECK(options.useTurbulence);
+	CHECK(options.volumeExport.directory.empty());
+
+	CHECK(options.parse(3, argv));
+	CHECK(!options.useTurbulence);
+	const AppVolumeExporter::Config& exportConfig = options.volumeExport;
+	CHECK(exportConfig.directory == "out");
+	CHECK(exportConfig.everyNFrames == 4);
+	CHECK(exportConfig.stride == 2);
+	CHECK(exportConfig.chunkSize == 16);
+	CHECK(exportConfig.roiMin[0] == 1 && exportConfig.roiMin[1] == 2 && exportConfig.roiMin[2] == 3);
+	CHECK(exportConfig.roiMax[0] == 10 && exportConfig.roiMax[1] == 20 && exportConfig.roiMax[2] == 30);
+
+	// colliders add up, each one a token of its own
+	char colliders[] = "collider=a.obj collider=b.obj meshCache=cache";
+	char* colliderArgv[] = { program, colliders };
+	AppOptions colliderOptions;
+	CHECK(colliderOptions.meshCacheDirectory == "cookedMeshes");
+	CHECK(colliderOptions.parse(2, colliderArgv));
+	CHECK(colliderOptions.colliders.size() == 2 && colliderOptions.colliders[1] == "b.obj");
+	CHECK(colliderOptions.meshCacheDirectory == "cache");
+
+	// the sparse grid carries the CPU particles, so it switches them on unless they are sized
+	char cpu[] = "sparseGrid=2";
+	char* cpuArgv[] = { program, cpu };
+	AppOptions cpuOptions;
+	CHECK(cpuOptions.cpuParticles.capacity == 0);
+	CHECK(cpuOptions.parse(2, cpuArgv));
+	CHECK(cpuOptions.sparseCellSize == 2.0f && cpuOptions.cpuParticles.capacity == 65536);
+	char sized[] = "cpuParticles=100 sparseGrid";
+	char* sizedArgv[] = { program, sized };
+	AppOptions sizedOptions;
+	CHECK(sizedOptions.parse(2, sizedArgv));
+	CHECK(sizedOptions.sparseCellSize == 1.0f && sizedOptions.cpuParticles.capacity == 100);
+
+	char reorder[] = "mortonReorder=4 outputOrder=id";
+	char* reorderArgv[] = { program, reorder };
+	AppOptions reorderOptions;
+	CHECK(reorderOptions.mortonReorderFrames == 0 && !reorderOptions.outputById);
+	CHECK(reorderOptions.parse(2, reorderArgv));
+	CHECK(reorderOptions.mortonReorderFrames == 4 && reorderOptions.outputById);
+	CHECK(reorderOptions.cpuParticles.capacity == 65536);
+
+	// a split domain simulates the CPU particles, but not with what depends on the rank
+	char split[] = "ranks=2 slabDomain=0,32";
+	char* splitArgv[] = { program, split };
+	AppOptions splitOptions;
+	CHECK(splitOptions.parse(2, splitArgv));
+	CHECK(splitOptions.rankCount == 2 && splitOptions.cpuParticles.capacity == 65536);
+	char splitSparse[] = "ranks=2 sparseGrid";
+	char splitLod[] = "targetFrameMs=5 ranks=3";
+	char* splitSparseArgv[] = { program, splitSparse };
+	char* splitLodArgv[] = { program, splitLod };
+	AppOptions splitSparseOptions, splitLodOptions;
+	CHECK(!splitSparseOptions.parse(2, splitSparseArgv));
+	CHECK(!splitLodOptions.parse(2, splitLodArgv));
+
+	char shared[] = "shm=sprites shmSlots=4 shmMaxSprites=100";
+	char* sharedArgv[] = { program, shared };
+	AppOptions sharedOptions;
+	CHECK(sharedOptions.sharedSprites.empty() && sharedOptions.sharedSlots == 8 && sharedOptions.sharedMaxSprites == 4096);
+	CHECK(sharedOptions.parse(2, sharedArgv));
+	CHECK(sharedOptions.sharedSprites == "sprites" && sharedOptions.sharedSlots == 4 && sharedOptions.sharedMaxSprites == 100);
+	char consumer[] = "consumeShm=sprites";
+	char* consumerArgv[] = { program, consumer };
+	AppOptions consumerOptions;
+	CHECK(consumerOptions.parse(2, consumerArgv) && consumerOptions.consumeSharedSprites == "sprites");
+
+	char lod[] = "targetFrameMs=12.5 lodHysteresis=0.2";
+	char* lodArgv[] = { program, lod };
+	AppOptions lodOptions;
+	CHECK(lodOptions.lod.targetMs == 0.0f);
+	CHECK(lodOptions.parse(2, lodArgv));
+	CHECK(lodOptions.lod.targetMs == 12.5f && lodOptions.lod.hysteresis == 0.2f);
+
+	char emitters[] = "emitters=64 benchmarkEmitters";
+	char* emittersArgv[] = { program, emitters };
+	AppOptions emitterOptions;
+	CHECK(emitterOptions.emitterCount == 1 && !emitterOptions.benchmarkEmitters);
+	CHECK(emitterOptions.parse(2, emittersArgv));
+	CHECK(emitterOptions.emitterCount == 64 && emitterOptions.benchmarkEmitters);
+
+	// the device is a policy, gpu still falls back to the CPU without CUDA
+	char device[] = "device=CPU";
+	char* deviceArgv[] = { program, device };
+	AppOptions deviceOptions;
+	CHECK(deviceOptions.executionPolicy == APP_EXECUTION_GPU_PREFERRED);
+	CHECK(deviceOptions.parse(2, deviceArgv));
+	CHECK(deviceOptions.executionPolicy == APP_EXECUTION_CPU_ONLY);
+
+	char tiles[] = "renderTiles=2,1,3 renderDomain=-8,0,-8,8,16,8";
+	char* tilesArgv[] = { program, tiles };
+	AppOptions tileOptions;
+	CHECK(tileOptions.renderTiles[0] == 1 && !tileOptions.useRenderDomain);
+	CHECK(tileOptions.parse(2, tilesArgv));
+	CHECK(tileOptions.renderTiles[0] == 2 && tileOptions.renderTiles[1] == 1 && tileOptions.renderTiles[2] == 3);
+	CHECK(tileOptions.useRenderDomain);
+	CHECK(nearlyEqual(tileOptions.renderDomain.minimum, PxVec3(-8.0f, 0.0f, -8.0f), 0.0f));
+	CHECK(nearlyEqual(tileOptions.renderDomain.maximum, PxVec3(8.0f, 16.0f, 8.0f), 0.0f));
+
+	char metrics[] = "metrics frames=120";
+	char metricsPort[] = "metrics=8080";
+	char* metricsArgv[] = { program, metrics };
+	char* metricsPortArgv[] = { program, metricsPort };
+	AppOptions metricsOptions, metricsPortOptions;
+	CHECK(metricsOptions.metricsPort == 0 && metricsOptions.frameCount == 8);
+	CHECK(metricsOptions.parse(2, metricsArgv));
+	CHECK(metricsOptions.metricsPort == 9464 && metricsOptions.frameCount == 120);
+	CHECK(metricsPortOptions.parse(2, metricsPortArgv) && metricsPortOptions.metricsPort == 8080);
+
+	char wind[] = "windCurl=2 windVortex=1,0,2,3,4 windVortex=0,0,0,1,1 windShear=1,0,0,0.5,0,0 windCells=16";
+	char* windArgv[] = { program, wind };
+	AppOptions windOptions;
+	CHECK(!windOptions.wind.isEnabled());
+	CHECK(windOptions.parse(2, windArgv));
+	CHECK(windOptions.wind.isEnabled() && windOptions.wind.curlAmplitude == 2.0f && windOptions.wind.curlScale == 8.0f);
+	CHECK(windOptions.wind.vortices.size() == 2 && windOptions.wind.vortices[0].radius == 4.0f);
+	CHECK(windOptions.wind.shearGradient.x == 0.5f && windOptions.wind.gridCells == 16);
+
+	// lazily, CUDA and TurbulenceFS are only loaded for turbulence
+	char lazy[] = "lazyStartup noTurbulence";
+	char* lazyArgv[] = { program, lazy };
+	AppOptions lazyOptions;
+	CHECK(!lazyOptions.getStartupPlan().lazy && lazyOptions.getStartupPlan().turbulence);
+	CHECK(lazyOptions.parse(2, lazyArgv));
+	AppStartupPlan plan = lazyOptions.getStartupPlan();
+	CHECK(plan.lazy && !plan.cuda && !plan.turbulence);
+
+	const char* invalid[] = { "noSuchOption", "exportVolume=", "exportEvery=x", "exportRoi=1,2,3", "collider=", "cpuParticles=0", "sparseGrid=0",
+		"mortonReorder=0", "outputOrder=random", "windCells=1",
+		"shm=", "shmSlots=1", "shmMaxSprites=0", "consumeShm=",
+		"targetFrameMs=0", "lodHysteresis=1",
+		"emitters=0",
+		"device=cuda", "device=",
+		"renderTiles=2,0,2", "renderTiles=2,2", "renderDomain=0,0,0,1,1,0",
+		"metrics=0", "metrics=70000", "frames=0",
+		"windCurl=0", "windVortex=0,0,0,1,0", "windShear=1,0,0" };
+	for (PxU32 i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+	{
+		std::string token(invalid[i]);
+		char* invalidArgv[] = { program, &token[0] };
+		AppOptions rejected;
+		CHECK(!rejected.parse(2, invalidArgv));
+	}
+}
+
+static std::string readFile(const std::string& path)
+{
+	std::string data;
+	FILE* file = NULL;
+	if (fopen_s(&file, path.c_str(), "rb") != 0 || !file)
+	{
+		return data;
+	}
+	char buffer[256];
+	for (size_t size; (size = fread(buffer, 1, sizeof(buffer), file)) > 0; )
+	{
+		data.append(buffer, size);
+	}
+	fclose(file);
+	return data;
+}
+
+static bool contains(const std::string& text, const char* part)
+{
+	return text.find(part) != std::string::npos;
+}
+
+static void testVolumeExporter()
+{
+	// a 7 x 4 x 3 grid whose velocities name their cell
+	AppVelocityGrid grid;
+	grid.resize(7, 4, 3);
+	grid.origin = PxVec3(0.5f);
+	grid.spacing = PxVec3(1.0f);
+	for (PxU32 z = 0; z < 3; z++)
+	{
+		for (PxU32 y = 0; y < 4; y++)
+		{
+			for (PxU32 x = 0; x < 7; x++)
+			{
+				grid.velocity[grid.cellIndex(x, y, z)] = PxVec3(PxF32(x), PxF32(y), PxF32(z));
+			}
+		}
+	}
+
+	// every second cell of x >= 1 (clamped to the grid), y < 4 and z < 2: x = 1, 3, 5,
+	// y = 0, 2 and z = 0, cut into chunks of 2 cells
+	AppVolumeExporter::Config config;
+	config.directory = "MinimalTurbulenceTests.zarr";
+	config.everyNFrames = 5;
+	config.stride = 2;
+	config.chunkSize = 2;
+	config.roiMin[0] = 1;
+	config.roiMax[1] = 4;
+	config.roiMax[2] = 2;
+
+	AppVolumeExporter exporter;
+	CHECK(!exporter.isExportFrame(0));
+	CHECK(exporter.start(config));
+	CHECK(exporter.isExportFrame(5));
+	CHECK(!exporter.isExportFrame(6));
+	exporter.submit(5, 0.25f, grid);
+	exporter.stop();
+
+	const std::string arrayPath = config.directory + "/velocity_000005.zarr";
+	CHECK(readFile(config.directory + "/.zgroup") == "{\"zarr_format\": 2}\n");
+
+	// the shape and chunks are (z, y, x, component), a chunk never exceeds the array
+	std::string zarray = readFile(arrayPath + "/.zarray");
+	CHECK(contains(zarray, "\"zarr_format\": 2"));
+	CHECK(contains(zarray, "\"shape\": [1, 2, 3, 3]"));
+	CHECK(contains(zarray, "\"chunks\": [1, 2, 2, 3]"));
+	CHECK(contains(zarray, "\"dtype\": \"<f4\""));
+	CHECK(contains(zarray, "\"order\": \"C\""));
+
+	// the origin is the first exported cell, the spacing is the stride's
+	std::string zattrs = readFile(arrayPath + "/.zattrs");
+	CHECK(contains(zattrs, "\"frame\": 5"));
+	CHECK(contains(zattrs, "\"origin\": [0.5, 0.5, 1.5]"));
+	CHECK(contains(zattrs, "\"spacing\": [2, 2, 2]"));
+
+	// the first chunk is full, the edge chunk holds x = 5 and is padded with zeros
+	const PxF32 first[] = { 1, 0, 0, 3, 0, 0, 1, 2, 0, 3, 2, 0 };
+	const PxF32 edge[] = { 5, 0, 0, 0, 0, 0, 5, 2, 0, 0, 0, 0 };
+	std::string chunk0 = readFile(arrayPath + "/0.0.0.0");
+	std::string chunk1 = readFile(arrayPath + "/0.0.1.0");
+	CHECK(chunk0.size() == sizeof(first) && !memcmp(chunk0.data(), first, sizeof(first)));
+	CHECK(chunk1.size() == sizeof(edge) && !memcmp(chunk1.data(), edge, sizeof(edge)));
+	CHECK(readFile(arrayPath + "/0.1.0.0").empty());
+
+	const char* files[] = { "/.zarray", "/.zattrs", "/0.0.0.0", "/0.0.1.0" };
+	for (PxU32 i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+	{
+		remove((arrayPath + files[i]).c_str());
+	}
+	RemoveDirectory(arrayPath.c_str());
+	remove((config.directory + "/.zgroup").c_str());
+	RemoveDirectory(config.directory.c_str());
+}
+
+static void testRadixSort(AppWorkerPool& pool)
+{
+	// enough keys for several chunks, few enough key values for many ties
+	const PxU32 count = 50000;
+	std::vector<PxU32> keys(count);
+	PxU32 state = 1;
+	for (PxU32 i = 0; i < count; i++)
+	{
+		keys[i] = nextRandom(state) & 0xfff;
+	}
+
+	AppRadixSort sort;
+	sort.sort(pool, &keys[0], count, 12);
+	const PxU32* permutation = sort.getPermutation();
+	CHECK(permutation != NULL);
+
+	std::vector<PxU8> seen(count, 0);
+	bool sorted = true, stable = true, complete = true;
+	for (PxU32 i = 0; i < count; i++)
+	{
+		complete = complete && permutation[i] < count && !seen[permutation[i]];
+		if (!complete)
+		{
+			break;
+		}
+		seen[permutation[i]] = 1;
+		if (i > 0)
+		{
+			PxU32 previous = keys[permutation[i - 1]], current = keys[permutation[i]];
+			sorted = sorted && previous <= current;
+			stable = stable && (previous != current || permutation[i - 1] < permutation[i]);
+		}
+	}
+	CHECK(complete);
+	CHECK(sorted);
+	CHECK(stable);
+
+	// full 32 bit keys, and sorting again reuses the buffers
+	PxU32 wide[] = { 0xffffffffu, 7, 0x80000000u, 7, 0 };
+	sort.sort(pool, wide, 5);
+	permutation = sort.getPermutation();
+	CHECK(permutation[0] == 4 && permutation[1] == 1 && permutation[2] == 3 && permutation[3] == 2 && permutation[4] == 0);
+
+	sort.sort(pool, wide, 0);
+	CHECK(sort.getPermutation() == NULL);
+}
+
+static void testParticleReorder(AppWorkerPool& pool)
+{
+	typedef NxRenderSpriteLayoutElement E;
+
+	CHECK(AppParticleReorder::mortonCode(1, 0, 0) == 1);
+	CHECK(AppParticleReorder::mortonCode(0, 1, 0) == 2);
+	CHECK(AppParticleReorder::mortonCode(0, 0, 1) == 4);
+	CHECK(AppParticleReorder::mortonCode(3, 3, 3) == 63);
+
+	// particles emitted all over a 16^3 box, more than one chunk of them
+	const PxU32 count = 10000;
+	std::vector<PxVec3> positions(count);
+	std::vector<PxVec3> velocities(count);
+	PxU32 state = 7;
+	for (PxU32 i = 0; i < count; i++)
+	{
+		positions[i] = PxVec3(PxF32(nextRandom(state) % 16), PxF32(nextRandom(state) % 16), PxF32(nextRandom(state) % 16)) + PxVec3(0.5f);
+		velocities[i] = PxVec3(PxF32(i), 0.0f, 0.0f);
+	}
+	AppCpuParticles::Config config;
+	config.capacity = count;
+	AppCpuParticles particles;
+	particles.init(config);
+	particles.emit(&positions[0], &velocities[0], count);
+
+	AppParticleReorder reorder;
+	reorder.init(pool);
+	reorder.setGrid(PxVec3(0.0f), PxVec3(1.0f));
+	particles.reorder(reorder);
+
+	// the cells come in Morton order and every particle keeps its state with its id
+	bool sorted = true, intact = true;
+	for (PxU32 i = 0; i < count; i++)
+	{
+		PxU32 id = particles.getIds()[i];
+		intact &= id < count && nearlyEqual(particles.getPositions()[i], positions[id], 0.0f) && particles.getVelocities()[i].x == PxF32(id);
+		sorted &= i == 0 || reorder.cellMortonCode(particles.getPositions()[i - 1]) <= reorder.cellMortonCode(particles.getPositions()[i]);
+	}
+	CHECK(sorted);
+	CHECK(intact);
+	CHECK(particles.getIds()[0] != 0 || particles.getIds()[1] != 1);
+
+	// the id remap gives the output back its emission order
+	const PxU32* byId = particles.sortById(pool);
+	bool remapped = true;
+	for (PxU32 i = 0; i < count; i++)
+	{
+		remapped &= particles.getIds()[byId[i]] == i;
+	}
+	CHECK(remapped);
+
+	std::vector<AppFullSpriteLayout> sprites(count);
+	particles.writeSprites(&sprites[0], byId);
+	CHECK(sprites[count - 1].get<E::USER_DATA_UINT1>() == count - 1);
+	CHECK(nearlyEqual(sprites[count - 1].position(), positions[count - 1], 0.0f));
+}
+
+static void testSparseVelocityGrid(AppWorkerPool& pool)
+{
+	const PxVec3 background(1.0f, 2.0f, 3.0f);
+	AppSparseVelocityGrid grid;
+	CHECK(!grid.isEnabled());
+	grid.init(1.0f, 2);
+	grid.setBackground(background);
+	CHECK(grid.isEnabled());
+	CHECK(grid.getBrickCount() == 0);
+	CHECK(nearlyEqual(grid.sample(PxVec3(3.0f, -40.0f, 7.5f)), background));
+
+	// the middle of a brick allocates that brick alone, a corner cell its seven neighbours too
+	grid.touch(PxVec3(4.5f, 4.5f, 4.5f));
+	CHECK(grid.getBrickCount() == 1);
+	grid.touch(PxVec3(4.5f, 4.5f, 4.5f));
+	CHECK(grid.getBrickCount() == 1);
+	grid.touch(PxVec3(-0.5f, -0.5f, -0.5f));
+	CHECK(grid.getBrickCount() == 8);
+	CHECK(grid.getMemoryBytes() >= 8 * sizeof(AppSparseVelocityGrid::Brick));
+	CHECK(nearlyEqual(grid.sample(PxVec3(4.5f, 4.5f, 4.5f)), background));
+
+	// a dense field of 4^3 cells over [0, 4)^3 pulls the cells it covers toward it
+	AppVelocityGrid dense;
+	dense.resize(4, 4, 4);
+	dense.origin = PxVec3(0.5f);
+	dense.spacing = PxVec3(1.0f);
+	for (PxU32 i = 0; i < dense.velocity.size(); i++)
+	{
+		dense.velocity[i] = PxVec3(5.0f, 0.0f, 0.0f);
+	}
+	grid.touch(PxVec3(4.5f, 4.5f, 4.5f));
+	grid.touch(PxVec3(-0.5f, -0.5f, -0.5f));
+	grid.step(pool, 10.0f, &dense);
+	CHECK(nearlyEqual(grid.sample(PxVec3(2.0f, 2.0f, 2.0f)), PxVec3(5.0f, 0.0f, 0.0f), 1e-3f));
+	CHECK(nearlyEqual(grid.sample(PxVec3(6.0f, 6.0f, 6.0f)), background, 1e-3f));
+
+	// bricks nobody touches are freed after the idle frames and read as background again
+	grid.step(pool, 10.0f, NULL);
+	grid.step(pool, 10.0f, NULL);
+	CHECK(grid.getBrickCount() == 0);
+	CHECK(nearlyEqual(grid.sample(PxVec3(2.0f, 2.0f, 2.0f)), background));
+
+	// freed bricks are reused, and start at the background
+	grid.touch(PxVec3(2.0f, 2.0f, 2.0f));
+	CHECK(nearlyEqual(grid.sample(PxVec3(2.0f, 2.0f, 2.0f)), background));
+
+	grid.clear();
+	CHECK(!grid.isEnabled());
+	CHECK(grid.getBrickCount() == 0);
+}
+
+static void testCpuParticles(AppWorkerPool& pool)
+{
+	typedef NxRenderSpriteLayoutElement E;
+
+	AppCpuParticles::Config config;
+	config.capacity = 4;
+	config.lifetime = 1.0f;
+	config.dragTime = 0.1f;
+	AppCpuParticles particles;
+	CHECK(!particles.isEnabled());
+	particles.init(config);
+	CHECK(particles.isEnabled());
+
+	// what does not fit is dropped
+	const PxVec3 positions[3] = { PxVec3(2.0f, 2.0f, 2.0f), PxVec3(10.0f, 2.0f, 2.0f), PxVec3(20.0f, 2.0f, 2.0f) };
+	const PxVec3 velocities[3] = { PxVec3(0.0f), PxVec3(0.0f, 1.0f, 0.0f), PxVec3(0.0f) };
+	CHECK(particles.emit(positions, velocities, 3) == 3);
+	CHECK(particles.getCount() == 3);
+
+	// a uniform dense field over [0, 4)^3 pulls the first particle along, the second one
+	// is outside of it and keeps its velocity
+	AppVelocityGrid dense;
+	dense.resize(4, 4, 4);
+	dense.origin = PxVec3(0.5f);
+	dense.spacing = PxVec3(1.0f);
+	for (PxU32 i = 0; i < dense.velocity.size(); i++)
+	{
+		dense.velocity[i] = PxVec3(5.0f, 0.0f, 0.0f);
+	}
+	AppCpuParticles::Flow flow;
+	flow.dense = &dense;
+	particles.step(pool, 0.5f, flow);
+	CHECK(particles.getCount() == 3);
+	CHECK(particles.getVelocities()[0].x > 4.9f);
+	CHECK(particles.getPositions()[0].x > 4.0f);
+	CHECK(nearlyEqual(particles.getVelocities()[1], PxVec3(0.0f, 1.0f, 0.0f)));
+	CHECK(nearlyEqual(particles.getPositions()[1], PxVec3(10.0f, 2.5f, 2.0f)));
+	CHECK(particles.getLife()[2] == 0.5f);
+
+	// the sparse grid carries them everywhere, and reads as its background where it has no bricks
+	CHECK(particles.emit(positions, velocities, 2) == 1);
+	CHECK(particles.getDroppedCount() == 1);
+	AppSparseVelocityGrid sparse;
+	sparse.init(1.0f, 2);
+	sparse.setBackground(PxVec3(0.0f, 0.0f, -3.0f));
+	flow.sparse = &sparse;
+	particles.step(pool, 0.25f, flow);
+	CHECK(particles.getVelocities()[1].z < -2.7f);
+
+	// the first three die, the last one keeps its id
+	particles.step(pool, 0.3f, flow);
+	CHECK(particles.getCount() == 1);
+	CHECK(particles.getIds()[0] == 3);
+	CHECK(PxAbs(particles.getLife()[0] - 0.45f) < 1e-5f);
+
+	AppFullSpriteLayout sprite;
+	particles.writeSprites(&sprite);
+	CHECK(nearlyEqual(sprite.position(), particles.getPositions()[0]));
+	CHECK(nearlyEqual(sprite.get<E::VELOCITY_FLOAT3>(), particles.getVelocities()[0]));
+	CHECK(sprite.get<E::USER_DATA_UINT1>() == 3);
+	CHECK(sprite.get<E::LIFE_REMAIN_FLOAT1>() == particles.getLife()[0]);
+}
+
+static void testWindField(AppWorkerPool& pool)
+{
+	// sin4 and cos4 over several turns either way
+	PxF32 worst = 0.0f;
+	for (PxI32 i = -400; i < 400; i += 4)
+	{
+		PX_ALIGN(16, PxF32 x[4]);
+		PX_ALIGN(16, PxF32 s[4]);
+		PX_ALIGN(16, PxF32 c[4]);
+		for (PxU32 l = 0; l < 4; l++)
+		{
+			x[l] = (i + PxI32(l)) * 0.05f;
+		}
+		_mm_store_ps(s, AppWindField::sin4(_mm_load_ps(x)));
+		_mm_store_ps(c, AppWindField::cos4(_mm_load_ps(x)));
+		for (PxU32 l = 0; l < 4; l++)
+		{
+			worst = PxMax(worst, PxAbs(s[l] - PxSin(x[l])));
+			worst = PxMax(worst, PxAbs(c[l] - PxCos(x[l])));
+		}
+	}
+	CHECK(worst < 2e-4f);
+
+	// a pure shear is linear, so the cache interpolates it exactly; the mean over the grid
+	// is the shear at the center height.  Sampling mixes points inside and outside of the
+	// grid, in counts that are not a multiple of four.
+	AppWindField::Config config;
+	config.shearBase = PxVec3(1.0f, 0.0f, 0.0f);
+	config.shearGradient = PxVec3(0.5f, 0.0f, -0.25f);
+	config.gridCells = 9;
+	CHECK(config.isEnabled());
+
+	AppWindField wind;
+	CHECK(!wind.isEnabled());
+	wind.init(config, PxBounds3(PxVec3(-10.0f, 0.0f, -10.0f), PxVec3(10.0f, 20.0f, 10.0f)), pool);
+	CHECK(wind.isEnabled());
+	CHECK(wind.getNodeCount() == 9 * 9 * 9);
+
+	wind.update(3.0f);
+	CHECK(nearlyEqual(wind.getMean(), PxVec3(6.0f, 0.0f, -2.5f)));
+	PxVec3 positions[7], velocities[7];
+	for (PxU32 i = 0; i < 7; i++)
+	{
+		positions[i] = PxVec3(PxF32(i) * 3.1f, PxF32(i) * 4.3f - 1.0f, 0.5f);
+		velocities[i] = PxVec3(-99.0f);
+	}
+	wind.sample(positions, velocities, 7);
+	for (PxU32 i = 0; i < 7; i++)
+	{
+		CHECK(nearlyEqual(velocities[i], config.shearBase + config.shearGradient * positions[i].y));
+	}
+
+	// a vortex turns counterclockwise seen from above, at its strength one radius out.  The
+	// cache holds the field exactly at its nodes, and the direct evaluation outside of it.
+	AppWindField::Vortex vortex;
+	vortex.center = PxVec3(0.0f);
+	vortex.strength = 2.0f;
+	vortex.radius = 1.0f;
+	AppWindField::Config vortexConfig;
+	vortexConfig.vortices.push_back(vortex);
+	vortexConfig.gridCells = 5;
+	AppWindField vortexWind;
+	vortexWind.init(vortexConfig, PxBounds3(PxVec3(-2.0f), PxVec3(2.0f)), pool);
+	vortexWind.update(0.0f);
+	PxVec3 east(1.0f, 1.0f, 0.0f), velocity;
+	vortexWind.sample(&east, &velocity, 1);
+	CHECK(nearlyEqual(velocity, PxVec3(0.0f, 0.0f, 2.0f)));
+	PxVec3 west(-1.0f, 5.0f, 0.0f);
+	vortexWind.sample(&west, &velocity, 1);
+	CHECK(nearlyEqual(velocity, PxVec3(0.0f, 0.0f, -2.0f)));
+
+	// the CPU particles feel the wind in flight, with no other flow around
+	AppCpuParticles::Config particleConfig;
+	particleConfig.capacity = 1;
+	particleConfig.dragTime = 0.01f;
+	AppCpuParticles particles;
+	particles.init(particleConfig);
+	PxVec3 start(0.0f, 4.0f, 0.0f), still(0.0f);
+	particles.emit(&start, &still, 1);
+	AppCpuParticles::Flow flow;
+	flow.wind = &wind;
+	particles.step(pool, 0.1f, flow);
+	CHECK(nearlyEqual(particles.getVelocities()[0], config.shearBase + config.shearGradient * 4.0f, 1e-3f));
+}
+
+class TestTransport : public AppTransport
+{
+public:
+	static const PxU32 MAX_RANKS = 4;
+
+	TestTransport(PxU32 rank, PxU32 rankCount)
+		: mRank(rank)
+		, mRankCount(rankCount)
+	{}
+
+	bool exchange(PxU32 peer, const std::vector<PxU8>& outgoing, std::vector<PxU8>& incoming)
+	{
+		sent[peer] = outgoing;
+		incoming = reply[peer];
+		return true;
+	}
+
+	PxU32 getRank() const
+	{
+		return mRank;
+	}
+
+	PxU32 getRankCount() const
+	{
+		return mRankCount;
+	}
+
+	std::vector<PxU8>	sent[MAX_RANKS];
+	std::vector<PxU8>	reply[MAX_RANKS];
+
+private:
+	PxU32	mRank;
+	PxU32	mRankCount;
+};
+
+// the message of a rank with nothing to send: frame and a zero count
+static std::vector<PxU8> emptyMessage(PxU32 frame)
+{
+	PxU32 header[2] = { frame, 0 };
+	return std::vector<PxU8>(reinterpret_cast<PxU8*>(header), reinterpret_cast<PxU8*>(header) + sizeof(header));
+}
+
+static PxU32 messageCount(const std::vector<PxU8>& message)
+{
+	return PxU32((message.size() - 2 * sizeof(PxU32)) / sizeof(AppSlabDecomposition::Migrant));
+}
+
+static AppSlabDecomposition::Migrant makeMigrant(const PxVec3& position, const PxVec3& velocity, PxU32 id)
+{
+	AppSlabDecomposition::Migrant migrant;
+	migrant.position = position;
+	migrant.velocity = velocity;
+	migrant.life = 0.5f;
+	migrant.id = id;
+	return migrant;
+}
+
+static void testSlabDecomposition(AppWorkerPool& pool)
+{
+	typedef AppSlabDecomposition::Migrant Migrant;
+	std::vector<Migrant> immigrants;
+
+	// two ranks over [0, 16) along x, the first owns x < 8
+	TestTransport first(0, 2), second(1, 2);
+	AppSlabDecomposition left, right;
+	left.init(first, 0, 0.0f, 16.0f);
+	right.init(second, 0, 0.0f, 16.0f);
+	CHECK(left.isEnabled());
+	CHECK(left.owns(PxVec3(-100.0f, 0.0f, 0.0f)) && !left.owns(PxVec3(8.0f, 0.0f, 0.0f)));
+	CHECK(right.owns(PxVec3(8.0f, 0.0f, 0.0f)) && right.owns(PxVec3(100.0f, 0.0f, 0.0f)));
+
+	// what one rank packs the other unpacks, in order and with the whole state
+	right.emigrate(makeMigrant(PxVec3(3.0f, 1.0f, 2.0f), PxVec3(-1.0f, 0.5f, 0.25f), 11));
+	right.emigrate(makeMigrant(PxVec3(7.5f, 0.0f, 0.0f), PxVec3(0.0f), 12));
+	right.emigrate(makeMigrant(PxVec3(9.0f, 0.0f, 0.0f), PxVec3(0.0f), 13));	// no rank above, stays queued
+	second.reply[0] = emptyMessage(7);
+	CHECK(right.exchange(7, immigrants));
+	CHECK(immigrants.empty());
+	CHECK(right.getMigratedCount() == 2);
+	CHECK(second.sent[0].size() == 2 * sizeof(PxU32) + 2 * sizeof(Migrant));
+
+	first.reply[1] = second.sent[0];
+	CHECK(left.exchange(7, immigrants));
+	CHECK(first.sent[1] == emptyMessage(7));
+	CHECK(immigrants.size() == 2);
+	if (immigrants.size() == 2)
+	{
+		CHECK(nearlyEqual(immigrants[0].position, PxVec3(3.0f, 1.0f, 2.0f)));
+		CHECK(nearlyEqual(immigrants[0].velocity, PxVec3(-1.0f, 0.5f, 0.25f)));
+		CHECK(immigrants[0].life == 0.5f && immigrants[0].id == 11);
+		CHECK(nearlyEqual(immigrants[1].position, PxVec3(7.5f, 0.0f, 0.0f)));
+	}
+
+	// a message from another frame or a cut off one fails the exchange
+	first.reply[1] = emptyMessage(8);
+	CHECK(!left.exchange(9, immigrants));
+	first.reply[1].resize(4);
+	CHECK(!left.exchange(8, immigrants));
+
+	// the middle of three ranks adopts what it receives, also what already moved past it,
+	// and sends that on at its next exchange
+	TestTransport outer(0, 3), middle(1, 3);
+	AppSlabDecomposition outerSlab, middleSlab;
+	outerSlab.init(outer, 0, 0.0f, 12.0f);
+	middleSlab.init(middle, 0, 0.0f, 12.0f);
+	outerSlab.emigrate(makeMigrant(PxVec3(10.0f, 0.0f, 0.0f), PxVec3(1.0f, 0.0f, 0.0f), 1));
+	outerSlab.emigrate(makeMigrant(PxVec3(5.0f, 0.0f, 0.0f), PxVec3(1.0f, 0.0f, 0.0f), 2));
+	outer.reply[1] = emptyMessage(3);
+	CHECK(outerSlab.exchange(3, immigrants));
+
+	AppCpuParticles::Config config;
+	config.capacity = 8;
+	AppCpuParticles particles;
+	particles.init(config);
+	middle.reply[0] = outer.sent[1];
+	middle.reply[2] = emptyMessage(3);
+	CHECK(middleSlab.exchange(3, immigrants));
+	CHECK(immigrants.size() == 2);
+	particles.adopt(immigrants);
+	CHECK(particles.getCount() == 2 && particles.getIds()[1] == 2 && particles.getLife()[1] == 0.5f);
+
+	CHECK(particles.emigrate(middleSlab) == 1);
+	CHECK(particles.getCount() == 1 && particles.getIds()[0] == 2);
+	middle.reply[0] = emptyMessage(4);
+	middle.reply[2] = emptyMessage(4);
+	CHECK(middleSlab.exchange(4, immigrants));
+	CHECK(immigrants.empty());
+	CHECK(messageCount(middle.sent[0]) == 0);
+	CHECK(messageCount(middle.sent[2]) == 1);
+
+	// Two ranks step the particles they own and hand over the ones that leave; every
+	// particle ends up where a single process puts it, on one rank only.  The flow drifts
+	// along +x, so only the first rank has anything to send.
+	AppVelocityGrid dense;
+	dense.resize(16, 4, 4);
+	dense.origin = PxVec3(0.5f);
+	dense.spacing = PxVec3(1.0f);
+	for (PxU32 i = 0; i < dense.velocity.size(); i++)
+	{
+		dense.velocity[i] = PxVec3(3.0f + (i % 7) * 0.25f, 0.1f * (i % 3), 0.0f);
+	}
+	AppCpuParticles::Flow flow;
+	flow.dense = &dense;
+
+	const PxU32 COUNT = 8;
+	PxVec3 positions[COUNT], velocities[COUNT];
+	PxU32 ids[COUNT];
+	for (PxU32 i = 0; i < COUNT; i++)
+	{
+		positions[i] = PxVec3(1.0f + i, 1.5f + 0.1f * i, 2.0f);
+		velocities[i] = PxVec3(0.0f);
+		ids[i] = 100 + i;
+	}
+
+	AppCpuParticles single, owned[2];
+	single.init(config);
+	single.emit(positions, velocities, COUNT, ids);
+	TestTransport transports[2] = { TestTransport(0, 2), TestTransport(1, 2) };
+	AppSlabDecomposition slabs[2];
+	for (PxU32 r = 0; r < 2; r++)
+	{
+		slabs[r].init(transports[r], 0, 0.0f, 16.0f);
+		owned[r].init(config);
+		for (PxU32 i = 0; i < COUNT; i++)
+		{
+			if (slabs[r].owns(positions[i]))
+			{
+				owned[r].emit(&positions[i], &velocities[i], 1, &ids[i]);
+			}
+		}
+	}
+	CHECK(owned[0].getCount() == 7 && owned[1].getCount() == 1);
+
+	for (PxU32 frame = 0; frame < 10; frame++)
+	{
+		single.step(pool, 0.1f, flow);
+		owned[0].step(pool, 0.1f, flow);
+		owned[1].step(pool, 0.1f, flow);
+
+		owned[0].emigrate(slabs[0]);
+		owned[1].emigrate(slabs[1]);
+		transports[0].reply[1] = emptyMessage(frame);
+		CHECK(slabs[0].exchange(frame, immigrants));
+		owned[0].adopt(immigrants);
+		transports[1].reply[0] = transports[0].sent[1];
+		CHECK(slabs[1].exchange(frame, immigrants));
+		owned[1].adopt(immigrants);
+		CHECK(transports[1].sent[0] == emptyMessage(frame));
+	}
+	CHECK(slabs[0].getMigratedCount() > 0);
+	CHECK(owned[0].getCount() + owned[1].getCount() == COUNT);
+
+	for (PxU32 r = 0; r < 2; r++)
+	{
+		for (PxU32 i = 0; i < owned[r].getCount(); i++)
+		{
+			CHECK(slabs[r].owns(owned[r].getPositions()[i]));
+			PxU32 s = owned[r].getIds()[i] - 100;
+			CHECK(single.getIds()[s] == owned[r].getIds()[i]);
+			CHECK(nearlyEqual(owned[r].getPositions()[i], single.getPositions()[s], 0.0f));
+			CHECK(nearlyEqual(owned[r].getVelocities()[i], single.getVelocities()[s], 0.0f));
+			CHECK(owned[r].getLife()[i] == single.getLife()[s]);
+		}
+	}
+}
+
+static void testLogRecord()
+{
+	// guard bytes right behind the record catch writes past its text
+	struct GuardedRecord
+	{
+		AppLogRecord	record;
+		char			guard[16];
+	};
+	GuardedRecord guarded;
+	memset(&guarded, 'x', sizeof(guarded));
+
+	AppLogRecord& record = guarded.record;
+	record.format = "%s|%s|%s|%u";
+	record.argCount = 0;
+	record.textUsed = 0;
+
+	// the strings take more than the text holds: the second one is cut, the third is empty
+	const std::string first(60, 'a'), second(60, 'b');
+	record.pack(first.c_str());
+	record.pack(second.c_str());
+	record.pack("c");
+	record.pack(7u);
+	CHECK(record.argCount == 4);
+	CHECK(record.textUsed == AppLogRecord::TEXT_SIZE);
+
+	char out[256];
+	record.formatTo(out, sizeof(out));
+	std::string expected = first + "|" + std::string(AppLogRecord::TEXT_SIZE - 62, 'b') + "||7";
+	CHECK(out == expected);
+
+	bool intact = true;
+	for (PxU32 i = 0; i < sizeof(guarded.guard); i++)
+	{
+		intact = intact && guarded.guard[i] == 'x';
+	}
+	CHECK(intact);
+}
+
+static void testSpriteConvert()
+{
+	typedef NxRenderSpriteLayoutElement E;
+
+	CHECK(AppBasicSpriteLayout::STRIDE == 16);
+	CHECK(AppFullSpriteLayout::STRIDE == 40);
+	CHECK(AppFullSpriteLayout::Offset<E::LIFE_REMAIN_FLOAT1>::value == 24);
+	CHECK(AppFullSpriteLayout::Has<E::VELOCITY_FLOAT3>::value);
+	CHECK(!AppBasicSpriteLayout::Has<E::VELOCITY_FLOAT3>::value);
+
+	PxU32 offsets[E::NUM_SEMANTICS];
+	AppBasicSpriteLayout::describe(offsets);
+	CHECK(offsets[E::POSITION_FLOAT3] == 0);
+	CHECK(offsets[E::LIFE_REMAIN_FLOAT1] == 12);
+	CHECK(offsets[E::VELOCITY_FLOAT3] == PX_MAX_U32);
+
+	AppBasicSpriteLayout basic[2];
+	for (PxU32 i = 0; i < 2; i++)
+	{
+		basic[i].get<E::POSITION_FLOAT3>() = PxVec3(PxF32(i), 2.0f, 3.0f);
+		basic[i].get<E::LIFE_REMAIN_FLOAT1>() = 0.5f + i;
+	}
+
+	// the fields the source lacks are filled with their zero values
+	AppFullSpriteLayout full[2];
+	AppSpriteConvert<AppFullSpriteLayout, AppBasicSpriteLayout>::run(full, basic, 2);
+	CHECK(nearlyEqual(full[1].position(), PxVec3(1.0f, 2.0f, 3.0f)));
+	CHECK(full[1].get<E::LIFE_REMAIN_FLOAT1>() == 1.5f);
+	CHECK(full[1].get<E::VELOCITY_FLOAT3>().isZero());
+	CHECK(full[1].get<E::DENSITY_FLOAT1>() == 0.0f);
+	CHECK(full[1].get<E::COLOR_RGBA8>() == 0xffffffff);
+	CHECK(full[1].get<E::USER_DATA_UINT1>() == 0);
+
+	// and the fields the destination lacks are dropped
+	full[0].get<E::VELOCITY_FLOAT3>() = PxVec3(9.0f);
+	full[0].get<E::LIFE_REMAIN_FLOAT1>() = 4.0f;
+	AppBasicSpriteLayout back[2];
+	AppSpriteConvert<AppBasicSpriteLayout, AppFullSpriteLayout>::run(back, full, 2);
+	CHECK(nearlyEqual(back[0].position(), PxVec3(0.0f, 2.0f, 3.0f)));
+	CHECK(back[0].get<E::LIFE_REMAIN_FLOAT1>() == 4.0f);
+
+	AppFullSpriteLayout copy[2];
+	AppSpriteConvert<AppFullSpriteLayout, AppFullSpriteLayout>::run(copy, full, 2);
+	CHECK(memcmp(copy, full, sizeof(full)) == 0);
+
+	// what an IOFX requests is numbered by NxRenderSpriteSemantic, not by layout element
+	typedef NxRenderSpriteSemantic S;
+	const PxU32 positionLife = (1 << S::POSITION) | (1 << S::LIFE_REMAIN);
+	CHECK(missingSpriteSemantics(positionLife, AppBasicSpriteLayout::SEMANTICS) == 0);
+	CHECK(missingSpriteSemantics(positionLife | (1 << S::VELOCITY) | (1 << S::COLOR), AppBasicSpriteLayout::SEMANTICS) == ((1 << S::VELOCITY) | (1 << S::COLOR)));
+	CHECK(missingSpriteSemantics(positionLife | (1 << S::VELOCITY) | (1 << S::COLOR) | (1 << S::USER_DATA), AppFullSpriteLayout::SEMANTICS) == 0);
+	CHECK(missingSpriteSemantics(1 << S::SCALE, AppFullSpriteLayout::SEMANTICS) == (1 << S::SCALE));
+}
+
+static void testCamera()
+{
+	AppCamera camera;
+	camera.init(AppCamera::Config());
+	CHECK(camera.isVisible(PxVec3(0.0f, 10.0f, 0.0f)));
+	CHECK(!camera.isVisible(PxVec3(0.0f, 10.0f, 50.0f)));
+	CHECK(camera.getDepth(PxVec3(3.0f, 10.0f, 0.0f)) == 40.0f);
+
+	// straight down, y can't be the up vector
+	AppCamera::Config down;
+	down.eye = PxVec3(0.0f, 50.0f, 0.0f);
+	down.target = PxVec3(0.0f);
+	camera.init(down);
+	CHECK(camera.getBounds().minimum.isFinite() && camera.getBounds().maximum.isFinite());
+	CHECK(camera.isVisible(PxVec3(1.0f, 0.0f, 1.0f)));
+	CHECK(!camera.isVisible(PxVec3(0.0f, 60.0f, 0.0f)));
+
+	char program[] = "MinimalTurbulence";
+	char downLine[] = "camera=0,50,0,0,0,0";
+	char* downArgv[] = { program, downLine };
+	AppOptions options;
+	CHECK(options.parse(2, downArgv) && options.useCamera);
+
+	char pointLine[] = "camera=0,5,0,0,5,0";
+	char* pointArgv[] = { program, pointLine };
+	AppOptions rejected;
+	CHECK(!rejected.parse(2, pointArgv));
+}
+
+static void testSpriteFrame(AppWorkerPool& pool)
+{
+	typedef NxRenderSpriteLayoutElement E;
+	typedef NxRenderSpriteSemantic S;
+	typedef AppSpriteBuffer::SpriteData SpriteData;
+
+	// the buffers hold as many sprites as the IOFX asks for
+	AppRenderResourceManager manager;
+	NxUserRenderSpriteBufferDesc desc;
+	CHECK(manager.getSpriteLayoutData(100, (1 << S::POSITION) | (1 << S::LIFE_REMAIN), &desc));
+	CHECK(desc.maxSprites == 100 && desc.stride == sizeof(SpriteData));
+
+	AppRenderRegion regions[2];
+	AppSpriteBuffer* buffers[2];
+	const PxU32 count = 60;
+	for (PxU32 b = 0; b < 2; b++)
+	{
+		buffers[b] = static_cast<AppSpriteBuffer*>(manager.createSpriteBuffer(desc));
+		buffers[b]->mRegion = &regions[b];
+
+		// the two buffers interleave in depth
+		SpriteData sprites[count];
+		for (PxU32 i = 0; i < count; i++)
+		{
+			sprites[i] = SpriteData();
+			sprites[i].get<E::POSITION_FLOAT3>() = PxVec3(0.0f, 10.0f, 30.0f - PxF32(2 * i + b));
+		}
+		buffers[b]->writeBuffer(sprites, 0, count);
+		CHECK(buffers[b]->mSpriteCount == count);
+	}
+
+	AppSpriteFrame frame;
+	frame.add(*buffers[0]);
+	frame.add(*buffers[1]);
+	CHECK(frame.getCount() == 2 * count);
+	CHECK(buffers[0]->mOutputBegin == buffers[0]->mOutputEnd);
+
+	// without a camera the frame goes out in the order it was gathered
+	AppSpriteBufferSettings settings;
+	std::vector<AppRenderRegion> noRegions;
+	frame.output(settings, noRegions);
+	CHECK(frame.getOutputCount() == 2 * count);
+	CHECK(frame.getOutputOrder()[count] == count);
+
+	// with one, the sprites of both buffers are sorted together, farthest first
+	AppCamera camera;
+	camera.init(AppCamera::Config());
+	SpriteData behind = SpriteData();
+	behind.get<E::POSITION_FLOAT3>() = PxVec3(0.0f, 10.0f, 50.0f);
+	frame.add(&behind, 1, NULL);
+	settings.camera = &camera;
+	settings.cullingPool = &pool;
+	frame.output(settings, noRegions);
+	CHECK(frame.getOutputCount() == 2 * count);
+	const PxU32* order = frame.getOutputOrder();
+	bool sorted = true;
+	for (PxU32 i = 0; i < 2 * count; i++)
+	{
+		// buffer b's sprite i is frame sprite b * count + i, at depth 10 + 2 * i + b
+		PxU32 depth = 2 * count - 1 - i;
+		sorted &= order[i] == (depth & 1) * count + depth / 2;
+	}
+	CHECK(sorted);
+
+	manager.releaseSpriteBuffer(*buffers[0]);
+	manager.releaseSpriteBuffer(*buffers[1]);
+}
+
+static bool writeFile(const char* path, const char* text)
+{
+	FILE* file = NULL;
+	if (fopen_s(&file, path, "w") != 0 || !file)
+	{
+		return false;
+	}
+	fputs(text, file);
+	fclose(file);
+	return true;
+}
+
+static void testCollisionMesh()
+{
+	const char* path = "MinimalTurbulenceTests.obj";
+
+	// a quad with texture and normal indices, and a triangle with negative indices
+	CHECK(writeFile(path,
+		"# test mesh\n"
+		"v 0 0 0\n"
+		"v 1 0 0\n"
+		"v\t1 1 0\n"
+		"v 0 1 0\n"
+		"vt 0 0\n"
+		"vn 0 0 1\n"
+		"f 1/1/1 2/1/1 3//1 4\n"
+		"v 0 0 1\n"
+		"f -1 -4 -3\n"));
+	AppCollisionMesh mesh;
+	CHECK(mesh.loadObj(path));
+	CHECK(mesh.points.size() == 5);
+	CHECK(mesh.getTriangleCount() == 3);
+	if (mesh.indices.size() == 9)
+	{
+		const PxU32 expected[9] = { 0, 1, 2, 0, 2, 3, 4, 1, 2 };
+		CHECK(memcmp(&mesh.indices[0], expected, sizeof(expected)) == 0);
+	}
+	CHECK(nearlyEqual(mesh.points[2], PxVec3(1.0f, 1.0f, 0.0f)));
+
+	// an index past the vertices read so far, a face with two corners, no faces at all
+	const char* malformed[] = { "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 4\nv 1 1 1\n", "v 0 0 0\nv 1 0 0\nf 1 2\n", "v 0 0 0\n", "v 0 0\nf 1 1 1\n" };
+	for (PxU32 i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++)
+	{
+		CHECK(writeFile(path, malformed[i]));
+		AppCollisionMesh rejected;
+		CHECK(!rejected.loadObj(path));
+	}
+	remove(path);
+
+	AppCollisionMesh missing;
+	CHECK(!missing.loadObj("MinimalTurbulenceTests.missing.obj"));
+}
+
+// Notes the order it ran in and the thread it ran on
+class OrderJob : public AppWorkerPool::Job
+{
+public:
+	OrderJob(volatile LONG& counter)
+		: order(0)
+		, thread(0)
+		, runs(0)
+		, mCounter(counter)
+	{}
+
+	void execute()
+	{
+		Sleep(1);
+		thread = GetCurrentThreadId();
+		order = InterlockedIncrement(&mCounter);
+		runs++;
+	}
+
+	LONG	order;
+	DWORD	thread;
+	PxU32	runs;
+
+private:
+	OrderJob& operator=(const OrderJob&);
+
+	volatile LONG&	mCounter;
+};
+
+static void testJobGraph(AppWorkerPool& pool)
+{
+	volatile LONG counter = 0;
+	OrderJob a(counter), b(counter), c(counter), d(counter), e(counter);
+
+	//   a -> b (main) -> d (main)
+	//   a -> c -------/
+	//   e, independent
+	AppJobGraph graph;
+	PxU32 ia = graph.addJob("a", a, false);
+	PxU32 ib = graph.addJob("b", b, true);
+	PxU32 ic = graph.addJob("c", c, false);
+	PxU32 id = graph.addJob("d", d, true);
+	graph.addJob("e", e, false);
+	graph.addDependency(ib, ia);
+	graph.addDependency(ic, ia);
+	graph.addDependency(id, ib);
+	graph.addDependency(id, ic);
+	CHECK(graph.getJobCount() == 5);
+	CHECK(!strcmp(graph.getJobName(ic), "c"));
+
+	for (PxU32 run = 0; run < 3; run++)
+	{
+		graph.run(pool);
+		CHECK(a.order < b.order && a.order < c.order);
+		CHECK(b.order < d.order && c.order < d.order);
+		CHECK(b.thread == GetCurrentThreadId() && d.thread == GetCurrentThreadId());
+	}
+	CHECK(a.runs == 3 && b.runs == 3 && c.runs == 3 && d.runs == 3 && e.runs == 3);
+	CHECK(counter == 15);
+
+	// the critical path runs from a to d, through b or c
+	std::string path = graph.describeCriticalPath();
+	CHECK(path.compare(0, 2, "a ") == 0);
+	CHECK(path.find(" > d ") != std::string::npos);
+	CHECK(graph.getCriticalPathMs() >= graph.getJobMs(ia) + graph.getJobMs(id));
+	CHECK(graph.getCriticalPathMs() <= graph.getWallMs() + 1e-3);
+
+	// a run ends with a worker job and the graph goes away right after it, every time
+	bool finished = true;
+	for (PxU32 run = 0; run < 50; run++)
+	{
+		OrderJob first(counter), last(counter);
+		AppJobGraph shortLived;
+		PxU32 ifirst = shortLived.addJob("first", first, true);
+		PxU32 ilast = shortLived.addJob("last", last, false);
+		shortLived.addDependency(ilast, ifirst);
+		shortLived.run(pool);
+		finished = finished && first.runs == 1 && last.runs == 1 && first.order < last.order;
+	}
+	CHECK(finished);
+
+	AppJobGraph empty;
+	empty.run(pool);
+	CHECK(empty.getWallMs() == 0.0);
+}
+
+int main(int /*argc*/, char** /*argv*/)
+{
+	AppWorkerPool pool;
+	if (!pool.start(3))
+	{
+		printf("Error starting the worker pool\n");
+		return 1;
+	}
+
+	testOptions();
+	testVolumeExporter();
+	testRadixSort(pool);
+	testSparseVelocityGrid(pool);
+	testCpuParticles(pool);
+	testParticleReorder(pool);
+	testWindField(pool);
+	testSlabDecomposition(pool);
+	testLogRecord();
+	testSpriteConvert();
+	testCamera();
+	testSpriteFrame(pool);
+	testCollisionMesh();
+	testJobGraph(pool);
+
+	pool.stop();
+	printf("%u checks failed\n", gFailures);
+	return int(gFailures);
+}
+
+#endif //PX_WINDOWS